@@ -0,0 +1,142 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/engine/schedulingshards.h"
+
+#include "execution/scheduler/sessionitem.h"
+#include "platform/logging.h"
+
+#include <limits>
+#include <string>
+
+namespace salus {
+
+SchedulingShards::SchedulingShards(size_t numShards)
+{
+    DCHECK_GT(numShards, 0);
+    m_shards.reserve(numShards);
+    for (size_t i = 0; i != numShards; ++i) {
+        m_shards.emplace_back(std::make_unique<Shard>());
+    }
+    // shard 0 is run by the caller of scheduleAll
+    for (size_t i = 1; i < numShards; ++i) {
+        auto &shard = *m_shards[i];
+        shard.thread = std::thread(&SchedulingShards::shardLoop, this, std::ref(shard));
+    }
+    LOG(INFO) << "Scheduling using " << numShards << " shards";
+}
+
+SchedulingShards::~SchedulingShards()
+{
+    m_shouldExit = true;
+    for (auto &shard : m_shards) {
+        shard->hasWork.notify();
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
+    }
+}
+
+size_t SchedulingShards::shardOf(const SessionItem &item, size_t numShards)
+{
+    // See Lamping & Veach, A Fast, Minimal Memory, Consistent Hash Algorithm
+    uint64_t key = std::hash<std::string>{}(item.sessHandle);
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < static_cast<int64_t>(numShards)) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = static_cast<int64_t>((b + 1) * (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+    return static_cast<size_t>(b);
+}
+
+size_t SchedulingShards::scheduleAll(const CandidateList &candidates, const ScheduleFn &fn, bool topOnly)
+{
+    for (auto &shard : m_shards) {
+        shard->ready.clear();
+        shard->scheduled = 0;
+    }
+
+    size_t rank = 0;
+    for (auto &item : candidates) {
+        m_shards[shardOf(*item, m_shards.size())]->ready.emplace_back(rank++, item);
+    }
+
+    m_fn = &fn;
+    // with topOnly, nothing ranked after the first candidate is ever visited
+    m_stopRank = topOnly ? 0 : std::numeric_limits<size_t>::max();
+
+    uint32_t dispatched = 0;
+    for (size_t i = 1; i < m_shards.size(); ++i) {
+        auto &shard = *m_shards[i];
+        if (shard.ready.empty() || shard.ready.front().first > m_stopRank) {
+            continue;
+        }
+        ++dispatched;
+        shard.hasWork.notify();
+    }
+
+    runShard(*m_shards[0]);
+
+    m_done.wait(dispatched);
+    m_fn = nullptr;
+
+    size_t scheduled = 0;
+    for (auto &shard : m_shards) {
+        // release session references early
+        shard->ready.clear();
+        scheduled += shard->scheduled;
+    }
+    return scheduled;
+}
+
+void SchedulingShards::shardLoop(Shard &shard)
+{
+    while (true) {
+        shard.hasWork.wait();
+        if (m_shouldExit) {
+            break;
+        }
+        runShard(shard);
+        m_done.notify();
+    }
+}
+
+void SchedulingShards::runShard(Shard &shard)
+{
+    for (auto &[rank, item] : shard.ready) {
+        if (rank > m_stopRank.load(std::memory_order_acquire)) {
+            break;
+        }
+
+        auto [count, shouldContinue] = (*m_fn)(item);
+        shard.scheduled += count;
+
+        if (!shouldContinue) {
+            // lower the stop rank to ours, so others won't start anything after us
+            auto curr = m_stopRank.load(std::memory_order_relaxed);
+            while (rank < curr && !m_stopRank.compare_exchange_weak(curr, rank, std::memory_order_acq_rel)) {
+            }
+            break;
+        }
+    }
+}
+
+} // namespace salus
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_EXEC_SCHEDULINGSHARDS_H
+#define SALUS_EXEC_SCHEDULINGSHARDS_H
+
+#include "utils/threadutils.h"
+
+#include <boost/container/small_vector.hpp>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct SessionItem;
+using PSessionItem = std::shared_ptr<SessionItem>;
+
+namespace salus {
+
+/**
+ * @brief Runs one scheduling iteration over candidate sessions on multiple threads.
+ *
+ * Sessions are partitioned across shards by a consistent hash of the session handle, so a
+ * session is always scheduled by the same shard as long as the number of shards doesn't
+ * change. Each shard has its own ready list and scheduling thread. The calling thread acts
+ * as shard 0. Resource conflicts across shards are arbitrated by ResourceMonitor when
+ * pre-allocating for operations.
+ */
+class SchedulingShards
+{
+public:
+    explicit SchedulingShards(size_t numShards);
+    ~SchedulingShards();
+
+    SALUS_DISALLOW_COPY_AND_ASSIGN(SchedulingShards);
+
+    using CandidateList = boost::container::small_vector_base<PSessionItem>;
+    /**
+     * @brief Called for each candidate, returns number of tasks scheduled and whether should
+     * continue to next candidate. Must be safe to call concurrently for different sessions.
+     */
+    using ScheduleFn = std::function<std::pair<size_t, bool>(const PSessionItem &)>;
+
+    /**
+     * @brief Schedule from all candidates and wait for all shards to finish.
+     *
+     * Candidates are visited in their order within a shard. Once `fn` asks to stop at some
+     * candidate, no shard will start visiting candidates ranked after it. Candidates ranked
+     * after it that were already being visited concurrently are not affected.
+     *
+     * If `topOnly` is set, only the top-ranked candidate is visited, matching a sequential
+     * pass whose policy always stops after the first candidate (i.e. not work conserving).
+     *
+     * @returns total number of tasks scheduled
+     */
+    size_t scheduleAll(const CandidateList &candidates, const ScheduleFn &fn, bool topOnly = false);
+
+    size_t numShards() const
+    {
+        return m_shards.size();
+    }
+
+    /**
+     * @brief Jump consistent hash of session to shard index in range [0, numShards)
+     */
+    static size_t shardOf(const SessionItem &item, size_t numShards);
+
+private:
+    struct Shard
+    {
+        std::vector<std::pair<size_t, PSessionItem>> ready;
+        size_t scheduled = 0;
+        sstl::notification hasWork;
+        std::thread thread;
+    };
+
+    void shardLoop(Shard &shard);
+    void runShard(Shard &shard);
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+
+    // State for current iteration
+    const ScheduleFn *m_fn = nullptr;
+    std::atomic_size_t m_stopRank{0};
+    sstl::semaphore m_done;
+    std::atomic_bool m_shouldExit{false};
+};
+
+} // namespace salus
+
+#endif // SALUS_EXEC_SCHEDULINGSHARDS_H
@@ -21,12 +21,20 @@
 
 #include "execution/engine/resourcecontext.h"
 #include "execution/engine/iterationcontext.h"
+#include "execution/engine/schedulingshards.h"
 #include "execution/operationtask.h"
 #include "resources/resources.h"
 #include "execution/threadpool/threadpool.h"
 #include "execution/scheduler/basescheduler.h"
 #include "execution/scheduler/operationitem.h"
 #include "utils/date.h"
+#include "utils/envutils.h"
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
@@ -71,8 +79,61 @@ void reportNoProgress(bool noProgress)
     }
 }
 
+#if defined(SALUS_ENABLE_PARALLEL_SCHED)
+size_t numSchedulingShards()
+{
+    auto def = std::max(std::thread::hardware_concurrency() / 4, 1u);
+    auto num = sstl::fromEnvVar("SALUS_SCHED_SHARDS", def);
+    return std::max(num, 1u);
+}
+#endif
+
+// Innermost active batch on this thread
+thread_local TaskExecutor::SubmitBatch *CurrentBatch = nullptr;
+
+// The task running on this worker, if any
+struct RunningTask
+{
+    const TaskExecutor *exec = nullptr;
+    std::shared_ptr<TaskHandoff> *handoff = nullptr;
+};
+thread_local RunningTask CurrentTask;
+
 } // namespace
 
+/**
+ * @brief Successors queued by a running task. Until the task returns, runTask leaves their
+ * closures here instead of the pool, and the worker then runs them next.
+ */
+class TaskHandoff
+{
+public:
+    /**
+     * @returns false if already closed, in which case c is left untouched.
+     */
+    bool offer(ThreadPool::Closure &c)
+    {
+        auto g = sstl::with_guard(m_mu);
+        if (m_closed) {
+            return false;
+        }
+        m_closures.emplace_back(std::move(c));
+        return true;
+    }
+
+    std::vector<ThreadPool::Closure> close()
+    {
+        auto g = sstl::with_guard(m_mu);
+        m_closed = true;
+        return std::move(m_closures);
+    }
+
+private:
+    std::mutex m_mu;
+    bool m_closed = false;
+    std::vector<ThreadPool::Closure> m_closures;
+};
+
 TaskExecutor::TaskExecutor(ThreadPool &pool, ResourceMonitor &resMonitor, SchedulingParam &param)
     : m_resMonitor(resMonitor)
     , m_pool(pool)
@@ -128,6 +189,15 @@ void TaskExecutor::queueTask(POpItem &&opItem)
         return;
     }
 
+    if (CurrentTask.exec == this) {
+        // queued by a task still running on this worker, which will also run this one
+        auto &handoff = *CurrentTask.handoff;
+        if (!handoff) {
+            handoff = std::make_shared<TaskHandoff>();
+        }
+        opItem->handoff = handoff;
+    }
+
     item->queueTask(std::move(opItem));
     m_note_has_work.notify();
 }
@@ -146,6 +216,14 @@ void TaskExecutor::scheduleLoop()
     boost::container::small_vector<PSessionItem, 5> candidates;
     bool interrupted = false;
 
+#if defined(SALUS_ENABLE_PARALLEL_SCHED)
+    std::unique_ptr<SchedulingShards> shards;
+    auto numShards = numSchedulingShards();
+    if (numShards > 1) {
+        shards = std::make_unique<SchedulingShards>(numShards);
+    }
+#endif
+
     while (!m_shouldExit) {
         SessionChangeSet changeset;
         // First accept and append any new sessions
@@ -263,6 +341,10 @@ void TaskExecutor::scheduleLoop()
 
         // Select and sort candidates.
         scheduler->notifyPreSchedulingIteration(m_sessions, changeset, &candidates);
+        // Priority classes take precedence over any policy, which only orders within a class.
+        std::stable_sort(candidates.begin(), candidates.end(), [](const auto &lhs, const auto &rhs) {
+            return lhs->effectivePriority() > rhs->effectivePriority();
+        });
 
         // Deleted sessions are no longer needed, release them.
         changeset.deletedSessions.clear();
@@ -271,6 +353,26 @@ void TaskExecutor::scheduleLoop()
         // NOTE: remainingCount only counts for candidate sessions in this sched iter.
         size_t remainingCount = 0;
         size_t scheduled = 0;
+#if defined(SALUS_ENABLE_PARALLEL_SCHED)
+        if (shards && candidates.size() > 1) {
+            std::atomic_size_t visitedRemaining{0};
+            // A policy that isn't work conserving stops after the top candidate, so letting other
+            // shards run their own candidates would schedule sessions a sequential pass never visits.
+            const bool topOnly = !m_schedParam.workConservative;
+            auto fn = [&scheduler, &visitedRemaining](const PSessionItem &item) {
+                VLOG(3) << "Scheduling all opItem in session " << item->sessHandle << ": queue size "
+                        << item->bgQueue.size();
+
+                // Try schedule from this session, which is only visited by this shard
+                auto res = scheduler->maybeScheduleFrom(item);
+                item->lastScheduled = res.first;
+                visitedRemaining.fetch_add(item->bgQueue.size(), std::memory_order_relaxed);
+                return res;
+            };
+            scheduled = shards->scheduleAll(candidates, fn, topOnly);
+            remainingCount = visitedRemaining.load(std::memory_order_relaxed);
+        } else
+#endif
         for (auto &item : candidates) {
             VLOG(3) << "Scheduling all opItem in session " << item->sessHandle << ": queue size "
                     << item->bgQueue.size();
@@ -366,18 +468,22 @@ POpItem TaskExecutor::runTask(POpItem &&opItem)
     }
 
     // NOTE: this is waited by schedule thread, so we can't afford running
-    // the operation inline. If the thread pool is full, simply consider the
-    // opItem as not scheduled.
+    // the operation inline. Full per-thread queues spill to the pool's overflow
+    // queue, so tryRun only gives the closure back when the pool is stopped,
+    // in which case simply consider the opItem as not scheduled.
 
-    // opItem has to be captured by value, we need it in case the thread pool is full
-    auto c = m_pool.tryRun([opItem, this]() mutable {
+    // opItem has to be captured by value, we need it in case the thread pool is stopped
+    ThreadPool::Closure task = [opItem, this]() mutable {
         DCHECK(opItem);
 
         if (auto item = opItem->sess.lock()) {
+            item->homeNode.store(m_pool.currentNode(), std::memory_order_relaxed);
+
             OperationTask::Callbacks cbs;
 
             // capture an session item untile done
-            cbs.done = [item, opItem, this]() {
+            cbs.done = [item, opItem, this, start = system_clock::now()]() {
+                item->usedComputeTime += duration_cast<microseconds>(system_clock::now() - start).count();
                 // succeed
                 taskStopped(*opItem, false);
             };
@@ -403,9 +509,40 @@ POpItem TaskExecutor::runTask(POpItem &&opItem)
 
             VLOG(2) << "Running opItem in session " << item->sessHandle << ": " << opItem->op;
             taskRunning(*opItem);
+
+            std::shared_ptr<TaskHandoff> handoff;
+            auto prev = std::exchange(CurrentTask, {this, &handoff});
             opItem->op->run(std::move(cbs));
+            CurrentTask = prev;
+
+            if (handoff) {
+                // successors admitted while op ran, their inputs are still hot in this core's cache
+                for (auto &c : handoff->close()) {
+                    c = m_pool.tryRunNext(std::move(c), item->workPriority());
+                    if (c) {
+                        // pool stopped
+                        c();
+                    }
+                }
+            }
         }
-    });
+    };
+
+    if (auto handoff = std::move(opItem->handoff); handoff && handoff->offer(task)) {
+        // the closure keeps opItem
+        return nullptr;
+    }
+
+    if (CurrentBatch && &CurrentBatch->m_exec == this) {
+        // the batch keeps opItem until the thread pool accepts the task
+        auto &group = CurrentBatch->group(item->workPriority(), item->homeNode.load(std::memory_order_relaxed));
+        group.closures.emplace_back(std::move(task));
+        group.items.emplace_back(std::move(opItem));
+        return nullptr;
+    }
+
+    auto c = m_pool.tryRunOnNode(std::move(task), item->homeNode.load(std::memory_order_relaxed),
+                                 item->workPriority());
     if (!c) {
         // successfully sent to thread pool, we can reset opItem
         opItem.reset();
@@ -413,6 +550,56 @@ POpItem TaskExecutor::runTask(POpItem &&opItem)
     return std::move(opItem);
 }
 
+TaskExecutor::SubmitBatch::SubmitBatch(TaskExecutor &exec)
+    : m_exec(exec)
+    , m_prev(CurrentBatch)
+{
+    CurrentBatch = this;
+}
+
+TaskExecutor::SubmitBatch::~SubmitBatch()
+{
+    for (auto &opItem : flush()) {
+        // no one to hand them back to
+        VLOG(2) << "Canceling opItem rejected by stopped thread pool: " << opItem->op;
+        opItem->op->cancel();
+    }
+}
+
+std::vector<POpItem> TaskExecutor::SubmitBatch::flush()
+{
+    std::vector<POpItem> rejected;
+    if (m_flushed) {
+        return rejected;
+    }
+    m_flushed = true;
+    CurrentBatch = m_prev;
+
+    // From high priority to low, so higher priority tasks are queued first
+    for (size_t p = 0; p != m_groups.size(); ++p) {
+        for (auto &group : m_groups[p]) {
+            if (!m_exec.m_pool.runBulkOnNode(group.closures, group.node, static_cast<ThreadPool::Priority>(p))) {
+                // pool stopped, the closures only hold extra references to the opItems
+                group.closures.clear();
+                std::move(group.items.begin(), group.items.end(), std::back_inserter(rejected));
+            }
+        }
+        m_groups[p].clear();
+    }
+    return rejected;
+}
+
+TaskExecutor::SubmitBatch::NodeGroup &TaskExecutor::SubmitBatch::group(ThreadPool::Priority p, int node)
+{
+    // Only a few nodes, a linear search is enough
+    auto &groups = m_groups[static_cast<size_t>(p)];
+    auto it = std::find_if(groups.begin(), groups.end(), [node](const auto &g) { return g.node == node; });
+    if (it != groups.end()) {
+        return *it;
+    }
+    return groups.emplace_back(NodeGroup{node, {}, {}});
+}
+
 void TaskExecutor::taskRunning(OperationItem &opItem)
 {
     LogOpTracing() << "OpItem Event " << opItem.op << " event: running";
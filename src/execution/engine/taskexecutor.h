@@ -21,16 +21,17 @@
 #define SALUS_EXEC_TASKEXECUTOR_H
 
 #include "execution/scheduler/schedulingparam.h"
+#include "execution/threadpool/threadpool.h"
 #include "resources/resources.h"
 #include "utils/threadutils.h"
 
+#include <array>
 #include <atomic>
 #include <thread>
 #include <list>
 #include <memory>
 
 class ResourceMonitor;
-class ThreadPool;
 struct SessionItem;
 using PSessionItem = std::shared_ptr<SessionItem>;
 struct OperationItem;
@@ -62,6 +63,11 @@ public:
         return m_schedParam;
     }
 
+    const ResourceMonitor &resourceMonitor() const
+    {
+        return m_resMonitor;
+    }
+
     void insertSession(PSessionItem sess);
 
     /**
@@ -82,6 +88,49 @@ public:
     // actually run task
     POpItem runTask(POpItem &&opItem);
 
+    /**
+     * @brief Collects tasks started by runTask on the current thread until flushed,
+     * and sends them to the thread pool as one batch. The batch owns the opItems until
+     * the pool accepts their tasks.
+     */
+    class SubmitBatch
+    {
+    public:
+        explicit SubmitBatch(TaskExecutor &exec);
+        /**
+         * @brief Flushes if not yet flushed. Tasks rejected at this point are canceled.
+         */
+        ~SubmitBatch();
+
+        SubmitBatch(const SubmitBatch &) = delete;
+        SubmitBatch &operator=(const SubmitBatch &) = delete;
+
+        /**
+         * @brief Stop collecting and send collected tasks to the thread pool.
+         * @returns opItems whose tasks were rejected because the pool is stopped. Like a
+         * non-null return value of runTask, they are not scheduled.
+         */
+        std::vector<POpItem> flush();
+
+    private:
+        friend class TaskExecutor;
+
+        // Tasks for the same NUMA node, sent to the pool together
+        struct NodeGroup
+        {
+            int node;
+            std::vector<ThreadPool::Closure> closures;
+            std::vector<POpItem> items;
+        };
+
+        NodeGroup &group(ThreadPool::Priority p, int node);
+
+        TaskExecutor &m_exec;
+        SubmitBatch *m_prev;
+        bool m_flushed = false;
+        std::array<std::vector<NodeGroup>, ThreadPool::kNumPriorities> m_groups;
+    };
+
     void deleteSession(PSessionItem item);
 
 private:
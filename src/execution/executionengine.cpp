@@ -24,6 +24,8 @@
 #include "execution/engine/iterationcontext.h"
 #include "execution/engine/resourcecontext.h"
 #include "execution/iterationtask.h"
+#include "execution/steptrace.h"
+#include "execution/threadpool/cpubudget.h"
 #include "platform/logging.h"
 #include "utils/containerutils.h"
 #include "utils/date.h"
@@ -37,6 +39,7 @@
 #include <functional>
 #include <iomanip>
 #include <unordered_map>
+#include <utility>
 
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
@@ -50,6 +53,21 @@ using namespace date;
 
 namespace salus {
 
+namespace {
+
+ThreadPoolOptions poolOptions()
+{
+    // Start with our share of the CPU budget, but leave room to grow when rebalancing
+    auto &budget = CpuBudget::instance();
+    ThreadPoolOptions opts;
+    opts.numThreads = budget.limit(CpuBudget::Pool::Engine);
+    opts.activeThreads = budget.share(CpuBudget::Pool::Engine);
+    opts.pinThreads = sstl::fromEnvVar("SALUS_POOL_PIN_THREADS", false);
+    return opts;
+}
+
+} // namespace
+
 ExecutionEngine &ExecutionEngine::instance()
 {
     static ExecutionEngine eng;
@@ -57,7 +75,8 @@ ExecutionEngine &ExecutionEngine::instance()
 }
 
 ExecutionEngine::ExecutionEngine()
-    : m_taskExecutor(m_pool, m_resMonitor, m_schedParam)
+    : m_pool(poolOptions())
+    , m_taskExecutor(m_pool, m_resMonitor, m_schedParam)
 {
 }
 
@@ -66,6 +85,10 @@ void ExecutionEngine::startScheduler()
     m_resMonitor.initializeLimits();
     m_taskExecutor.startExecution();
 
+    CpuBudget::instance().attach(
+        CpuBudget::Pool::Engine, [this]() { return m_pool.pendingTasks(); },
+        [this](size_t n) { m_pool.setActiveThreads(n); });
+
     m_schedThread = std::make_unique<std::thread>(std::bind(&ExecutionEngine::scheduleLoop, this));
 }
 
@@ -81,6 +104,8 @@ void ExecutionEngine::stopScheduler()
     }
 
     m_taskExecutor.stopExecution();
+
+    CpuBudget::instance().detach(CpuBudget::Pool::Engine);
 }
 
 ExecutionEngine::~ExecutionEngine()
@@ -255,7 +280,16 @@ int ExecutionEngine::scheduleOnQueue(LaneQueue &lctx, IterQueue &staging)
             return false; // B goes first
         }
 
-        return ectxA->m_item->numFinishedIters < ectxB->m_item->numFinishedIters;
+        auto &itemA = *ectxA->m_item;
+        auto &itemB = *ectxB->m_item;
+        if (itemA.effectivePriority() != itemB.effectivePriority()) {
+            return itemA.effectivePriority() > itemB.effectivePriority();
+        }
+
+        // stride scheduling: each finished iter advances the pass by 1/weight
+        auto passA = itemA.numFinishedIters.load() / itemA.weight.load();
+        auto passB = itemB.numFinishedIters.load() / itemB.weight.load();
+        return passA < passB;
     };
 
     auto fairSorter = [](const auto &iterItemA, const auto &iterItemB) {
@@ -268,24 +302,53 @@ int ExecutionEngine::scheduleOnQueue(LaneQueue &lctx, IterQueue &staging)
             return false; // B goes first
         }
 
-        // fairness (equalize time)
-        auto reA = ectxA->m_item->usedRunningTime.load();
-        auto reB = ectxB->m_item->usedRunningTime.load();
+        auto &itemA = *ectxA->m_item;
+        auto &itemB = *ectxB->m_item;
+        if (itemA.effectivePriority() != itemB.effectivePriority()) {
+            return itemA.effectivePriority() > itemB.effectivePriority();
+        }
+
+        // fairness (equalize time weighted by share)
+        auto reA = itemA.usedRunningTime.load() / itemA.weight.load();
+        auto reB = itemB.usedRunningTime.load() / itemB.weight.load();
         return reA < reB;
     };
 
-    if (m_schedParam.scheduler == "fair") {
+    auto prioritySorter = [](const auto &iterItemA, const auto &iterItemB) {
+        std::shared_ptr<ExecutionContext> ectxA = iterItemA.wectx.lock();
+        std::shared_ptr<ExecutionContext> ectxB = iterItemB.wectx.lock();
+        if (!ectxB) {
+            return true; // A goes first
+        }
+        if (!ectxA) {
+            return false; // B goes first
+        }
+        return ectxA->m_item->effectivePriority() > ectxB->m_item->effectivePriority();
+    };
+
+    if (m_schedParam.scheduler == "fair" || m_schedParam.scheduler == "drf") {
+        // iterations only use time on a lane, which is its dominant resource
         staging.sort(fairSorter);
     } else if (m_schedParam.scheduler == "rr") {
         staging.sort(rrSorter);
     } else if (m_schedParam.scheduler == "pack") {
-        // do nothing
+        // only honor priority classes, list::sort is stable
+        staging.sort(prioritySorter);
     } else if (m_schedParam.scheduler == "fifo") {
+        // first session in arrival order among the highest priority class
         PSessionItem sessItem = nullptr;
         auto it = lctx.fifoQueue.begin();
         auto ed = lctx.fifoQueue.end();
-        while (it != ed && !(sessItem = it->lock())) {
-            it = lctx.fifoQueue.erase(it);
+        while (it != ed) {
+            auto s = it->lock();
+            if (!s) {
+                it = lctx.fifoQueue.erase(it);
+                continue;
+            }
+            if (!sessItem || s->effectivePriority() > sessItem->effectivePriority()) {
+                sessItem = std::move(s);
+            }
+            ++it;
         }
         if (sessItem) {
             if (lctx.lastSessionItem != sessItem.get()) {
@@ -319,13 +382,19 @@ int ExecutionEngine::scheduleOnQueue(LaneQueue &lctx, IterQueue &staging)
         staging.clear();
     } else {
         CHECK_EQ(m_schedParam.scheduler, "preempt") << "Unknown scheduler selected: " << m_schedParam.scheduler;
-        // find the sessItem with least remaining time
+        // find the sessItem with least remaining time in the highest priority class
         int64_t minRemainingTime = std::numeric_limits<int64_t>::max();
+        int maxPriority = std::numeric_limits<int>::min();
         PSessionItem sessItem = nullptr;
         for (auto &ws : lctx.sessions) {
             if (auto s = ws.lock()) {
                 auto remain = static_cast<int64_t>(s->totalRunningTime) - static_cast<int64_t>(s->usedRunningTime);
-                if (remain <= minRemainingTime) {
+                auto priority = s->effectivePriority();
+                if (priority > maxPriority) {
+                    maxPriority = priority;
+                    minRemainingTime = std::numeric_limits<int64_t>::max();
+                }
+                if (priority == maxPriority && remain <= minRemainingTime) {
                     minRemainingTime = remain;
                     sessItem = std::move(s);
                 }
@@ -407,12 +476,47 @@ bool ExecutionEngine::checkIter(IterationItem &iterItem, ExecutionContext &, Lan
     return lctx.numExpensiveIterRunning.compare_exchange_weak(zero, 1);
 }
 
+void ExecutionEngine::maybeDonatePriority(ExecutionContext &ectx, LaneQueue &lctx)
+{
+    // A lower priority session holding the lane blocks us, so let it inherit our priority
+    // until its iteration finishes, to avoid priority inversion through held resources.
+    auto g = sstl::with_guard(lctx.holderMu);
+    auto holder = lctx.expensiveHolder.lock();
+    if (!holder || holder == ectx.m_item) {
+        return;
+    }
+    auto waiting = ectx.m_item->effectivePriority();
+    if (holder->priority.load(std::memory_order_relaxed) >= waiting) {
+        return;
+    }
+    auto curr = holder->inheritedPriority.load();
+    while (curr < waiting && !holder->inheritedPriority.compare_exchange_weak(curr, waiting)) {
+    }
+    if (curr < waiting) {
+        lctx.donatedPriority = waiting;
+        VLOG(2) << "Session " << holder->sessHandle << " inherits priority " << waiting << " from session "
+                << ectx.m_item->sessHandle;
+    }
+}
+
+void ExecutionEngine::releaseLane(SessionItem &holder, LaneQueue &lctx)
+{
+    auto g = sstl::with_guard(lctx.holderMu);
+    lctx.expensiveHolder.reset();
+    // Only take back what was donated through this lane, a higher priority donated through
+    // another lane the session still holds stays until that one is released.
+    if (auto donated = std::exchange(lctx.donatedPriority, std::nullopt)) {
+        holder.inheritedPriority.compare_exchange_strong(*donated, SessionItem::kNoInheritedPriority);
+    }
+}
+
 bool ExecutionEngine::runIter(IterationItem &iterItem, ExecutionContext &ectx, LaneQueue &lctx)
 {
     DCHECK(ectx.m_item);
 
     VLOG(2) << "Try iteration " << ectx.m_item->sessHandle << ":" << iterItem.iter->graphId();
     if (!checkIter(iterItem, ectx, lctx)) {
+        maybeDonatePriority(ectx, lctx);
         VLOG(2) << "event: skip_iter "
                 << nlohmann::json({{"sess", ectx.m_item->sessHandle},
                                    {"graphId", iterItem.iter->graphId()},
@@ -429,15 +533,25 @@ bool ExecutionEngine::runIter(IterationItem &iterItem, ExecutionContext &ectx, L
         return false;
     }
 
+    if (const auto &trace = iterItem.iter->trace()) {
+        trace->record(StepTrace::Stage::LaneQueue, StepTrace::nowNs() - iterItem.queuedNs);
+    }
+
     bool expensive = iterItem.iter->isExpensive();
+    if (expensive) {
+        auto g = sstl::with_guard(lctx.holderMu);
+        lctx.expensiveHolder = ectx.m_item;
+    }
 
     auto iCtx = std::make_shared<IterationContext>(m_taskExecutor, ectx.m_item,
-                                                   [&lctx, expensive, start = system_clock::now()](auto &sessItem) {
+                                                   [this, &lctx, expensive, start = system_clock::now()](auto &sessItem) {
                                                        if (expensive) {
                                                            auto usedTime =
                                                                duration_cast<milliseconds>(system_clock::now() - start).count();
                                                            sessItem.usedRunningTime += usedTime;
                                                            ++sessItem.numFinishedIters;
+                                                           // no longer holding the lane
+                                                           releaseLane(sessItem, lctx);
                                                            if (VLOG_IS_ON(1)) {
                                                                LogOpTracing() << "event: sess_add_time " << nlohmann::json({
                                                                    {"sess", sessItem.sessHandle},
@@ -543,7 +657,22 @@ void ExecutionContext::setSessionHandle(const std::string &h)
 
 void ExecutionContext::scheduleIteartion(std::unique_ptr<IterationTask> &&iterTask)
 {
-    m_engine.scheduleIteration({shared_from_this(), std::move(iterTask)});
+    uint64_t queuedNs = 0;
+    {
+        auto g = sstl::with_guard(m_traceMu);
+        if (m_trace) {
+            m_trace->mark(StepTrace::Stage::Setup);
+            iterTask->setTrace(m_trace);
+            queuedNs = StepTrace::nowNs();
+        }
+    }
+    m_engine.scheduleIteration({shared_from_this(), std::move(iterTask), queuedNs});
+}
+
+void ExecutionContext::setCurrentTrace(std::shared_ptr<StepTrace> trace)
+{
+    auto g = sstl::with_guard(m_traceMu);
+    m_trace = std::move(trace);
 }
 
 void ExecutionContext::dropExlusiveMode()
@@ -558,4 +687,20 @@ void ExecutionContext::setExpectedRunningTime(uint64_t time)
     DCHECK(m_item);
     m_item->totalRunningTime = time;
 }
+
+void ExecutionContext::setSchedulingWeight(double weight)
+{
+    DCHECK(m_item);
+    if (weight <= 0) {
+        LOG(WARNING) << "Ignoring non-positive scheduling weight " << weight;
+        return;
+    }
+    m_item->weight = weight;
+}
+
+void ExecutionContext::setPriority(int priority)
+{
+    DCHECK(m_item);
+    m_item->priority = priority;
+}
 } // namespace salus
@@ -40,12 +40,14 @@
 #include <future>
 #include <list>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <set>
 
 namespace salus {
 class IterationTask;
 class ExecutionContext;
+class StepTrace;
 
 class ExecutionEngine
 {
@@ -98,6 +100,8 @@ private:
     {
         std::weak_ptr<ExecutionContext> wectx;
         std::unique_ptr<IterationTask> iter;
+        // When the iteration was queued, only if it is traced
+        uint64_t queuedNs = 0;
     };
 
 
@@ -114,6 +118,11 @@ private:
         std::set<std::weak_ptr<SessionItem>, std::owner_less<std::weak_ptr<SessionItem>>> sessions;
         SessionItem *lastSessionItem = nullptr;
         std::list<std::weak_ptr<SessionItem>> fifoQueue;
+        std::mutex holderMu;
+        // session of the running expensive iteration, cleared when the iteration finishes
+        std::weak_ptr<SessionItem> expensiveHolder GUARDED_BY(holderMu);
+        // priority donated to expensiveHolder while waiting on this lane
+        std::optional<int> donatedPriority GUARDED_BY(holderMu);
     };
 
     IterQueue m_iterQueue GUARDED_BY(m_mu);
@@ -126,6 +135,8 @@ private:
     void scheduleLoop();
     int scheduleOnQueue(LaneQueue &lctx, IterQueue &staging);
     bool checkIter(IterationItem &iterItem, ExecutionContext &ectx, LaneQueue &lctx);
+    void maybeDonatePriority(ExecutionContext &ectx, LaneQueue &lctx);
+    void releaseLane(SessionItem &holder, LaneQueue &lctx);
     bool runIter(IterationItem &iterItem, ExecutionContext &ectx, LaneQueue &lctx);
     bool maybeWaitForAWhile(size_t scheduled);
     void maybeWaitForWork(size_t pending, size_t scheduled);
@@ -140,6 +151,9 @@ class ExecutionContext : public std::enable_shared_from_this<ExecutionContext>
     std::any m_userData;
     uint64_t m_laneId;
 
+    std::mutex m_traceMu;
+    std::shared_ptr<StepTrace> m_trace GUARDED_BY(m_traceMu);
+
     friend class ExecutionEngine;
     /**
      * @brief remove from engine and give up our reference of session item
@@ -157,8 +171,17 @@ public:
         removeFromEngine();
     }
 
+    /**
+     * @brief Queue iterTask to the engine. It is traced as part of the current trace, if any.
+     */
     void scheduleIteartion(std::unique_ptr<IterationTask> &&iterTask);
 
+    /**
+     * @brief Set the trace of the request whose iterations are being scheduled, nullptr when there is none.
+     * The session must not schedule iterations for more than one request at a time.
+     */
+    void setCurrentTrace(std::shared_ptr<StepTrace> trace);
+
     void registerPagingCallbacks(PagingCallbacks &&pcb);
     void setInterruptCallback(std::function<void()> cb);
 
@@ -188,6 +211,16 @@ public:
 
     void setExpectedRunningTime(uint64_t time);
 
+    /**
+     * @brief Set relative share of the session, used by weighted and stride scheduling
+     */
+    void setSchedulingWeight(double weight);
+
+    /**
+     * @brief Set priority class of the session, higher class is always scheduled first
+     */
+    void setPriority(int priority);
+
     /**
      * @brief Make a resource context that first allocate from session's resources
      * @param spec
@@ -23,11 +23,13 @@
 #include "resources/resources.h"
 #include "utils/pointerutils.h"
 
+#include <memory>
 #include <string>
 
 namespace salus {
 class IterationContext;
 class ExecutionEngine;
+class StepTrace;
 class IterationTask
 {
 public:
@@ -46,6 +48,22 @@ public:
     virtual bool isCanceled() const = 0;
 
     virtual bool isExpensive() const = 0;
+
+    /**
+     * @returns the trace of the request this iteration runs for, or nullptr if it isn't traced
+     */
+    const std::shared_ptr<StepTrace> &trace() const
+    {
+        return m_trace;
+    }
+
+    void setTrace(std::shared_ptr<StepTrace> trace)
+    {
+        m_trace = std::move(trace);
+    }
+
+private:
+    std::shared_ptr<StepTrace> m_trace;
 };
 
 } // namespace salus
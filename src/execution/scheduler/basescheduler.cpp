@@ -120,8 +120,7 @@ bool BaseScheduler::maybePreAllocateFor(OperationItem &opItem, const DeviceSpec
         return false;
     }
 
-    auto g = sstl::with_guard(item->tickets_mu);
-    item->tickets.insert(ticket);
+    item->registerTicket(ticket);
     return true;
 }
 
@@ -148,6 +147,11 @@ bool BaseScheduler::insufficientMemory(const DeviceSpec &spec)
     return true;
 }
 
+Resources BaseScheduler::resourceCapacity() const
+{
+    return m_taskExec.resourceMonitor().capacity();
+}
+
 std::string BaseScheduler::debugString(const PSessionItem &item) const
 {
     UNUSED(item);
@@ -222,32 +226,19 @@ size_t BaseScheduler::submitAllTaskFromQueue(const PSessionItem &item)
         SessionItem::UnsafeQueue stage;
         stage.swap(queue);
 
-#if defined(SALUS_ENABLE_PARALLEL_SCHED)
-        // Do all schedule in queue in parallel
-        std::vector<std::future<std::shared_ptr<OperationItem>>> futures;
-        futures.reserve(stage.size());
-        for (auto &opItem : stage) {
-            auto fu = m_taskExec.pool().post([opItem = std::move(opItem), this]() mutable {
-                DCHECK(opItem);
-                return submitTask(std::move(opItem));
-            });
-            futures.emplace_back(std::move(fu));
-        }
+        // Send everything started here to the thread pool at once, with a single wake up
+        TaskExecutor::SubmitBatch batch(m_taskExec);
 
-        for (auto &fu : futures) {
-            auto poi = fu.get();
-            if (poi) {
-                queue.emplace_back(std::move(poi));
-            }
-        }
-#else
         for (auto &opItem : stage) {
             auto poi = submitTask(std::move(opItem));
             if (poi) {
                 queue.emplace_back(std::move(poi));
             }
         }
-#endif
+        // Tasks rejected by the thread pool are not scheduled, same as submitTask returning them
+        for (auto &poi : batch.flush()) {
+            queue.emplace_back(std::move(poi));
+        }
         VLOG(2) << "All opItem in session " << item->sessHandle << " examined";
 
         scheduled = size - queue.size();
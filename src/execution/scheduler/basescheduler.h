@@ -130,6 +130,10 @@ protected:
      */
     size_t submitAllTaskFromQueue(const PSessionItem &item);
 
+    /**
+     * @brief Total resources managed by the task executor
+     */
+    Resources resourceCapacity() const;
 
     /**
      * @brief Missing resources per operation in this iteration.
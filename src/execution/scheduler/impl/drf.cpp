@@ -0,0 +1,147 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "drf.h"
+
+#include "execution/scheduler/operationitem.h"
+#include "execution/operationtask.h"
+#include "utils/macros.h"
+#include "platform/logging.h"
+#include "utils/envutils.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+using namespace salus;
+
+namespace {
+SchedulerRegistary::Register reg("drf", [](auto &engine) {
+    return std::make_unique<DRFScheduler>(engine);
+});
+
+// Weight of the newest sample in the smoothed compute share
+constexpr double kComputeAlpha = 0.3;
+
+} // namespace
+
+DRFScheduler::DRFScheduler(TaskExecutor &engine)
+    : BaseScheduler(engine)
+    , m_capacity(resourceCapacity())
+{
+}
+
+DRFScheduler::~DRFScheduler() = default;
+
+std::string DRFScheduler::name() const
+{
+    return "drf";
+}
+
+void DRFScheduler::notifyPreSchedulingIteration(const SessionList &sessions,
+                                                const SessionChangeSet &changeset,
+                                                sstl::not_null<CandidateList *> candidates)
+{
+    BaseScheduler::notifyPreSchedulingIteration(sessions, changeset, candidates);
+
+    candidates->clear();
+
+    // Remove old sessions
+    for (auto &sess : changeset.deletedSessions) {
+        m_shares.erase(sess->sessHandle);
+    }
+
+    // Compute time used by all sessions since last iteration. Tasks keep finishing on workers,
+    // so read each counter once and use the same value for the total and the share.
+    std::vector<uint64_t> computeTimes;
+    computeTimes.reserve(sessions.size());
+    uint64_t totalComputeDelta = 0;
+    for (auto &sess : sessions) {
+        auto &share = m_shares[sess->sessHandle];
+        computeTimes.emplace_back(sess->usedComputeTime.load());
+        totalComputeDelta += computeTimes.back() - share.lastComputeTime;
+    }
+
+    auto computeTime = computeTimes.begin();
+    for (auto &sess : sessions) {
+        candidates->emplace_back(sess);
+        updateShare(*sess, m_shares[sess->sessHandle], *computeTime++, totalComputeDelta);
+    }
+
+    // We assume m_sessions.size() is always no more than a few,
+    // therefore sorting in every iteration is acceptable.
+    using std::sort;
+    sort(candidates->begin(), candidates->end(), [this](const auto &lhs, const auto &rhs) {
+        return m_shares.at(lhs->sessHandle).dominant < m_shares.at(rhs->sessHandle).dominant;
+    });
+}
+
+void DRFScheduler::updateShare(const SessionItem &item, Share &share, uint64_t computeTime,
+                               uint64_t totalComputeDelta) const
+{
+    if (totalComputeDelta > 0) {
+        auto delta = computeTime - share.lastComputeTime;
+        auto sample = static_cast<double>(delta) / totalComputeDelta;
+        share.compute = kComputeAlpha * sample + (1 - kComputeAlpha) * share.compute;
+    }
+    share.lastComputeTime = computeTime;
+
+    double dominant = share.compute;
+    share.dominantResource = "compute";
+    item.forEachUsage([&](const ResourceTag &tag, uint64_t usage) {
+        auto cap = sstl::getOrDefault(m_capacity, tag, 0);
+        if (cap == 0) {
+            return;
+        }
+        auto s = static_cast<double>(usage) / cap;
+        if (s > dominant) {
+            dominant = s;
+            share.dominantResource = tag.DebugString();
+        }
+    });
+
+    auto weight = item.weight.load(std::memory_order_relaxed);
+    weight = weight > 0 ? weight : 1.0;
+    share.dominant = dominant / weight;
+}
+
+std::pair<size_t, bool> DRFScheduler::maybeScheduleFrom(PSessionItem item)
+{
+    auto scheduled = submitAllTaskFromQueue(item);
+
+    return reportScheduleResult(scheduled);
+}
+
+std::pair<size_t, bool> DRFScheduler::reportScheduleResult(size_t scheduled) const
+{
+    static auto workConservative = m_taskExec.schedulingParam().workConservative;
+    // the session with the least dominant share is scheduled solely
+    // unless it has nothing to run
+    return {scheduled, workConservative && scheduled == 0};
+}
+
+std::string DRFScheduler::debugString(const PSessionItem &item) const
+{
+    std::ostringstream oss;
+    auto it = m_shares.find(item->sessHandle);
+    if (it != m_shares.end()) {
+        oss << "dominant: " << it->second.dominant << " (" << it->second.dominantResource << ")";
+    }
+    return oss.str();
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_EXEC_SCHED_DRF_H
+#define SALUS_EXEC_SCHED_DRF_H
+
+#include "execution/scheduler/basescheduler.h"
+
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief Weighted Dominant Resource Fairness.
+ *
+ * Sessions are ordered by their dominant share divided by weight. A session's share of a
+ * resource is its current usage over the total capacity, considering every resource tracked
+ * in SessionItem, plus its share of compute time measured since the last scheduling iteration.
+ * Resources with zero capacity are ignored, so without GPU (e.g. SALUS_SCHED_USE_GPU=0), the
+ * policy works on CPU memory and compute time only.
+ */
+class DRFScheduler : public BaseScheduler
+{
+public:
+    explicit DRFScheduler(salus::TaskExecutor &engine);
+    ~DRFScheduler() override;
+
+    std::string name() const override;
+
+    void notifyPreSchedulingIteration(const SessionList &sessions,
+                                      const SessionChangeSet &changeset,
+                                      sstl::not_null<CandidateList *> candidates) override;
+    std::pair<size_t, bool> maybeScheduleFrom(PSessionItem item) override;
+
+    using BaseScheduler::debugString;
+    std::string debugString(const PSessionItem &item) const override;
+
+private:
+    std::pair<size_t, bool> reportScheduleResult(size_t scheduled) const;
+
+    struct Share
+    {
+        uint64_t lastComputeTime = 0;
+        // smoothed fraction of compute time used
+        double compute = 0;
+        // weighted dominant share
+        double dominant = 0;
+        std::string dominantResource;
+    };
+
+    void updateShare(const SessionItem &item, Share &share, uint64_t computeTime, uint64_t totalComputeDelta) const;
+
+    Resources m_capacity;
+    std::unordered_map<std::string, Share> m_shares;
+};
+
+#endif // SALUS_EXEC_SCHED_DRF_H
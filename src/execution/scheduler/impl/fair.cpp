@@ -25,6 +25,7 @@
 #include "utils/date.h"
 #include "platform/logging.h"
 #include "utils/envutils.h"
+#include "utils/containerutils.h"
 
 #include <chrono>
 #include <sstream>
@@ -60,49 +61,33 @@ void FairScheduler::notifyPreSchedulingIteration(const SessionList &sessions,
                                                  const SessionChangeSet &changeset,
                                                  sstl::not_null<CandidateList *> candidates)
 {
-    static auto lastSnapshotTime = system_clock::now();
-
     BaseScheduler::notifyPreSchedulingIteration(sessions, changeset, candidates);
 
     candidates->clear();
 
-    // Remove old sessions
-    for (auto &sess : changeset.deletedSessions) {
-        aggResUsages.erase(sess->sessHandle);
+    for (auto it = changeset.addedSessionBegin; it != changeset.addedSessionEnd; ++it) {
+        LOG(DEBUG) << "Adding session " << (*it)->sessHandle;
     }
 
-    // Sort sessions if needed. When there is addition, counters are reset thus no need to sort.
-    // Snapshot resource usage counter first, or reset them
-    if (changeset.numAddedSessions == 0) {
-        auto now = system_clock::now();
-        auto sSinceLastSnapshot = FpSeconds(now - lastSnapshotTime).count();
-        lastSnapshotTime = now;
-        for (auto &sess : sessions) {
-            candidates->emplace_back(sess);
-            // calculate progress counter increase since last snapshot
-            size_t mem = sess->resourceUsage(resources::GPU0Memory);
-            aggResUsages[sess->sessHandle] += mem * sSinceLastSnapshot;
-        }
-
-        // We assume m_sessions.size() is always no more than a few,
-        // therefore sorting in every iteration is acceptable.
-        using std::sort;
-        sort(candidates->begin(), candidates->end(), [this](const auto &lhs, const auto &rhs) {
-            return aggResUsages.at(lhs->sessHandle) < aggResUsages.at(rhs->sessHandle);
-        });
-    } else {
-        for (auto it = changeset.addedSessionBegin; it != changeset.addedSessionEnd; ++it) {
-            LOG(DEBUG) << "Adding session " << (*it)->sessHandle;
-        }
-        // clear to reset everything to zero.
-        aggResUsages.clear();
-        aggResUsages.reserve(sessions.size());
-        for (auto &sess : sessions) {
-            candidates->emplace_back(sess);
-            // touch each item once to ensure it's in the map
-            aggResUsages[sess->sessHandle] = 0;
-        }
+    // Service is accounted by each session on resource events, and decays over time, so
+    // history is kept across session additions and removals. Here we only snapshot it.
+    auto now = std::chrono::steady_clock::now();
+    m_services.clear();
+    m_services.reserve(sessions.size());
+    for (auto &sess : sessions) {
+        candidates->emplace_back(sess);
+        // service is normalized by weight, so a session with twice the weight gets twice the share
+        auto weight = sess->weight.load(std::memory_order_relaxed);
+        weight = weight > 0 ? weight : 1.0;
+        m_services[sess.get()] = sess->fairnessService(now) / weight;
     }
+
+    // We assume m_sessions.size() is always no more than a few,
+    // therefore sorting in every iteration is acceptable.
+    using std::sort;
+    sort(candidates->begin(), candidates->end(), [this](const auto &lhs, const auto &rhs) {
+        return m_services.at(lhs.get()) < m_services.at(rhs.get());
+    });
 }
 
 std::pair<size_t, bool> FairScheduler::maybeScheduleFrom(PSessionItem item)
@@ -124,6 +109,6 @@ std::pair<size_t, bool> FairScheduler::reportScheduleResult(size_t scheduled) co
 std::string FairScheduler::debugString(const PSessionItem &item) const
 {
     std::ostringstream oss;
-    oss << "counter: " << aggResUsages.at(item->sessHandle);
+    oss << "counter: " << sstl::getOrDefault(m_services, item.get(), 0.0);
     return oss.str();
 }
@@ -47,7 +47,8 @@ public:
 private:
     std::pair<size_t, bool> reportScheduleResult(size_t scheduled) const;
 
-    std::unordered_map<std::string, double> aggResUsages;
+    // Decayed service of each candidate in the current scheduling iteration
+    std::unordered_map<const SessionItem *, double> m_services;
 };
 
 #endif // SALUS_EXEC_SCHED_FAIR_H
@@ -25,6 +25,7 @@
 
 namespace salus {
 class OperationTask;
+class TaskHandoff;
 } // namespace salus
 
 struct SessionItem;
@@ -32,6 +33,8 @@ struct OperationItem
 {
     std::weak_ptr<SessionItem> sess;
     std::unique_ptr<salus::OperationTask> op;
+    // Set when queued by a task still running on a pool worker, which then runs this next
+    std::shared_ptr<salus::TaskHandoff> handoff;
 
     size_t hash() const
     {
@@ -19,7 +19,83 @@
 
 #include "sessionitem.h"
 
+#include "utils/envutils.h"
+
+#include <cmath>
+
 using namespace salus;
+using FpSeconds = std::chrono::duration<double, std::chrono::seconds::period>;
+
+namespace {
+
+// Source of unique values for SessionItem::ticketsEpoch
+std::atomic_uint_fast64_t nextTicketsEpoch{1};
+
+// The last ticket registered to a session by this thread. The cache is valid as long as
+// the session's ticketsEpoch doesn't change, because that's the only way a registered
+// ticket can be removed. The epoch being globally unique also protects against a new
+// session reusing the address of a deleted one.
+struct LastRegisteredTicket
+{
+    const SessionItem *sess = nullptr;
+    uint64_t ticket = 0;
+    uint_fast64_t epoch = 0;
+};
+thread_local LastRegisteredTicket lastRegistered;
+
+// Decay rate (per second) of fairness service, from the configured half-life
+double serviceDecayRate()
+{
+    static const auto rate = [] {
+        auto halfLifeMs = sstl::fromEnvVar("SALUS_FAIR_HALFLIFE_MS", 10000.0);
+        if (halfLifeMs <= 0) {
+            halfLifeMs = 10000.0;
+        }
+        return std::log(2.0) / (halfLifeMs / 1000.0);
+    }();
+    return rate;
+}
+
+} // namespace
+
+SessionItem::SessionItem(std::string handle)
+    : serviceUpdated(std::chrono::steady_clock::now())
+    , ticketsEpoch(nextTicketsEpoch.fetch_add(1, std::memory_order_relaxed))
+    , sessHandle(std::move(handle))
+{
+}
+
+int SessionItem::usageSlot(const ResourceTag &tag)
+{
+    auto type = static_cast<int>(tag.type);
+    auto devType = static_cast<int>(tag.device.type);
+    auto devId = tag.device.id;
+    if (type < 0 || type >= kNumResourceTypes
+        || devType < 0 || devType >= kNumDeviceTypes
+        || devId < 0 || devId >= kMaxDevicesPerType) {
+        return -1;
+    }
+    return (type * kNumDeviceTypes + devType) * kMaxDevicesPerType + devId;
+}
+
+SessionItem::UsageCounter &SessionItem::otherUsage(const ResourceTag &tag)
+{
+    auto g = sstl::with_guard(other_mu);
+    auto [it, inserted] = otherUsages.try_emplace(tag, 0);
+    if (inserted) {
+        VLOG(1) << "Resource usage of " << tag.DebugString() << " tracked without a fixed slot";
+    }
+    return it->second;
+}
+
+ResourceTag SessionItem::tagOfSlot(size_t slot)
+{
+    auto devId = static_cast<int>(slot % kMaxDevicesPerType);
+    slot /= kMaxDevicesPerType;
+    auto devType = static_cast<DeviceType>(slot % kNumDeviceTypes);
+    auto type = static_cast<ResourceType>(slot / kNumDeviceTypes);
+    return {type, DeviceSpec{devType, devId}};
+}
 
 SessionItem::~SessionItem()
 {
@@ -77,10 +153,7 @@ void SessionItem::notifyAlloc(const uint64_t graphId, uint64_t ticket, const Res
 {
     resourceUsage(tag) += num;
 
-    {
-        auto g = sstl::with_guard(tickets_mu);
-        tickets.emplace(ticket);
-    }
+    registerTicket(ticket);
 
     updateTracker(graphId, tag);
 }
@@ -90,18 +163,50 @@ void SessionItem::notifyDealloc(const uint64_t graphId, uint64_t ticket, const R
     resourceUsage(tag) -= num;
     if (last) {
         VLOG(2) << "Removing ticket " << ticket << " from session " << sessHandle;
-        auto g = sstl::with_guard(tickets_mu);
-        tickets.erase(ticket);
+        unregisterTicket(ticket);
     }
 
     updateTracker(graphId, tag);
 }
 
+void SessionItem::registerTicket(uint64_t ticket)
+{
+    auto &cache = lastRegistered;
+    if (cache.sess == this && cache.ticket == ticket
+        && cache.epoch == ticketsEpoch.load(std::memory_order_seq_cst)) {
+        return;
+    }
+
+    auto g = sstl::with_guard(tickets_mu);
+    tickets.emplace(ticket);
+    cache.sess = this;
+    cache.ticket = ticket;
+    cache.epoch = ticketsEpoch.load(std::memory_order_relaxed);
+}
+
+void SessionItem::unregisterTicket(uint64_t ticket)
+{
+    auto g = sstl::with_guard(tickets_mu);
+    auto it = tickets.find(ticket);
+    if (it == tickets.end()) {
+        return;
+    }
+    // Invalidate caches before erasing. A concurrent registerTicket that still sees the old epoch
+    // is ordered before this removal, and one that sees the new epoch waits for the lock and
+    // inserts again after it.
+    ticketsEpoch.store(nextTicketsEpoch.fetch_add(1, std::memory_order_relaxed), std::memory_order_seq_cst);
+    tickets.erase(it);
+}
+
 void SessionItem::updateTracker(const uint64_t graphId, const ResourceTag &tag)
 {
     if (tag == trackerTag) {
         VLOG(2) << "SessionItem::updateTracker graphid=" << graphId << ", sess=" << sessHandle;
-        auto g = sstl::with_guard(mu);
+        auto g = sstl::with_guard(trackers_mu);
+
+        advanceServiceUnsafe(std::chrono::steady_clock::now());
+        serviceUsage = resourceUsage(tag);
+
         auto it = allocTrackers.find(graphId);
         if (it != allocTrackers.end()) {
             it->second.update(resourceUsage(tag));
@@ -109,10 +214,30 @@ void SessionItem::updateTracker(const uint64_t graphId, const ResourceTag &tag)
     }
 }
 
+void SessionItem::advanceServiceUnsafe(std::chrono::steady_clock::time_point now)
+{
+    auto dt = FpSeconds(now - serviceUpdated).count();
+    if (dt <= 0) {
+        return;
+    }
+    // usage was constant at serviceUsage during dt
+    auto rate = serviceDecayRate();
+    auto decay = std::exp(-rate * dt);
+    decayedService = decayedService * decay + serviceUsage * (1 - decay) / rate;
+    serviceUpdated = now;
+}
+
+double SessionItem::fairnessService(std::chrono::steady_clock::time_point now)
+{
+    auto g = sstl::with_guard(trackers_mu);
+    advanceServiceUnsafe(now);
+    return decayedService;
+}
+
 bool SessionItem::beginIteration(AllocationRegulator::Ticket t, ResStats newRm, const uint64_t graphId)
 {
     VLOG(2) << "SessionItem::beginIteration graphid=" << graphId << ", sess=" << sessHandle;
-    auto g = sstl::with_guard(mu);
+    auto g = sstl::with_guard(trackers_mu);
     auto it = allocTrackers.try_emplace(graphId, trackerTag).first;
     return it->second.beginIter(t, newRm, resourceUsage(trackerTag));
 }
@@ -120,6 +245,6 @@ bool SessionItem::beginIteration(AllocationRegulator::Ticket t, ResStats newRm,
 void SessionItem::endIteration(const uint64_t graphId)
 {
     VLOG(2) << "SessionItem::endIteration graphid=" << graphId << ", sess=" << sessHandle;
-    auto g = sstl::with_guard(mu);
+    auto g = sstl::with_guard(trackers_mu);
     allocTrackers.at(graphId).endIter();
 }
@@ -26,8 +26,14 @@
 #include "execution/devices.h"
 #include "execution/engine/taskexecutor.h"
 #include "execution/engine/allocationlistener.h"
+#include "execution/threadpool/threadpool.h"
 #include "platform/thread_annotations.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <atomic>
+#include <limits>
 #include <list>
 #include <string>
 #include <functional>
@@ -63,21 +69,41 @@ private:
     // total number of executed op in this session
     uint64_t totalExecutedOp = 0 GUARDED_BY(mu);
 
-    // rm for current iteration
+    std::mutex mu;
+
+    // rm for current iteration, has its own lock to not contend with queue operations
     const static constexpr ResourceTag trackerTag = resources::GPU0Memory;
-    std::unordered_map<uint64_t, salus::IterAllocTracker> allocTrackers GUARDED_BY(mu);
+    std::unordered_map<uint64_t, salus::IterAllocTracker> allocTrackers GUARDED_BY(trackers_mu);
+    std::mutex trackers_mu;
 
-    void updateTracker(uint64_t graphId, const ResourceTag &tag);
+    // Exponentially decayed integral of trackerTag usage over time, in byte-seconds.
+    // Maintained on each usage change of trackerTag, so it survives session churn
+    // in the scheduler.
+    double decayedService GUARDED_BY(trackers_mu) = 0;
+    uint64_t serviceUsage GUARDED_BY(trackers_mu) = 0;
+    std::chrono::steady_clock::time_point serviceUpdated GUARDED_BY(trackers_mu);
 
-    std::mutex mu;
+    void advanceServiceUnsafe(std::chrono::steady_clock::time_point now);
+
+    void updateTracker(uint64_t graphId, const ResourceTag &tag);
 
     size_t lastScheduled = 0;
 
     uint64_t holWaiting = 0;
     size_t queueHeadHash = 0;
 
-    std::unordered_set<uint64_t> tickets;
+    std::unordered_set<uint64_t> tickets GUARDED_BY(tickets_mu);
     std::mutex tickets_mu;
+    // Changed to a new globally unique value before a ticket is removed from tickets,
+    // so per-thread caches of registered tickets can be validated without locking.
+    std::atomic_uint_fast64_t ticketsEpoch;
+
+    /**
+     * @brief Add ticket to tickets. Repeated registration of the same ticket from the
+     * same thread is lock free.
+     */
+    void registerTicket(uint64_t ticket);
+    void unregisterTicket(uint64_t ticket);
 
     // Accessed by multiple scheduling thread
     std::atomic_bool protectOOM{true};
@@ -100,23 +126,74 @@ public:
     uint64_t totalRunningTime {0};
     std::atomic_uint_fast64_t usedRunningTime {0};
     std::atomic_uint_fast64_t numFinishedIters {0};
+    // measured wall time of all operations run in this session, in microseconds
+    std::atomic_uint_fast64_t usedComputeTime {0};
+    // NUMA node of the worker that last ran an operation of this session, -1 if unknown.
+    // Later operations prefer this node, so tensors of the session stay on one socket.
+    std::atomic_int homeNode {-1};
 
-    explicit SessionItem(std::string handle)
-        : sessHandle(std::move(handle))
+    // relative share of this session used by weighted schedulers,
+    // atomic because it may be set by RPC handlers while scheduling threads read it
+    std::atomic<double> weight {1.0};
+
+    // priority class, sessions in higher class are always considered first
+    std::atomic_int priority {0};
+    // priority donated by a higher priority session waiting on resources held by this session
+    constexpr static int kNoInheritedPriority = std::numeric_limits<int>::min();
+    std::atomic_int inheritedPriority {kNoInheritedPriority};
+
+    int effectivePriority() const
+    {
+        return std::max(priority.load(std::memory_order_relaxed), inheritedPriority.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Thread pool priority level for work of this session, based on the sign of its priority class
+     */
+    ThreadPool::Priority workPriority() const
     {
-        // NOTE: add other devices
-        resUsage[resources::GPU0Memory].get() = 0;
-        resUsage[resources::GPU1Memory].get() = 0;
-        resUsage[resources::CPU0Memory].get() = 0;
-        resUsage[{ResourceType::GPU_STREAM, salus::devices::GPU0}].get() = 0;
-        resUsage[{ResourceType::GPU_STREAM, salus::devices::GPU1}].get() = 0;
+        auto p = effectivePriority();
+        if (p > 0) {
+            return ThreadPool::Priority::High;
+        }
+        return p < 0 ? ThreadPool::Priority::Low : ThreadPool::Priority::Normal;
     }
 
+    explicit SessionItem(std::string handle);
+
     ~SessionItem() override;
 
-    sstl::MutableAtom::value_type &resourceUsage(const ResourceTag &tag)
+    using UsageCounter = std::atomic_uint_fast64_t;
+    UsageCounter &resourceUsage(const ResourceTag &tag)
     {
-        return resUsage.at(tag).get();
+        auto slot = usageSlot(tag);
+        if (slot < 0) {
+            return otherUsage(tag);
+        }
+        return resUsage[static_cast<size_t>(slot)];
+    }
+
+    /**
+     * @brief Visit all resources this session currently uses
+     * @param fn called with (const ResourceTag &, uint64_t usage) for each nonzero usage
+     */
+    template<typename Fn>
+    void forEachUsage(Fn &&fn) const
+    {
+        for (size_t slot = 0; slot != kNumUsageSlots; ++slot) {
+            auto usage = resUsage[slot].load(std::memory_order_relaxed);
+            if (usage) {
+                fn(tagOfSlot(slot), usage);
+            }
+        }
+
+        auto g = sstl::with_guard(other_mu);
+        for (const auto &[tag, counter] : otherUsages) {
+            auto usage = counter.load(std::memory_order_relaxed);
+            if (usage) {
+                fn(tag, usage);
+            }
+        }
     }
 
     void setPagingCallbacks(salus::PagingCallbacks pcb);
@@ -151,10 +228,37 @@ public:
 
     void interrupt();
 
+    /**
+     * @brief Decayed service received by this session up to `now`, used by fair scheduling.
+     * The half-life of the decay is controlled by environment variable SALUS_FAIR_HALFLIFE_MS.
+     */
+    double fairnessService(std::chrono::steady_clock::time_point now);
+
 private:
-    using AtomicResUsages = std::unordered_map<ResourceTag, sstl::MutableAtom>;
-    // must be initialized in constructor
-    AtomicResUsages resUsage;
+    // Usage counters are kept in fixed slots, one for each (resource type, device) pair,
+    // so updating them on every allocation is a single atomic operation without lookup.
+    constexpr static int kNumResourceTypes = 4;
+    constexpr static int kNumDeviceTypes = 2;
+    constexpr static int kMaxDevicesPerType = 4;
+    constexpr static size_t kNumUsageSlots = kNumResourceTypes * kNumDeviceTypes * kMaxDevicesPerType;
+
+    /**
+     * @brief Map tag to index in resUsage
+     * @return the slot index, or -1 if the tag can't be tracked
+     */
+    static int usageSlot(const ResourceTag &tag);
+    static ResourceTag tagOfSlot(size_t slot);
+
+    /**
+     * @brief Counter for a tag without a slot, e.g. on a device with a large id. Slower, as it takes a lock.
+     */
+    UsageCounter &otherUsage(const ResourceTag &tag);
+
+    std::array<UsageCounter, kNumUsageSlots> resUsage{};
+
+    // Counters are never removed, so references to them stay valid
+    mutable std::mutex other_mu;
+    std::unordered_map<ResourceTag, UsageCounter> otherUsages GUARDED_BY(other_mu);
 };
 using PSessionItem = std::shared_ptr<SessionItem>;
 using SessionList = std::list<PSessionItem>;
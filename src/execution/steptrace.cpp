@@ -0,0 +1,212 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/steptrace.h"
+
+#include "platform/logging.h"
+#include "utils/envutils.h"
+
+#include "protos.h"
+
+#include <chrono>
+#include <ostream>
+#include <sstream>
+
+namespace salus {
+
+namespace {
+
+size_t index(StepTrace::Stage stage)
+{
+    return static_cast<size_t>(stage);
+}
+
+size_t bucketOf(uint64_t ns)
+{
+    auto us = ns / 1000;
+    size_t b = 0;
+    while (us && b < ThreadPool::Histogram::kNumBuckets - 1) {
+        us >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+const char *methodName(uint16_t method)
+{
+    if (!executor::MethodId_IsValid(method)) {
+        return "METHOD_UNKNOWN";
+    }
+    return executor::MethodId_Name(static_cast<executor::MethodId>(method)).c_str();
+}
+
+} // namespace
+
+std::shared_ptr<StepTrace> StepTrace::start(uint64_t startNs)
+{
+    static const bool enabled = sstl::fromEnvVarBool("SALUS_TRACE_LATENCY", true);
+    if (!enabled) {
+        return nullptr;
+    }
+    return std::make_shared<StepTrace>(startNs);
+}
+
+uint64_t StepTrace::nowNs()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+const char *StepTrace::stageName(Stage stage)
+{
+    static constexpr std::array<const char *, kNumStages> names{
+        "Receive", "IOQueue", "Parse", "StepQueue", "Setup", "LaneQueue", "Execute", "SendQueue", "Total",
+    };
+    return names[index(stage)];
+}
+
+StepTrace::StepTrace(uint64_t startNs)
+    : m_startNs(startNs)
+    , m_lastMarkNs(startNs)
+{
+}
+
+StepTrace::~StepTrace()
+{
+    if (m_method == executor::METHOD_UNKNOWN) {
+        // Never got far enough to be accounted to anything
+        return;
+    }
+    LatencyStats::instance().add(*this);
+
+    static const auto slowNs = sstl::fromEnvVar("SALUS_TRACE_SLOW_MS", uint64_t{0}) * 1000 * 1000;
+    if (slowNs && hasStage(Stage::Total) && elapsed(Stage::Total) >= slowNs) {
+        LOG(WARNING) << "Slow request " << *this;
+    }
+}
+
+void StepTrace::setMethod(uint16_t method)
+{
+    DCHECK_LT(method, LatencyStats::kMaxMethods);
+    if (method < LatencyStats::kMaxMethods) {
+        m_method = method;
+    }
+}
+
+void StepTrace::setSession(const std::string &session)
+{
+    m_session = session;
+}
+
+void StepTrace::mark(Stage stage)
+{
+    auto now = nowNs();
+    auto last = m_lastMarkNs.exchange(now, std::memory_order_relaxed);
+    m_ns[index(stage)].fetch_add(now > last ? now - last : 0, std::memory_order_relaxed);
+    m_seen.fetch_or(1u << index(stage), std::memory_order_relaxed);
+}
+
+void StepTrace::record(Stage stage, uint64_t ns)
+{
+    auto &slot = m_ns[index(stage)];
+    auto cur = slot.load(std::memory_order_relaxed);
+    while (cur < ns && !slot.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {
+    }
+    m_seen.fetch_or(1u << index(stage), std::memory_order_relaxed);
+}
+
+uint64_t StepTrace::elapsed(Stage stage) const
+{
+    return m_ns[index(stage)].load(std::memory_order_relaxed);
+}
+
+bool StepTrace::hasStage(Stage stage) const
+{
+    return m_seen.load(std::memory_order_relaxed) & (1u << index(stage));
+}
+
+std::ostream &operator<<(std::ostream &os, const StepTrace &trace)
+{
+    os << "trace " << trace.m_session << ":" << trace.m_seq << " " << methodName(trace.m_method);
+    for (size_t i = 0; i != StepTrace::kNumStages; ++i) {
+        auto stage = static_cast<StepTrace::Stage>(i);
+        if (trace.hasStage(stage)) {
+            os << " " << StepTrace::stageName(stage) << "=" << trace.elapsed(stage) / 1000 << "us";
+        }
+    }
+    return os;
+}
+
+LatencyStats &LatencyStats::instance()
+{
+    static LatencyStats stats;
+    return stats;
+}
+
+void LatencyStats::add(const StepTrace &trace)
+{
+    auto &method = m_buckets[trace.method()];
+    for (size_t i = 0; i != StepTrace::kNumStages; ++i) {
+        auto stage = static_cast<StepTrace::Stage>(i);
+        if (trace.hasStage(stage)) {
+            method[i][bucketOf(trace.elapsed(stage))].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::vector<LatencyStats::MethodStats> LatencyStats::snapshot() const
+{
+    std::vector<MethodStats> result;
+    for (size_t m = 0; m != kMaxMethods; ++m) {
+        MethodStats stats;
+        stats.method = static_cast<uint16_t>(m);
+        uint64_t samples = 0;
+        for (size_t i = 0; i != StepTrace::kNumStages; ++i) {
+            for (size_t b = 0; b != ThreadPool::Histogram::kNumBuckets; ++b) {
+                stats.stages[i].buckets[b] = m_buckets[m][i][b].load(std::memory_order_relaxed);
+            }
+            samples += stats.stages[i].count();
+        }
+        if (samples > 0) {
+            result.emplace_back(std::move(stats));
+        }
+    }
+    return result;
+}
+
+std::string LatencyStats::report() const
+{
+    std::ostringstream oss;
+    for (const auto &stats : snapshot()) {
+        oss << methodName(stats.method) << " (p50/p90/p99 us):\n";
+        for (size_t i = 0; i != StepTrace::kNumStages; ++i) {
+            const auto &h = stats.stages[i];
+            if (h.count() == 0) {
+                continue;
+            }
+            oss << "    " << StepTrace::stageName(static_cast<StepTrace::Stage>(i)) << ": " << h.count()
+                << " samples, " << h.quantileUpperBound(0.5) << "/" << h.quantileUpperBound(0.9) << "/"
+                << h.quantileUpperBound(0.99) << "\n";
+        }
+    }
+    return oss.str();
+}
+
+} // namespace salus
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_EXEC_STEPTRACE_H
+#define SALUS_EXEC_STEPTRACE_H
+
+#include "execution/threadpool/threadpool.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace salus {
+
+/**
+ * @brief Where one request spent its time, from being received until its reply is sent.
+ *
+ * A trace is created when a request is received and shared by everything working on the request:
+ * the sender, the session step, and the iterations it schedules on the ExecutionEngine. It is
+ * identified by the envelope seq and the session handle, and is added to the per-method histograms
+ * of LatencyStats when the last reference is dropped.
+ *
+ * The seq, method and session are set along the request path before the trace is finished, and only
+ * read after that. Stages can be accounted from any thread.
+ *
+ * Tracing is on unless SALUS_TRACE_LATENCY is false, off, no or 0. Traces with a total time of at least
+ * SALUS_TRACE_SLOW_MS are also logged with their breakdown, 0 disables that.
+ */
+class StepTrace
+{
+public:
+    enum class Stage
+    {
+        // Reading all frames from the socket
+        Receive = 0,
+        // Waiting for an IO thread
+        IOQueue,
+        // Decoding the envelope and request
+        Parse,
+        // Waiting for steps queued before in the same session
+        StepQueue,
+        // MasterSession work until the iterations of the step are scheduled
+        Setup,
+        // Iterations waiting in ExecutionEngine lane queues, the longest of them
+        LaneQueue,
+        // Iterations running kernels, the longest of them
+        Execute,
+        // Reply waiting for the socket thread
+        SendQueue,
+        // From receive until the reply is sent
+        Total,
+    };
+    static constexpr size_t kNumStages = 9;
+
+    /**
+     * @returns a new trace started at startNs, or nullptr if tracing is disabled
+     */
+    static std::shared_ptr<StepTrace> start(uint64_t startNs);
+
+    static uint64_t nowNs();
+
+    static const char *stageName(Stage stage);
+
+    explicit StepTrace(uint64_t startNs);
+    ~StepTrace();
+
+    StepTrace(const StepTrace &) = delete;
+    StepTrace &operator=(const StepTrace &) = delete;
+
+    void setSeq(uint64_t seq)
+    {
+        m_seq = seq;
+    }
+
+    uint64_t seq() const
+    {
+        return m_seq;
+    }
+
+    /**
+     * @brief Set the executor::MethodId the trace is accounted to
+     */
+    void setMethod(uint16_t method);
+
+    uint16_t method() const
+    {
+        return m_method;
+    }
+
+    void setSession(const std::string &session);
+
+    uint64_t startNs() const
+    {
+        return m_startNs;
+    }
+
+    /**
+     * @brief Account the time since the previous mark, or since start, to stage.
+     * For stages that follow each other on the request path.
+     */
+    void mark(Stage stage);
+
+    /**
+     * @brief Account ns to stage. If recorded more than once, e.g. by iterations running in parallel,
+     * the longest is kept.
+     */
+    void record(Stage stage, uint64_t ns);
+
+    /**
+     * @returns nanoseconds accounted to stage so far
+     */
+    uint64_t elapsed(Stage stage) const;
+
+    bool hasStage(Stage stage) const;
+
+private:
+    friend std::ostream &operator<<(std::ostream &os, const StepTrace &trace);
+
+    const uint64_t m_startNs;
+    uint64_t m_seq = 0;
+    uint16_t m_method = 0;
+
+    std::string m_session;
+
+    std::atomic<uint64_t> m_lastMarkNs;
+    std::atomic<uint32_t> m_seen{0};
+    std::array<std::atomic<uint64_t>, kNumStages> m_ns{};
+};
+
+std::ostream &operator<<(std::ostream &os, const StepTrace &trace);
+
+/**
+ * @brief Per-method latency histograms of finished traces, accumulated over the lifetime of the process
+ */
+class LatencyStats
+{
+public:
+    // Enough for all executor::MethodId values
+    static constexpr size_t kMaxMethods = 64;
+
+    static LatencyStats &instance();
+
+    struct MethodStats
+    {
+        uint16_t method = 0;
+        std::array<ThreadPool::Histogram, StepTrace::kNumStages> stages;
+    };
+
+    void add(const StepTrace &trace);
+
+    /**
+     * @returns histograms of methods with at least one finished trace
+     */
+    std::vector<MethodStats> snapshot() const;
+
+    /**
+     * @returns one line per method and stage, with count and p50/p90/p99 upper bounds in microseconds
+     */
+    std::string report() const;
+
+private:
+    using Buckets = std::array<std::atomic<uint64_t>, ThreadPool::Histogram::kNumBuckets>;
+
+    std::array<std::array<Buckets, StepTrace::kNumStages>, kMaxMethods> m_buckets{};
+};
+
+} // namespace salus
+
+#endif // SALUS_EXEC_STEPTRACE_H
@@ -12,6 +12,8 @@
 
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -141,11 +143,47 @@ public:
     void Notify(bool all)
     {
         std::atomic_thread_fence(std::memory_order_seq_cst);
+        NotifyNoFence(all);
+    }
+
+    // NotifyMany wakes up to n waiting threads, with a single fence.
+    // Stops early once there is no waiter left. Returns the number of threads woken.
+    // Must be called after changing the associated wait predicate.
+    unsigned NotifyMany(unsigned n)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        unsigned woken = 0;
+        while (woken < n && NotifyNoFence(false))
+            ++woken;
+        return woken;
+    }
+
+    struct Waiter
+    {
+        friend class EventCount;
+        // Align to 128 byte boundary to prevent false sharing with other Waiter objects in the same vector.
+        alignas(128) std::atomic<Waiter *> next;
+        std::mutex mu;
+        std::condition_variable cv;
+        uint64_t epoch;
+        unsigned state;
+        enum
+        {
+            kNotSignaled,
+            kWaiting,
+            kSignaled,
+        };
+    };
+
+private:
+    // Returns false if there was no waiter to wake.
+    bool NotifyNoFence(bool all)
+    {
         uint64_t state = state_.load(std::memory_order_acquire);
         for (;;) {
             // Easy case: no waiters.
             if ((state & kStackMask) == kStackMask && (state & kWaiterMask) == 0)
-                return;
+                return false;
             uint64_t waiters = (state & kWaiterMask) >> kWaiterShift;
             uint64_t newstate;
             if (all) {
@@ -169,36 +207,18 @@ public:
             }
             if (state_.compare_exchange_weak(state, newstate, std::memory_order_acquire)) {
                 if (!all && waiters)
-                    return; // unblocked pre-wait thread
+                    return true; // unblocked pre-wait thread
                 if ((state & kStackMask) == kStackMask)
-                    return;
+                    return true;
                 Waiter *w = &waiters_[state & kStackMask];
                 if (!all)
                     w->next.store(nullptr, std::memory_order_relaxed);
                 Unpark(w);
-                return;
+                return true;
             }
         }
     }
 
-    struct Waiter
-    {
-        friend class EventCount;
-        // Align to 128 byte boundary to prevent false sharing with other Waiter objects in the same vector.
-        alignas(128) std::atomic<Waiter *> next;
-        std::mutex mu;
-        std::condition_variable cv;
-        uint64_t epoch;
-        unsigned state;
-        enum
-        {
-            kNotSignaled,
-            kWaiting,
-            kSignaled,
-        };
-    };
-
-private:
     // State_ layout:
     // - low kStackBits is a stack of waiters committed wait.
     // - next kWaiterBits is count of waiters in prewait state.
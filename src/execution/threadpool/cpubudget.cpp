@@ -0,0 +1,222 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpubudget.h"
+
+#include "execution/threadpool/cputopology.h"
+#include "platform/logging.h"
+#include "utils/envutils.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+size_t index(CpuBudget::Pool p)
+{
+    return static_cast<size_t>(p);
+}
+
+} // namespace
+
+CpuBudget &CpuBudget::instance()
+{
+    static CpuBudget budget(sstl::fromEnvVar("SALUS_CPU_BUDGET", CpuTopology::system()->numCpus()),
+                            sstl::fromEnvVar("SALUS_CPU_REBALANCE_MS", 100));
+    return budget;
+}
+
+CpuBudget::CpuBudget(size_t total, int rebalanceMs)
+    : m_total(std::max<size_t>(total, 1))
+    , m_rebalanceMs(rebalanceMs)
+    , m_shares(split(m_total))
+{
+    m_members[index(Pool::Engine)].threads = m_shares.engine;
+    m_members[index(Pool::IO)].threads = m_shares.io;
+    m_members[index(Pool::TFCompute)].threads = m_shares.tfCompute;
+}
+
+CpuBudget::~CpuBudget()
+{
+    std::unique_lock<std::mutex> l(m_mu);
+    m_numAttached = 0;
+    m_cv.notify_all();
+    l.unlock();
+    if (m_thread && m_thread->joinable()) {
+        m_thread->join();
+    }
+}
+
+CpuBudget::Shares CpuBudget::split(size_t total)
+{
+    Shares s;
+    // IO threads mostly wait on requests, TF compute threads only run the few ops not going
+    // through the engine, so the engine gets the rest.
+    s.io = std::max<size_t>(total / 4, 1);
+    s.tfCompute = std::clamp<size_t>(total / 8, 1, 4);
+    s.engine = total > s.io + s.tfCompute ? total - s.io - s.tfCompute : 1;
+    return s;
+}
+
+size_t CpuBudget::share(Pool p) const
+{
+    switch (p) {
+    case Pool::Engine:
+        return m_shares.engine;
+    case Pool::IO:
+        return m_shares.io;
+    case Pool::TFCompute:
+        return m_shares.tfCompute;
+    }
+    return 1;
+}
+
+size_t CpuBudget::limit(Pool p) const
+{
+    if (p == Pool::TFCompute) {
+        // Not resizable
+        return m_shares.tfCompute;
+    }
+    // Everything not reserved for the other resizable pool's minimum of one thread
+    return std::max<size_t>(m_shares.engine + m_shares.io - 1, 1);
+}
+
+size_t CpuBudget::current(Pool p) const
+{
+    std::lock_guard<std::mutex> g(m_mu);
+    return m_members[index(p)].threads;
+}
+
+void CpuBudget::attach(Pool p, std::function<size_t()> pending, std::function<void(size_t)> resize)
+{
+    size_t threads;
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        auto &m = m_members[index(p)];
+        if (m.attached) {
+            LOG(ERROR) << "Pool " << index(p) << " already attached to CPU budget";
+            return;
+        }
+        m.attached = true;
+        m.pending = std::move(pending);
+        m.resize = resize;
+        threads = m.threads;
+        ++m_numAttached;
+
+        if (!m_thread && m_rebalanceMs > 0) {
+            m_thread = std::make_unique<std::thread>(&CpuBudget::rebalanceLoop, this);
+        }
+    }
+    // The pool is still being constructed by the caller, so no rebalancing resized it in between
+    resize(threads);
+}
+
+void CpuBudget::detach(Pool p)
+{
+    std::unique_ptr<std::thread> thr;
+    {
+        std::unique_lock<std::mutex> l(m_mu);
+        // The pool goes away after this, so wait for callbacks into it to return
+        m_idle.wait(l, [this]() { return !m_rebalancing; });
+        auto &m = m_members[index(p)];
+        if (!m.attached) {
+            return;
+        }
+        m.attached = false;
+        m.pending = nullptr;
+        m.resize = nullptr;
+        if (--m_numAttached == 0) {
+            thr = std::move(m_thread);
+            m_cv.notify_all();
+        }
+    }
+    if (thr && thr->joinable()) {
+        thr->join();
+    }
+}
+
+void CpuBudget::rebalance()
+{
+    std::unique_lock<std::mutex> l(m_mu);
+    rebalanceLocked(l);
+}
+
+void CpuBudget::rebalanceLocked(std::unique_lock<std::mutex> &l)
+{
+    // Only engine and IO pools are resizable
+    auto &engine = m_members[index(Pool::Engine)];
+    auto &io = m_members[index(Pool::IO)];
+    if (!engine.attached || !io.attached || m_rebalancing) {
+        return;
+    }
+
+    // Callbacks take the pools' own locks, so they are called without holding m_mu.
+    // Pools stay attached until m_rebalancing is cleared, see detach.
+    m_rebalancing = true;
+    auto enginePendingFn = engine.pending;
+    auto ioPendingFn = io.pending;
+    l.unlock();
+    const auto enginePending = enginePendingFn();
+    const auto ioPending = ioPendingFn();
+    l.lock();
+
+    // Move a thread only when one side has more than a task queued per thread
+    // and the other side has nothing queued.
+    Member *from = nullptr;
+    Member *to = nullptr;
+    if (enginePending > engine.threads && ioPending == 0 && io.threads > 1) {
+        from = &io;
+        to = &engine;
+    } else if (ioPending > io.threads && enginePending == 0 && engine.threads > 1) {
+        from = &engine;
+        to = &io;
+    }
+    if (from) {
+        from->threads -= 1;
+        to->threads += 1;
+        VLOG(2) << "CPU budget rebalanced: engine " << engine.threads << " (" << enginePending << " pending), io "
+                << io.threads << " (" << ioPending << " pending)";
+
+        // Shrink first, so the total stays within the budget
+        auto shrink = from->resize;
+        auto grow = to->resize;
+        const auto fromThreads = from->threads;
+        const auto toThreads = to->threads;
+        l.unlock();
+        shrink(fromThreads);
+        grow(toThreads);
+        l.lock();
+    }
+
+    m_rebalancing = false;
+    m_idle.notify_all();
+}
+
+void CpuBudget::rebalanceLoop()
+{
+    const auto period = std::chrono::milliseconds(m_rebalanceMs);
+    std::unique_lock<std::mutex> l(m_mu);
+    while (m_numAttached > 0) {
+        m_cv.wait_for(l, period);
+        if (m_numAttached == 0) {
+            break;
+        }
+        rebalanceLocked(l);
+    }
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXECUTION_THREADPOOL_CPUBUDGET_H
+#define EXECUTION_THREADPOOL_CPUBUDGET_H
+
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief One CPU budget shared by the thread pools of the server.
+ *
+ * The budget is split between the engine ThreadPool, the IO pool and the TF compute pool.
+ * Pools that can resize at runtime attach to the budget, after which a background thread
+ * periodically moves threads from idle pools to pools with queued work. The total number
+ * of active threads in attached pools stays within the budget.
+ */
+class CpuBudget
+{
+public:
+    enum class Pool
+    {
+        Engine = 0,
+        IO = 1,
+        TFCompute = 2,
+    };
+    static constexpr size_t kNumPools = 3;
+
+    struct Shares
+    {
+        size_t engine = 0;
+        size_t io = 0;
+        size_t tfCompute = 0;
+    };
+
+    /**
+     * @brief The budget of this process. Total is SALUS_CPU_BUDGET, defaults to number of
+     * usable CPUs. Rebalancing period is SALUS_CPU_REBALANCE_MS, 0 disables rebalancing.
+     */
+    static CpuBudget &instance();
+
+    CpuBudget(size_t total, int rebalanceMs);
+    ~CpuBudget();
+
+    CpuBudget(const CpuBudget &) = delete;
+    CpuBudget &operator=(const CpuBudget &) = delete;
+
+    /**
+     * @brief Initial split of total CPUs, each pool gets at least one thread.
+     */
+    static Shares split(size_t total);
+
+    size_t total() const
+    {
+        return m_total;
+    }
+
+    /**
+     * @returns the initial share of pool p
+     */
+    size_t share(Pool p) const;
+
+    /**
+     * @returns the maximum number of threads pool p may grow to when rebalancing. Pools start
+     * threads only as they grow, up front they run share(p) of them.
+     */
+    size_t limit(Pool p) const;
+
+    /**
+     * @brief Attach a resizable pool. pending returns the number of queued tasks,
+     * resize sets the number of active threads. The pool is resized to its share.
+     */
+    void attach(Pool p, std::function<size_t()> pending, std::function<void(size_t)> resize);
+
+    /**
+     * @brief Detach pool p. Must be called before the pool is destroyed.
+     */
+    void detach(Pool p);
+
+    /**
+     * @returns current number of active threads assigned to pool p
+     */
+    size_t current(Pool p) const;
+
+    /**
+     * @brief Move at most one thread between attached pools according to their queue pressure.
+     * Called periodically by the rebalancing thread.
+     */
+    void rebalance();
+
+private:
+    struct Member
+    {
+        bool attached = false;
+        size_t threads = 0;
+        std::function<size_t()> pending;
+        std::function<void(size_t)> resize;
+    };
+
+    void rebalanceLoop();
+    // Temporarily releases l while calling into the pools
+    void rebalanceLocked(std::unique_lock<std::mutex> &l);
+
+    const size_t m_total;
+    const int m_rebalanceMs;
+    const Shares m_shares;
+
+    mutable std::mutex m_mu;
+    std::condition_variable m_cv;
+    // Notified when a rebalance in progress finished calling into the pools
+    std::condition_variable m_idle;
+    bool m_rebalancing = false;
+    std::array<Member, kNumPools> m_members;
+    size_t m_numAttached = 0;
+    std::unique_ptr<std::thread> m_thread;
+};
+
+#endif // EXECUTION_THREADPOOL_CPUBUDGET_H
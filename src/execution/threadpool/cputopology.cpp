@@ -0,0 +1,140 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cputopology.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <thread>
+
+namespace {
+
+std::vector<int> processCpuSet()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i != CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) {
+                cpus.push_back(i);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        for (int i = 0, n = static_cast<int>(std::thread::hardware_concurrency()); i < n; ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+} // namespace
+
+CpuTopology::CpuTopology(std::vector<std::vector<int>> nodes)
+    : m_nodes(std::move(nodes))
+{
+    m_nodes.erase(std::remove_if(m_nodes.begin(), m_nodes.end(), [](const auto &cpus) { return cpus.empty(); }),
+                  m_nodes.end());
+    if (m_nodes.empty()) {
+        m_nodes.push_back(processCpuSet());
+    }
+}
+
+size_t CpuTopology::numCpus() const
+{
+    size_t n = 0;
+    for (const auto &cpus : m_nodes) {
+        n += cpus.size();
+    }
+    return n;
+}
+
+std::vector<int> CpuTopology::parseCpuList(std::string_view list)
+{
+    std::vector<int> cpus;
+    while (!list.empty() && (list.back() == '\n' || list.back() == ' ')) {
+        list.remove_suffix(1);
+    }
+    while (!list.empty()) {
+        auto end = list.find(',');
+        auto range = list.substr(0, end);
+        list = end == std::string_view::npos ? std::string_view{} : list.substr(end + 1);
+
+        int first = 0;
+        int last = 0;
+        auto [p, ec] = std::from_chars(range.data(), range.data() + range.size(), first);
+        if (ec != std::errc()) {
+            return {};
+        }
+        last = first;
+        if (p != range.data() + range.size()) {
+            if (*p != '-') {
+                return {};
+            }
+            auto [p2, ec2] = std::from_chars(p + 1, range.data() + range.size(), last);
+            if (ec2 != std::errc() || p2 != range.data() + range.size() || last < first) {
+                return {};
+            }
+        }
+        for (int i = first; i <= last; ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+CpuTopology CpuTopology::discover(const std::string &sysfsRoot)
+{
+    auto allowed = processCpuSet();
+    std::sort(allowed.begin(), allowed.end());
+
+    std::vector<std::vector<int>> nodes;
+    // Node ids are usually contiguous, but stop only after a few missing ones to be safe with holes
+    for (int id = 0, missing = 0; missing < 8; ++id) {
+        std::ifstream f(sysfsRoot + "/node" + std::to_string(id) + "/cpulist");
+        if (!f) {
+            ++missing;
+            continue;
+        }
+        missing = 0;
+        std::string line;
+        std::getline(f, line);
+        std::vector<int> cpus;
+        for (auto cpu : parseCpuList(line)) {
+            if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(std::move(cpus));
+    }
+    if (nodes.empty()) {
+        nodes.push_back(std::move(allowed));
+    }
+    return CpuTopology(std::move(nodes));
+}
+
+std::shared_ptr<const CpuTopology> CpuTopology::system()
+{
+    static auto topo = std::make_shared<const CpuTopology>(discover());
+    return topo;
+}
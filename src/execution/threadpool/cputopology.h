@@ -0,0 +1,73 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXECUTION_THREADPOOL_CPUTOPOLOGY_H
+#define EXECUTION_THREADPOOL_CPUTOPOLOGY_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief CPUs usable by this process, grouped by NUMA node.
+ * Nodes without any usable CPU are omitted, so node index here may differ from the kernel's node id.
+ */
+class CpuTopology
+{
+public:
+    /**
+     * @brief Construct from explicit CPU lists, one per node. Useful to fake a multi-socket machine.
+     */
+    explicit CpuTopology(std::vector<std::vector<int>> nodes);
+
+    /**
+     * @brief Discover topology from sysfs, restricted to the process cpuset.
+     * Falls back to a single node with all usable CPUs if sysfsRoot is not available.
+     */
+    static CpuTopology discover(const std::string &sysfsRoot = "/sys/devices/system/node");
+
+    /**
+     * @returns the discovered topology of this machine, which is only discovered once.
+     */
+    static std::shared_ptr<const CpuTopology> system();
+
+    /**
+     * @brief Parse a kernel cpulist string like "0-3,8,10-11"
+     * @returns parsed CPU ids, or empty if the string is malformed
+     */
+    static std::vector<int> parseCpuList(std::string_view list);
+
+    size_t numNodes() const
+    {
+        return m_nodes.size();
+    }
+
+    size_t numCpus() const;
+
+    const std::vector<int> &cpusOf(size_t node) const
+    {
+        return m_nodes[node];
+    }
+
+private:
+    std::vector<std::vector<int>> m_nodes;
+};
+
+#endif // EXECUTION_THREADPOOL_CPUTOPOLOGY_H
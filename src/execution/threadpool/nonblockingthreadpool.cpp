@@ -3,7 +3,14 @@
  *
  * A non-blocking thread pool implementation with optimizations:
  * - Work stealing
- * - One spinning wait thread
+ * - One spinning wait thread, with adaptive spin budget
+ * - Unbounded overflow queue when per-thread queues are full
+ * - Priority levels with starvation protection
+ * - NUMA aware stealing and optional CPU pinning
+ * - Per-worker LIFO slot for continuations
+ * - Per-worker statistics
+ * - Compensating threads for blocking tasks
+ * - Adjustable number of active workers
  *
  * This file is part of Salus
  * (see https://github.com/SymbioticLab/Salus).
@@ -27,8 +34,20 @@
 #include "utils/fixed_function.hpp"
 #include "RunQueue.h"
 
+#include <concurrentqueue.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -38,6 +57,8 @@ using std::vector;
 struct Task
 {
     ThreadPool::Closure c;
+    // When the task was submitted, in steady clock nanoseconds, 0 if not collecting stats
+    uint64_t enqueuedNs = 0;
 
     Task() = default;
     explicit Task(ThreadPool::Closure &&cc) : c(std::move(cc)) {}
@@ -72,11 +93,33 @@ ThreadPoolOptions::ThreadPoolOptions()
     spinCount = allowSpinning && numThreads > 0 ? 5000 / numThreads : 0;
 }
 
+namespace {
+thread_local ThreadPool::Priority CurrentPriority = ThreadPool::Priority::Normal;
+} // namespace
+
+ThreadPool::PriorityScope::PriorityScope(Priority p)
+    : m_prev(CurrentPriority)
+{
+    CurrentPriority = p;
+}
+
+ThreadPool::PriorityScope::~PriorityScope()
+{
+    CurrentPriority = m_prev;
+}
+
+ThreadPool::Priority ThreadPool::currentPriority()
+{
+    return CurrentPriority;
+}
+
 class ThreadPoolPrivate
 {
     ThreadPool *const q; // NOLINT
 
     using Queue = RunQueue<Task, 1024>;
+    using Priority = ThreadPool::Priority;
+    static constexpr size_t kNumLevels = ThreadPool::kNumPriorities;
 
     ThreadPoolPrivate(const ThreadPoolPrivate &) = delete;
     ThreadPoolPrivate &operator =(const ThreadPoolPrivate &) = delete;
@@ -87,11 +130,22 @@ public:
     ThreadPoolPrivate(ThreadPool *q, const ThreadPoolOptions &options);
     ~ThreadPoolPrivate();
 
-    Task tryRun(Task c);
+    Task tryRun(Task c, Priority p, int node);
+    Task tryRunNext(Task c, Priority p);
+    bool runBulk(vector<ThreadPool::Closure> &cs, Priority p, int node);
     void stop();
     void join();
     size_t numThreads() const;
     int currentThreadId() const;
+    size_t numNodes() const;
+    int currentNode() const;
+    ThreadPool::SpinStats spinStats() const;
+    ThreadPool::Stats stats() const;
+    bool beginBlocking();
+    void endBlocking();
+    void setActiveThreads(size_t n);
+    size_t activeThreads() const;
+    size_t pendingTasks() const;
 
 private:
     struct PerThread
@@ -100,22 +154,204 @@ private:
             : pool(nullptr)
             , rand(0)
             , thread_id(-1)
+            , picks(0)
+            , spinBudget(0)
+            , spareOf(nullptr)
         {
         }
         ThreadPoolPrivate *pool; // Parent pool, or null for normal threads.
         uint64_t rand;           // Random generator state.
         int thread_id;           // Worker thread index in pool.
+        unsigned picks;          // Number of tasks taken, for starvation protection.
+        int spinBudget;          // Current adaptive spin budget.
+        ThreadPoolPrivate *spareOf; // Pool this thread compensates for, or null.
     };
 
+    /**
+     * Number of workers on node taking work. Sets node to -1 if there is no preference
+     * or the node has none of them.
+     */
+    size_t activeOnNode(int &node) const;
+
     /**
      * Main worker thread loop.
      */
     void workerLoop(int thread_id);
 
     /**
-     * Steal tries to steal work from other worker threads in best-effort manner.
+     * Find the next task to run, looking at priority levels from high to low. For each level,
+     * first the thread's own queue, then the overflow queue, and then steal if canSteal.
+     */
+    Task findWork(PerThread *pt, bool canSteal);
+
+    /**
+     * A single task a worker runs next, before its own queue.
+     * Only the owner puts into it, but any worker may take from it.
+     */
+    struct alignas(128) NextSlot
+    {
+        std::mutex mu;
+        Task task;
+        size_t level = 0;
+        std::atomic<bool> full{false};
+    };
+
+    /**
+     * Counters of a worker. Only written by the owning worker, so plain load and store suffice.
+     */
+    struct alignas(128) WorkerCounters
+    {
+        using Counter = std::atomic<uint64_t>;
+        Counter tasks{0};
+        Counter steals{0};
+        Counter failedSteals{0};
+        Counter overflowPops{0};
+        Counter parks{0};
+        Counter parkNs{0};
+        Counter runNs{0};
+        std::array<Counter, ThreadPool::Histogram::kNumBuckets> queueWaitUs{};
+        std::array<Counter, ThreadPool::Histogram::kNumBuckets> runTimeUs{};
+
+        static void add(Counter &c, uint64_t v)
+        {
+            c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+
+        static size_t bucketOf(uint64_t ns)
+        {
+            auto us = ns / 1000;
+            size_t b = 0;
+            while (us && b < ThreadPool::Histogram::kNumBuckets - 1) {
+                us >>= 1;
+                ++b;
+            }
+            return b;
+        }
+    };
+
+    static uint64_t nowNs()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now().time_since_epoch())
+                                         .count());
+    }
+
+    void stamp(Task &t) const
+    {
+        if (m_options.collectStats) {
+            t.enqueuedNs = nowNs();
+        }
+    }
+
+    /**
+     * A compensating thread. It has no queue of its own, and only steals.
+     */
+    struct Spare
+    {
+        std::thread thr;
+        std::atomic<bool> exited{false};
+    };
+
+    /**
+     * Main loop of compensating threads.
+     */
+    void spareLoop(Spare &self);
+
+    /**
+     * Start a compensating thread, m_spareMu must be held.
+     */
+    void spawnSpareUnsafe();
+
+    /**
+     * Join compensating threads that already exited, m_spareMu must be held.
      */
-    Task steal();
+    void reapSparesUnsafe();
+
+    /**
+     * Wait for all compensating threads to exit.
+     */
+    void joinSpares();
+
+    /**
+     * Whether the worker is above the active limit and should sleep. Everyone is active when stopping.
+     */
+    bool isInactive(int thread_id) const
+    {
+        return static_cast<size_t>(thread_id) >= m_active.load(std::memory_order_relaxed) && !m_done;
+    }
+
+    /**
+     * Hand the queued work of an inactive worker to others, and sleep until it is active again.
+     */
+    void parkInactive(PerThread *pt);
+
+    /**
+     * Count the current thread as blocking, starting or waking a compensating thread if needed.
+     */
+    bool countBlocking();
+
+    /**
+     * Wake an idle compensating thread, if any, after new work is made available.
+     */
+    void maybeWakeSpare()
+    {
+        if (m_idleSpares.load() > 0) {
+            std::lock_guard<std::mutex> g(m_spareMu);
+            m_spareCv.notify_one();
+        }
+    }
+
+    /**
+     * Run t on the current worker, recording its queue wait and run time.
+     */
+    void runTask(PerThread *pt, Task &t);
+
+    /**
+     * Take the task of level from the next slot of worker, returns an empty task if there is none.
+     */
+    Task takeNext(size_t worker, size_t level);
+
+    /**
+     * Steal tries to steal work of level from other worker threads in best-effort manner.
+     * Workers on the same NUMA node as the caller are tried first.
+     */
+    Task steal(size_t level);
+
+    /**
+     * Assign each worker a NUMA node and CPU, spreading over nodes in round-robin order.
+     */
+    void placeWorkers();
+
+    /**
+     * Start workers until there are n of them. Workers are never stopped before the pool is destroyed.
+     */
+    void spawnWorkers(size_t n);
+
+    void pinCurrentThread(int thread_id);
+
+    /**
+     * Push t to the overflow queue of level, which never fails.
+     */
+    void pushOverflow(Task &&t, size_t level);
+
+    /**
+     * Pop from the overflow queue of level, returns an empty task if it is empty.
+     */
+    Task popOverflow(size_t level);
+
+    bool overflowEmpty(size_t level) const
+    {
+        return m_overflowSize[level].load() == 0;
+    }
+
+    /**
+     * Whether the next pick should look at lower levels first to avoid starvation.
+     */
+    bool agingPick(PerThread *pt) const
+    {
+        const auto limit = m_options.starvationLimit;
+        return limit > 0 && (pt->picks + 1) % static_cast<unsigned>(limit) == 0;
+    }
 
     /**
      * waitForWork blocks until new work is available (returns true), or if it is
@@ -124,7 +360,19 @@ private:
      */
     bool waitForWork(EventCount::Waiter *waiter, Task *t);
 
-    int nonEmptyQueueIndex();
+    /**
+     * Spin for work within the worker's budget, and adapt the budget to where work was found.
+     */
+    Task spinForWork(PerThread *pt, bool canSteal);
+
+    /**
+     * Adapt the spin budget of the current worker after it parked for parked time.
+     */
+    void adaptAfterPark(std::chrono::steady_clock::duration parked);
+
+    int nonEmptyQueueIndex(size_t level);
+
+    bool anyNonEmpty();
 
     static inline PerThread *getPerThread()
     {
@@ -142,15 +390,53 @@ private:
     }
 
     ThreadPoolOptions m_options;
+    // Workers are started on demand, up to numThreads, as the active limit is raised
+    std::mutex m_spawnMu;
     vector<std::thread> m_threads;
-    vector<Queue> m_queues;
+    std::atomic<size_t> m_spawned{0};
+    // One set of per-thread queues for each priority level
+    std::array<vector<Queue>, kNumLevels> m_queues;
     vector<unsigned> m_coprimes;
     vector<EventCount::Waiter> m_waiters;
+    vector<NextSlot> m_nextSlots;
+    vector<WorkerCounters> m_counters;
+    std::atomic<uint64_t> m_overflowPushes{0};
+
+    // Workers with index at or above m_active sleep on m_inactiveCv
+    std::atomic<size_t> m_active;
+    std::mutex m_inactiveMu;
+    std::condition_variable m_inactiveCv;
+
+    // Compensating threads
+    std::mutex m_spareMu;
+    std::condition_variable m_spareCv;
+    std::condition_variable m_sparesGone;
+    std::list<Spare> m_spares;
+    size_t m_liveSpares = 0;
+    std::atomic<int> m_idleSpares{0};
+    std::atomic<int> m_blockingWorkers{0};
+    std::atomic<uint64_t> m_blockingRegions{0};
+    std::atomic<uint64_t> m_sparesStarted{0};
+    std::atomic<uint64_t> m_sparesRetired{0};
+    std::shared_ptr<const CpuTopology> m_topology;
+    vector<int> m_workerNode;
+    vector<int> m_workerCpu;
+    vector<vector<unsigned>> m_nodeWorkers;
+    // Shared by all workers for tasks that don't fit in per-thread queues.
+    // m_overflowSize is increased before enqueue and decreased after dequeue,
+    // so it never under-reports, which is required by waitForWork.
+    std::array<moodycamel::ConcurrentQueue<Task>, kNumLevels> m_overflow;
+    std::array<std::atomic<size_t>, kNumLevels> m_overflowSize;
     std::atomic<unsigned> m_blocked;
     std::atomic<bool> m_spinning;
     std::atomic<bool> m_done;
     std::atomic<bool> m_cancelled;
     EventCount m_ec;
+
+    std::atomic<uint64_t> m_spinHits{0};
+    std::atomic<uint64_t> m_spinMisses{0};
+    std::atomic<uint64_t> m_parks{0};
+    std::atomic<uint64_t> m_shortParks{0};
 };
 
 ThreadPool::ThreadPool(const ThreadPoolOptions &options)
@@ -160,10 +446,17 @@ ThreadPool::ThreadPool(const ThreadPoolOptions &options)
 
 ThreadPool::~ThreadPool() = default;
 
-ThreadPool::Closure ThreadPool::tryRun(Closure c)
+ThreadPool::Closure ThreadPool::tryRun(Closure c, Priority p)
 {
     Task t(std::move(c));
-    t = d->tryRun(std::move(t));
+    t = d->tryRun(std::move(t), p, -1);
+    return std::move(t.c);
+}
+
+ThreadPool::Closure ThreadPool::tryRunOnNode(Closure c, int node, Priority p)
+{
+    Task t(std::move(c));
+    t = d->tryRun(std::move(t), p, node);
     return std::move(t.c);
 }
 void ThreadPool::stop()
@@ -182,14 +475,104 @@ int ThreadPool::currentThreadId() const
 {
     return d->currentThreadId();
 }
+ThreadPool::Closure ThreadPool::tryRunNext(Closure c, Priority p)
+{
+    Task t(std::move(c));
+    t = d->tryRunNext(std::move(t), p);
+    return std::move(t.c);
+}
+
+bool ThreadPool::runBulk(std::vector<Closure> &cs, Priority p)
+{
+    return d->runBulk(cs, p, -1);
+}
+
+bool ThreadPool::runBulkOnNode(std::vector<Closure> &cs, int node, Priority p)
+{
+    return d->runBulk(cs, p, node);
+}
+ThreadPool::SpinStats ThreadPool::spinStats() const
+{
+    return d->spinStats();
+}
+ThreadPool::Stats ThreadPool::stats() const
+{
+    return d->stats();
+}
+
+void ThreadPool::setActiveThreads(size_t n)
+{
+    d->setActiveThreads(n);
+}
+
+size_t ThreadPool::activeThreads() const
+{
+    return d->activeThreads();
+}
+
+size_t ThreadPool::pendingTasks() const
+{
+    return d->pendingTasks();
+}
+
+ThreadPool::BlockingScope::BlockingScope(ThreadPool &pool)
+    : m_pool(pool)
+    , m_counted(pool.d->beginBlocking())
+{
+}
+
+ThreadPool::BlockingScope::~BlockingScope()
+{
+    if (m_counted) {
+        m_pool.d->endBlocking();
+    }
+}
+
+uint64_t ThreadPool::Histogram::count() const
+{
+    uint64_t n = 0;
+    for (auto c : buckets) {
+        n += c;
+    }
+    return n;
+}
+
+uint64_t ThreadPool::Histogram::quantileUpperBound(double q) const
+{
+    const auto total = count();
+    if (total == 0) {
+        return 0;
+    }
+    const auto target = static_cast<uint64_t>(std::max(q, 0.0) * static_cast<double>(total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i != kNumBuckets; ++i) {
+        seen += buckets[i];
+        if (seen > target || seen == total) {
+            return uint64_t{1} << i;
+        }
+    }
+    return uint64_t{1} << (kNumBuckets - 1);
+}
+size_t ThreadPool::numNodes() const
+{
+    return d->numNodes();
+}
+int ThreadPool::currentNode() const
+{
+    return d->currentNode();
+}
 
 ThreadPoolPrivate::ThreadPoolPrivate(ThreadPool *q, const ThreadPoolOptions &options)
     : q(q)
     , m_options(options)
-    // Queue is not movable or copyable, thus can only be constructed this way
-    , m_queues(options.numThreads)
     // Waiter is not movable or copyable, thus can only be constructed this way
     , m_waiters(options.numThreads)
+    // NextSlot is not movable or copyable either
+    , m_nextSlots(options.numThreads)
+    , m_counters(options.numThreads)
+    , m_active(options.activeThreads == 0 ? options.numThreads
+                                          : std::min(options.activeThreads, options.numThreads))
+    , m_topology(options.topology ? options.topology : CpuTopology::system())
     , m_blocked(0)
     , m_spinning(false)
     , m_done(false)
@@ -198,9 +581,33 @@ ThreadPoolPrivate::ThreadPoolPrivate(ThreadPool *q, const ThreadPoolOptions &opt
 {
     auto numThreads = m_options.numThreads;
 
+    if (!m_options.allowSpinning) {
+        m_options.spinCount = m_options.minSpinCount = m_options.maxSpinCount = 0;
+    }
+    if (m_options.spinCount < 0) {
+        m_options.spinCount = 0;
+    }
+    if (m_options.minSpinCount < 0) {
+        m_options.minSpinCount = 0;
+    }
+    if (m_options.maxSpareThreads < 0) {
+        m_options.maxSpareThreads = static_cast<int>(numThreads);
+    }
+    if (m_options.maxSpinCount < 0) {
+        m_options.maxSpinCount = 4 * m_options.spinCount;
+    }
+    m_options.maxSpinCount = std::max(m_options.maxSpinCount, m_options.minSpinCount);
+    m_options.spinCount = std::clamp(m_options.spinCount, m_options.minSpinCount, m_options.maxSpinCount);
+
     m_threads.reserve(numThreads);
     m_coprimes.reserve(numThreads);
 
+    for (size_t l = 0; l != kNumLevels; ++l) {
+        // Queue is not movable or copyable, thus can only be constructed this way
+        m_queues[l] = vector<Queue>(numThreads);
+        m_overflowSize[l] = 0;
+    }
+
     // Calculate coprimes of numThreads.
     // Coprimes are used for a random walk over all threads in Steal
     // and NonEmptyQueueIndex. Iteration is based on the fact that if we take
@@ -222,21 +629,80 @@ ThreadPoolPrivate::ThreadPoolPrivate(ThreadPool *q, const ThreadPoolOptions &opt
         }
     }
 
+    placeWorkers();
+
+    spawnWorkers(m_active);
+}
+
+void ThreadPoolPrivate::placeWorkers()
+{
+    const auto numThreads = m_options.numThreads;
+    const auto numNodes = m_topology->numNodes();
+
+    m_workerNode.resize(numThreads);
+    m_workerCpu.resize(numThreads);
+    m_nodeWorkers.resize(numNodes);
     for (size_t i = 0; i < numThreads; i++) {
+        const auto node = i % numNodes;
+        const auto &cpus = m_topology->cpusOf(node);
+        m_workerNode[i] = static_cast<int>(node);
+        m_workerCpu[i] = cpus[(i / numNodes) % cpus.size()];
+        m_nodeWorkers[node].push_back(static_cast<unsigned>(i));
+    }
+}
+
+void ThreadPoolPrivate::spawnWorkers(size_t n)
+{
+    std::lock_guard<std::mutex> g(m_spawnMu);
+    if (m_done) {
+        return;
+    }
+    // Count the worker before it runs, so it takes part in the termination check in waitForWork
+    for (auto i = m_threads.size(); i < n; ++i) {
+        m_spawned.fetch_add(1);
         m_threads.emplace_back([this, i]() { workerLoop(i); });
     }
 }
 
-Task ThreadPoolPrivate::tryRun(Task t)
+void ThreadPoolPrivate::pinCurrentThread(int thread_id)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(m_workerCpu[thread_id], &set);
+    // Best effort, the thread simply stays unpinned if this fails
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+Task ThreadPoolPrivate::tryRun(Task t, Priority p, int node)
 {
+    const auto level = static_cast<size_t>(p);
+    assert(level < kNumLevels);
+
+    if (m_cancelled.load(std::memory_order_relaxed)) {
+        // Nothing will run it anymore
+        return t;
+    }
+
+    const auto nodeActive = activeOnNode(node);
+    stamp(t);
+
     auto pt = getPerThread();
-    if (pt->pool == this) {
+    if (pt->pool == this && (node < 0 || m_workerNode[pt->thread_id] == node)) {
         // Worker thread of this pool, push onto the thread's queue.
-        t = m_queues[pt->thread_id].PushFront(std::move(t));
+        t = m_queues[level][pt->thread_id].PushFront(std::move(t));
+    } else if (node >= 0) {
+        // Push onto a random queue of an active worker on the requested node.
+        const auto &workers = m_nodeWorkers[node];
+        t = m_queues[level][workers[rand(&pt->rand) % nodeActive]].PushBack(std::move(t));
     } else {
         // A free-standing thread (or worker of another pool), push onto a random
         // queue.
-        t = m_queues[rand(&pt->rand) % m_queues.size()].PushBack(std::move(t));
+        t = m_queues[level][rand(&pt->rand) % m_active.load(std::memory_order_relaxed)].PushBack(std::move(t));
+    }
+    if (t) {
+        // The queue is full, never give the task back to caller.
+        pushOverflow(std::move(t), level);
+        t = {};
     }
     // Note: below we touch this after making w available to worker threads.
     // Strictly speaking, this can lead to a racy-use-after-free. Consider that
@@ -245,8 +711,133 @@ Task ThreadPoolPrivate::tryRun(Task t)
     // completes overall computations, which in turn leads to destruction of
     // this. We expect that such scenario is prevented by program, that is,
     // this is kept alive while any threads can potentially be in Schedule.
-    if (!t) {
+    m_ec.Notify(false);
+    maybeWakeSpare();
+    return t;
+}
+
+Task ThreadPoolPrivate::tryRunNext(Task t, Priority p)
+{
+    auto pt = getPerThread();
+    if (pt->pool != this || m_cancelled.load(std::memory_order_relaxed)) {
+        return tryRun(std::move(t), p, -1);
+    }
+
+    const auto level = static_cast<size_t>(p);
+    assert(level < kNumLevels);
+
+    stamp(t);
+    auto &slot = m_nextSlots[pt->thread_id];
+    Task prev;
+    size_t prevLevel;
+    {
+        std::lock_guard<std::mutex> g(slot.mu);
+        prev = std::move(slot.task);
+        prevLevel = slot.level;
+        slot.task = std::move(t);
+        slot.level = level;
+        slot.full.store(true, std::memory_order_release);
+    }
+
+    // No one needs to be woken up for the slot, as this worker runs it next.
+    // But the previous occupant is now up for grabs.
+    if (prev) {
+        prev = m_queues[prevLevel][pt->thread_id].PushFront(std::move(prev));
+        if (prev) {
+            pushOverflow(std::move(prev), prevLevel);
+        }
         m_ec.Notify(false);
+        maybeWakeSpare();
+    }
+    return {};
+}
+
+Task ThreadPoolPrivate::takeNext(size_t worker, size_t level)
+{
+    auto &slot = m_nextSlots[worker];
+    if (!slot.full.load(std::memory_order_acquire)) {
+        return {};
+    }
+    std::lock_guard<std::mutex> g(slot.mu);
+    if (!slot.task || slot.level != level) {
+        return {};
+    }
+    slot.full.store(false, std::memory_order_relaxed);
+    return std::move(slot.task);
+}
+
+size_t ThreadPoolPrivate::activeOnNode(int &node) const
+{
+    if (node >= static_cast<int>(m_nodeWorkers.size()) || m_nodeWorkers.size() == 1) {
+        node = -1;
+    }
+    if (node < 0) {
+        return 0;
+    }
+    // Workers of a node are in ascending order, and those taking work are the ones below m_active.
+    // A node may have none, with fewer threads than nodes or after setActiveThreads.
+    const auto &workers = m_nodeWorkers[node];
+    const auto active = m_active.load(std::memory_order_relaxed);
+    const auto nodeActive =
+        static_cast<size_t>(std::lower_bound(workers.begin(), workers.end(), active) - workers.begin());
+    if (nodeActive == 0) {
+        node = -1;
+    }
+    return nodeActive;
+}
+
+bool ThreadPoolPrivate::runBulk(vector<ThreadPool::Closure> &cs, Priority p, int node)
+{
+    if (cs.empty()) {
+        return true;
+    }
+    if (m_cancelled.load(std::memory_order_relaxed)) {
+        // Nothing will run them anymore, give them back
+        return false;
+    }
+
+    const auto level = static_cast<size_t>(p);
+    assert(level < kNumLevels);
+
+    // Spread over queues of the node, or all active ones, in round-robin order from a random start,
+    // so each woken worker is likely to find something in its own queue.
+    auto pt = getPerThread();
+    const auto nodeActive = activeOnNode(node);
+    const auto numThreads = node >= 0 ? nodeActive : m_active.load(std::memory_order_relaxed);
+    auto victim = rand(&pt->rand) % numThreads;
+    for (auto &c : cs) {
+        Task t(std::move(c));
+        stamp(t);
+        t = m_queues[level][node >= 0 ? m_nodeWorkers[node][victim] : victim].PushBack(std::move(t));
+        if (t) {
+            pushOverflow(std::move(t), level);
+        }
+        if (++victim == numThreads) {
+            victim = 0;
+        }
+    }
+
+    m_ec.NotifyMany(static_cast<unsigned>(std::min(cs.size(), numThreads)));
+    maybeWakeSpare();
+    cs.clear();
+    return true;
+}
+
+void ThreadPoolPrivate::pushOverflow(Task &&t, size_t level)
+{
+    m_overflowPushes.fetch_add(1, std::memory_order_relaxed);
+    m_overflowSize[level].fetch_add(1);
+    m_overflow[level].enqueue(std::move(t));
+}
+
+Task ThreadPoolPrivate::popOverflow(size_t level)
+{
+    if (overflowEmpty(level)) {
+        return {};
+    }
+    Task t;
+    if (m_overflow[level].try_dequeue(t)) {
+        m_overflowSize[level].fetch_sub(1);
     }
     return t;
 }
@@ -258,15 +849,209 @@ void ThreadPoolPrivate::stop()
 
     // Wake up the threads without work to let them exit on their own.
     m_ec.Notify(true);
+    {
+        std::lock_guard<std::mutex> g(m_inactiveMu);
+        m_inactiveCv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> g(m_spareMu);
+        m_spareCv.notify_all();
+    }
+}
+
+void ThreadPoolPrivate::setActiveThreads(size_t n)
+{
+    n = std::clamp<size_t>(n, 1, m_options.numThreads);
+    // Queues below m_active may be pushed to at any time, so their workers must exist first
+    spawnWorkers(n);
+    {
+        std::lock_guard<std::mutex> g(m_inactiveMu);
+        m_active = n;
+        m_inactiveCv.notify_all();
+    }
+    // Parked workers above the limit need to notice they are no longer active
+    m_ec.Notify(true);
+}
+
+size_t ThreadPoolPrivate::activeThreads() const
+{
+    return m_active;
+}
+
+size_t ThreadPoolPrivate::pendingTasks() const
+{
+    size_t n = 0;
+    for (size_t l = 0; l != kNumLevels; ++l) {
+        n += m_overflowSize[l].load(std::memory_order_relaxed);
+        for (const auto &q : m_queues[l]) {
+            n += q.Size();
+        }
+    }
+    return n;
+}
+
+void ThreadPoolPrivate::parkInactive(PerThread *pt)
+{
+    // Others may steal from us, but we are not going to look at the queue for a while
+    size_t moved = 0;
+    for (size_t level = 0; level != kNumLevels; ++level) {
+        auto t = takeNext(pt->thread_id, level);
+        if (!t) {
+            t = m_queues[level][pt->thread_id].PopFront();
+        }
+        for (; t; t = m_queues[level][pt->thread_id].PopFront()) {
+            pushOverflow(std::move(t), level);
+            ++moved;
+        }
+    }
+    // We may also have consumed a notification meant for an active worker, pass it on
+    m_ec.NotifyMany(static_cast<unsigned>(std::max<size_t>(moved, 1)));
+    maybeWakeSpare();
+
+    std::unique_lock<std::mutex> l(m_inactiveMu);
+    m_inactiveCv.wait(l, [this, pt]() { return !isInactive(pt->thread_id); });
 }
 
 void ThreadPoolPrivate::join()
 {
+    std::lock_guard<std::mutex> g(m_spawnMu);
     for (auto &thr : m_threads) {
         if (thr.joinable()) {
             thr.join();
         }
     }
+    joinSpares();
+}
+
+bool ThreadPoolPrivate::beginBlocking()
+{
+    auto pt = getPerThread();
+    if (pt->pool != this) {
+        // A blocking compensating thread needs compensation as well, but has no next slot
+        return pt->spareOf == this && countBlocking();
+    }
+
+    // Nobody else would run our next task while we block, make it available for stealing
+    for (size_t level = 0; level != kNumLevels; ++level) {
+        auto t = takeNext(pt->thread_id, level);
+        if (!t) {
+            continue;
+        }
+        t = m_queues[level][pt->thread_id].PushFront(std::move(t));
+        if (t) {
+            pushOverflow(std::move(t), level);
+        }
+        m_ec.Notify(false);
+        break;
+    }
+
+    return countBlocking();
+}
+
+bool ThreadPoolPrivate::countBlocking()
+{
+    m_blockingRegions.fetch_add(1, std::memory_order_relaxed);
+    const auto blocking = static_cast<size_t>(m_blockingWorkers.fetch_add(1) + 1);
+
+    std::lock_guard<std::mutex> g(m_spareMu);
+    if (m_cancelled) {
+        return true;
+    }
+    if (m_idleSpares.load() > 0) {
+        m_spareCv.notify_one();
+    } else if (m_liveSpares < blocking && m_liveSpares < static_cast<size_t>(m_options.maxSpareThreads)) {
+        spawnSpareUnsafe();
+    }
+    return true;
+}
+
+void ThreadPoolPrivate::endBlocking()
+{
+    m_blockingWorkers.fetch_sub(1);
+}
+
+void ThreadPoolPrivate::spawnSpareUnsafe()
+{
+    reapSparesUnsafe();
+
+    auto &spare = m_spares.emplace_back();
+    ++m_liveSpares;
+    m_sparesStarted.fetch_add(1, std::memory_order_relaxed);
+    spare.thr = std::thread([this, &spare]() { spareLoop(spare); });
+}
+
+void ThreadPoolPrivate::reapSparesUnsafe()
+{
+    for (auto it = m_spares.begin(); it != m_spares.end();) {
+        if (it->exited.load()) {
+            it->thr.join();
+            it = m_spares.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ThreadPoolPrivate::joinSpares()
+{
+    std::unique_lock<std::mutex> l(m_spareMu);
+    m_spareCv.notify_all();
+    m_sparesGone.wait(l, [this]() { return m_liveSpares == 0; });
+    for (auto &spare : m_spares) {
+        spare.thr.join();
+    }
+    m_spares.clear();
+}
+
+void ThreadPoolPrivate::spareLoop(Spare &self)
+{
+    auto pt = getPerThread();
+    // Not a worker of this pool as far as queues are concerned
+    pt->pool = nullptr;
+    pt->rand = std::hash<std::thread::id>()(std::this_thread::get_id());
+    pt->thread_id = -1;
+    pt->spareOf = this;
+
+    const auto timeout = std::chrono::milliseconds(m_options.spareIdleTimeoutMs);
+
+    std::unique_lock<std::mutex> l(m_spareMu, std::defer_lock);
+    while (!m_cancelled) {
+        Task t;
+        for (size_t level = 0; level != kNumLevels && !t; ++level) {
+            t = popOverflow(level);
+            if (!t) {
+                t = steal(level);
+            }
+        }
+        if (t) {
+            runTask(pt, t);
+            continue;
+        }
+
+        l.lock();
+        m_idleSpares.fetch_add(1);
+        // Pairs with the check of m_idleSpares after submission
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto status = std::cv_status::no_timeout;
+        if (!m_cancelled && !m_done && !anyNonEmpty()) {
+            status = m_spareCv.wait_for(l, timeout);
+        }
+        m_idleSpares.fetch_sub(1);
+
+        const bool needed = m_liveSpares <= static_cast<size_t>(std::max(m_blockingWorkers.load(), 0));
+        if ((m_done && !anyNonEmpty()) || (status == std::cv_status::timeout && !needed)) {
+            break;
+        }
+        l.unlock();
+    }
+
+    if (!l.owns_lock()) {
+        l.lock();
+    }
+    --m_liveSpares;
+    m_sparesRetired.fetch_add(1, std::memory_order_relaxed);
+    self.exited = true;
+    m_sparesGone.notify_all();
 }
 
 size_t ThreadPoolPrivate::numThreads() const
@@ -284,6 +1069,60 @@ int ThreadPoolPrivate::currentThreadId() const
     }
 }
 
+size_t ThreadPoolPrivate::numNodes() const
+{
+    return m_nodeWorkers.size();
+}
+
+ThreadPool::SpinStats ThreadPoolPrivate::spinStats() const
+{
+    ThreadPool::SpinStats stats;
+    stats.spinHits = m_spinHits.load(std::memory_order_relaxed);
+    stats.spinMisses = m_spinMisses.load(std::memory_order_relaxed);
+    stats.parks = m_parks.load(std::memory_order_relaxed);
+    stats.shortParks = m_shortParks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+ThreadPool::Stats ThreadPoolPrivate::stats() const
+{
+    ThreadPool::Stats stats;
+    stats.spin = spinStats();
+    stats.blockingRegions = m_blockingRegions.load(std::memory_order_relaxed);
+    stats.sparesStarted = m_sparesStarted.load(std::memory_order_relaxed);
+    stats.sparesRetired = m_sparesRetired.load(std::memory_order_relaxed);
+    if (!m_options.collectStats) {
+        return stats;
+    }
+    stats.overflowPushes = m_overflowPushes.load(std::memory_order_relaxed);
+    stats.workers.reserve(m_counters.size());
+    for (const auto &c : m_counters) {
+        auto &w = stats.workers.emplace_back();
+        w.tasks = c.tasks.load(std::memory_order_relaxed);
+        w.steals = c.steals.load(std::memory_order_relaxed);
+        w.failedSteals = c.failedSteals.load(std::memory_order_relaxed);
+        w.overflowPops = c.overflowPops.load(std::memory_order_relaxed);
+        w.parks = c.parks.load(std::memory_order_relaxed);
+        w.parkNs = c.parkNs.load(std::memory_order_relaxed);
+        w.runNs = c.runNs.load(std::memory_order_relaxed);
+        for (size_t i = 0; i != ThreadPool::Histogram::kNumBuckets; ++i) {
+            w.queueWaitUs.buckets[i] = c.queueWaitUs[i].load(std::memory_order_relaxed);
+            w.runTimeUs.buckets[i] = c.runTimeUs[i].load(std::memory_order_relaxed);
+        }
+    }
+    return stats;
+}
+
+int ThreadPoolPrivate::currentNode() const
+{
+    auto pt = getPerThread();
+    if (pt->pool == this) {
+        return m_workerNode[pt->thread_id];
+    } else {
+        return -1;
+    }
+}
+
 ThreadPoolPrivate::~ThreadPoolPrivate()
 {
     m_done = true;
@@ -291,13 +1130,24 @@ ThreadPoolPrivate::~ThreadPoolPrivate()
     // Now if all threads block without work, they will start exiting.
     // But note that threads can continue to work arbitrary long,
     // block, submit new work, unblock and otherwise live full life.
+    {
+        std::lock_guard<std::mutex> g(m_inactiveMu);
+        m_inactiveCv.notify_all();
+    }
     if (!m_cancelled) {
         m_ec.Notify(true);
     } else {
+        // Compensating threads may still be stealing, let them go first
+        joinSpares();
         // Since we were cancelled, there might be entries in the queues.
         // Empty them to prevent their destructor from asserting.
-        for (auto &q : m_queues) {
-            q.Flush();
+        for (auto &qs : m_queues) {
+            for (auto &q : qs) {
+                q.Flush();
+            }
+        }
+        for (auto &slot : m_nextSlots) {
+            slot.task = {};
         }
     }
 
@@ -305,18 +1155,21 @@ ThreadPoolPrivate::~ThreadPoolPrivate()
     join();
 
     m_threads.clear();
-    m_queues.clear();
+    for (auto &qs : m_queues) {
+        qs.clear();
+    }
 }
 
-int ThreadPoolPrivate::nonEmptyQueueIndex()
+int ThreadPoolPrivate::nonEmptyQueueIndex(size_t level)
 {
     auto pt = getPerThread();
-    const size_t size = m_queues.size();
+    const auto &queues = m_queues[level];
+    const size_t size = queues.size();
     unsigned r = rand(&pt->rand);
     unsigned inc = m_coprimes[r % m_coprimes.size()];
     unsigned victim = r % size;
     for (unsigned i = 0; i < size; i++) {
-        if (!m_queues[victim].Empty()) {
+        if (!queues[victim].Empty()) {
             return victim;
         }
         victim += inc;
@@ -327,17 +1180,29 @@ int ThreadPoolPrivate::nonEmptyQueueIndex()
     return -1;
 }
 
+bool ThreadPoolPrivate::anyNonEmpty()
+{
+    for (size_t l = 0; l != kNumLevels; ++l) {
+        if (nonEmptyQueueIndex(l) != -1 || !overflowEmpty(l)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void ThreadPoolPrivate::workerLoop(int thread_id)
 {
     const auto numThreads = m_options.numThreads;
-    const auto spinCount = m_options.spinCount;
     const auto allowSpinning = m_options.allowSpinning;
 
     auto pt = getPerThread();
     pt->pool = this;
     pt->rand = std::hash<std::thread::id>()(std::this_thread::get_id());
     pt->thread_id = thread_id;
-    auto &q = m_queues[thread_id];
+    pt->spinBudget = m_options.spinCount;
+    if (m_options.pinThreads) {
+        pinCurrentThread(thread_id);
+    }
     auto waiter = &m_waiters[thread_id];
 
     if (numThreads == 1) {
@@ -348,11 +1213,13 @@ void ThreadPoolPrivate::workerLoop(int thread_id)
         // counter-productive for the types of I/O workloads the single thread
         // pools tend to be used for.
         while (!m_cancelled) {
-            auto t = q.PopFront();
-            for (int i = 0; i < spinCount && !t; i++) {
-                if (!m_cancelled.load(std::memory_order_relaxed)) {
-                    t = q.PopFront();
-                }
+            if (isInactive(thread_id)) {
+                parkInactive(pt);
+                continue;
+            }
+            auto t = findWork(pt, false);
+            if (!t) {
+                t = spinForWork(pt, false);
             }
             if (!t) {
                 if (!waitForWork(waiter, &t)) {
@@ -360,49 +1227,174 @@ void ThreadPoolPrivate::workerLoop(int thread_id)
                 }
             }
             if (t) {
-                t();
+                runTask(pt, t);
             }
         }
     } else {
         while (!m_cancelled) {
-            auto t = q.PopFront();
+            if (isInactive(thread_id)) {
+                parkInactive(pt);
+                continue;
+            }
+            auto t = findWork(pt, true);
             if (!t) {
-                t = steal();
+                // Leave one thread spinning. This reduces latency.
+                if (allowSpinning && !m_spinning && !m_spinning.exchange(true)) {
+                    t = spinForWork(pt, true);
+                    m_spinning = false;
+                }
                 if (!t) {
-                    // Leave one thread spinning. This reduces latency.
-                    if (allowSpinning && !m_spinning && !m_spinning.exchange(true)) {
-                        for (int i = 0; i < spinCount && !t; i++) {
-                            if (!m_cancelled.load(std::memory_order_relaxed)) {
-                                t = steal();
-                            } else {
-                                return;
-                            }
-                        }
-                        m_spinning = false;
-                    }
-                    if (!t) {
-                        if (!waitForWork(waiter, &t)) {
-                            return;
-                        }
+                    if (!waitForWork(waiter, &t)) {
+                        return;
                     }
                 }
             }
             if (t) {
-                t();
+                runTask(pt, t);
+            }
+        }
+    }
+}
+
+void ThreadPoolPrivate::runTask(PerThread *pt, Task &t)
+{
+    if (!m_options.collectStats || pt->thread_id < 0) {
+        t();
+        return;
+    }
+
+    auto &c = m_counters[pt->thread_id];
+    const auto start = nowNs();
+    if (t.enqueuedNs && start > t.enqueuedNs) {
+        WorkerCounters::add(c.queueWaitUs[WorkerCounters::bucketOf(start - t.enqueuedNs)], 1);
+    }
+    t();
+    const auto dur = nowNs() - start;
+    WorkerCounters::add(c.runTimeUs[WorkerCounters::bucketOf(dur)], 1);
+    WorkerCounters::add(c.runNs, dur);
+    WorkerCounters::add(c.tasks, 1);
+}
+
+Task ThreadPoolPrivate::spinForWork(PerThread *pt, bool canSteal)
+{
+    const auto budget = pt->spinBudget;
+    if (budget <= 0) {
+        return {};
+    }
+
+    Task t;
+    int i = 0;
+    for (; i < budget && !t; i++) {
+        if (m_cancelled.load(std::memory_order_relaxed)) {
+            return {};
+        }
+        t = findWork(pt, canSteal);
+    }
+
+    if (t) {
+        m_spinHits.fetch_add(1, std::memory_order_relaxed);
+        // Work arrived late in the spin, a slightly longer spin may save the next park.
+        if (i > budget / 2) {
+            pt->spinBudget = std::min(budget + budget / 2 + 1, m_options.maxSpinCount);
+        }
+    } else {
+        m_spinMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return t;
+}
+
+void ThreadPoolPrivate::adaptAfterPark(std::chrono::steady_clock::duration parked)
+{
+    m_parks.fetch_add(1, std::memory_order_relaxed);
+
+    auto pt = getPerThread();
+    if (m_options.collectStats) {
+        auto &c = m_counters[pt->thread_id];
+        WorkerCounters::add(c.parks, 1);
+        WorkerCounters::add(c.parkNs,
+                            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(parked).count()));
+    }
+    if (parked < std::chrono::microseconds(m_options.shortParkUs)) {
+        m_shortParks.fetch_add(1, std::memory_order_relaxed);
+        // Paid a futex round trip for a short gap, spin longer next time.
+        if (m_options.allowSpinning) {
+            pt->spinBudget = std::min(std::max(pt->spinBudget * 2, 1), m_options.maxSpinCount);
+        }
+    } else {
+        // Work is sparse, spinning mostly burns CPU.
+        pt->spinBudget = std::max(pt->spinBudget / 2, m_options.minSpinCount);
+    }
+}
+
+Task ThreadPoolPrivate::findWork(PerThread *pt, bool canSteal)
+{
+    // Normally from high to low, but reversed once in a while to avoid starvation
+    const bool reversed = agingPick(pt);
+    for (size_t i = 0; i != kNumLevels; ++i) {
+        const auto level = reversed ? kNumLevels - 1 - i : i;
+        auto t = takeNext(pt->thread_id, level);
+        if (!t) {
+            t = m_queues[level][pt->thread_id].PopFront();
+        }
+        if (!t) {
+            t = popOverflow(level);
+            if (t && m_options.collectStats) {
+                WorkerCounters::add(m_counters[pt->thread_id].overflowPops, 1);
+            }
+        }
+        if (!t && canSteal) {
+            t = steal(level);
+            if (t && m_options.collectStats) {
+                WorkerCounters::add(m_counters[pt->thread_id].steals, 1);
             }
         }
+        if (t) {
+            ++pt->picks;
+            return t;
+        }
+    }
+    if (canSteal && m_options.collectStats) {
+        WorkerCounters::add(m_counters[pt->thread_id].failedSteals, 1);
     }
+    return {};
 }
 
-Task ThreadPoolPrivate::steal()
+Task ThreadPoolPrivate::steal(size_t level)
 {
     auto pt = getPerThread();
-    const size_t size = m_queues.size();
+    auto &queues = m_queues[level];
+    const size_t size = queues.size();
+
+    // Try workers on the same node first, to keep data local
+    if (pt->thread_id >= 0 && m_nodeWorkers.size() > 1) {
+        const auto &local = m_nodeWorkers[m_workerNode[pt->thread_id]];
+        const size_t n = local.size();
+        unsigned start = rand(&pt->rand) % n;
+        for (size_t i = 0; i < n; i++) {
+            auto t = queues[local[(start + i) % n]].PopBack();
+            if (t) {
+                return t;
+            }
+        }
+    }
+
     unsigned r = rand(&pt->rand);
     unsigned inc = m_coprimes[r % m_coprimes.size()];
     unsigned victim = r % size;
     for (unsigned i = 0; i < size; i++) {
-        auto t = m_queues[victim].PopBack();
+        auto t = queues[victim].PopBack();
+        if (t) {
+            return t;
+        }
+        victim += inc;
+        if (victim >= size) {
+            victim -= size;
+        }
+    }
+
+    // Take others' next task only as a last resort, as it is hot in its owner's cache
+    for (unsigned i = 0; i < size; i++) {
+        auto t = takeNext(victim, level);
         if (t) {
             return t;
         }
@@ -418,29 +1410,38 @@ bool ThreadPoolPrivate::waitForWork(EventCount::Waiter *waiter, Task *t)
 {
     // We already did best-effort emptiness check in Steal, so prepare for blocking.
     m_ec.Prewait(waiter);
-    // Now do a reliable emptiness check.
-    int victim = nonEmptyQueueIndex();
-    if (victim != -1) {
-      m_ec.CancelWait(waiter);
-      if (m_cancelled) {
-        return false;
-      } else {
-        *t = m_queues[victim].PopBack();
-        return true;
+    // Now do a reliable emptiness check, from high priority level to low.
+    for (size_t l = 0; l != kNumLevels; ++l) {
+      int victim = nonEmptyQueueIndex(l);
+      if (victim != -1 || !overflowEmpty(l)) {
+        m_ec.CancelWait(waiter);
+        if (m_cancelled) {
+          return false;
+        } else {
+          *t = victim != -1 ? m_queues[l][victim].PopBack() : popOverflow(l);
+          return true;
+        }
       }
     }
+    // Workers exiting due to cancellation never count as blocked below, so a
+    // thread that prepared to wait after stop() must not commit, otherwise it
+    // waits forever for the others.
+    if (m_cancelled) {
+      m_ec.CancelWait(waiter);
+      return false;
+    }
     // Number of blocked threads is used as termination condition.
     // If we are shutting down and all worker threads blocked without work,
     // that's we are done.
     m_blocked++;
-    if (m_done && m_blocked == m_options.numThreads) {
+    if (m_done && m_blocked == m_spawned.load()) {
       m_ec.CancelWait(waiter);
       // Almost done, but need to re-check queues.
       // Consider that all queues are empty and all worker threads are preempted
       // right after incrementing blocked_ above. Now a free-standing thread
       // submits work and calls destructor (which sets done_). If we don't
       // re-check queues, we will exit leaving the work unexecuted.
-      if (nonEmptyQueueIndex() != -1) {
+      if (anyNonEmpty()) {
         // Note: we must not pop from queues before we decrement blocked_,
         // otherwise the following scenario is possible. Consider that instead
         // of checking for emptiness we popped the only element from queues.
@@ -454,7 +1455,9 @@ bool ThreadPoolPrivate::waitForWork(EventCount::Waiter *waiter, Task *t)
       m_ec.Notify(true);
       return false;
     }
+    const auto parkStart = std::chrono::steady_clock::now();
     m_ec.CommitWait(waiter);
     m_blocked--;
+    adaptAfterPark(std::chrono::steady_clock::now() - parkStart);
     return true;
 }
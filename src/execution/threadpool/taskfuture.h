@@ -0,0 +1,304 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EXECUTION_THREADPOOL_TASKFUTURE_H
+#define EXECUTION_THREADPOOL_TASKFUTURE_H
+
+#include <concurrentqueue.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+
+namespace detail {
+
+/**
+ * @brief Shared state between a TaskPromise and a TaskFuture.
+ * States are recycled through a per-type pool, so steady state use doesn't touch the global allocator.
+ * The mutex and condition variable are only used when the consumer has to block.
+ */
+template<typename R>
+class TaskState
+{
+public:
+    static TaskState *acquire()
+    {
+        TaskState *s = nullptr;
+        if (!freeList().frees.try_dequeue(s)) {
+            s = new TaskState;
+        }
+        s->m_refs.store(2, std::memory_order_relaxed);
+        return s;
+    }
+
+    void release()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        m_value.reset();
+        m_error = nullptr;
+        m_status.store(kEmpty, std::memory_order_relaxed);
+
+        auto &fl = freeList();
+        if (fl.frees.size_approx() >= FreeList::kMaxFree || !fl.frees.enqueue(this)) {
+            delete this;
+        }
+    }
+
+    template<typename... Args>
+    void setValue(Args &&... args)
+    {
+        if constexpr (!std::is_void_v<R>) {
+            m_value.emplace(std::forward<Args>(args)...);
+        }
+        markReady();
+    }
+
+    void setException(std::exception_ptr e)
+    {
+        m_error = std::move(e);
+        markReady();
+    }
+
+    bool ready() const
+    {
+        return m_status.load(std::memory_order_acquire) == kReady;
+    }
+
+    void wait()
+    {
+        // Results are usually either already there or very close, so spin a little before blocking
+        for (int i = 0; i < kSpinCount; ++i) {
+            if (ready()) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mu);
+        auto status = kEmpty;
+        if (m_status.compare_exchange_strong(status, kWaiting, std::memory_order_acq_rel)
+            || status == kWaiting) {
+            m_cv.wait(lock, [this]() { return ready(); });
+        }
+    }
+
+    auto get()
+    {
+        wait();
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        if constexpr (!std::is_void_v<R>) {
+            return std::move(*m_value);
+        }
+    }
+
+private:
+    TaskState() = default;
+
+    void markReady()
+    {
+        if (m_status.exchange(kReady, std::memory_order_acq_rel) == kWaiting) {
+            // Lock to not race with the waiter between its check and wait
+            std::lock_guard<std::mutex> g(m_mu);
+            m_cv.notify_all();
+        }
+    }
+
+    struct FreeList
+    {
+        constexpr static size_t kMaxFree = 1024;
+        moodycamel::ConcurrentQueue<TaskState *> frees;
+    };
+
+    static FreeList &freeList()
+    {
+        // Intentionally leaked: futures may be released by other static objects during exit,
+        // after a function-local static would have been destroyed.
+        static auto *fl = new FreeList;
+        return *fl;
+    }
+
+    constexpr static int kSpinCount = 64;
+    enum Status : int
+    {
+        kEmpty,
+        kWaiting,
+        kReady,
+    };
+
+    using Storage = std::conditional_t<std::is_void_v<R>, bool, R>;
+    std::optional<Storage> m_value;
+    std::exception_ptr m_error;
+    std::atomic<int> m_refs{0};
+    std::atomic<Status> m_status{kEmpty};
+    std::mutex m_mu;
+    std::condition_variable m_cv;
+};
+
+} // namespace detail
+
+template<typename R>
+class TaskPromise;
+
+/**
+ * @brief A lightweight move-only future returned by ThreadPool::post.
+ * Like std::future, get() may only be called once.
+ */
+template<typename R>
+class TaskFuture
+{
+public:
+    TaskFuture() = default;
+    ~TaskFuture()
+    {
+        if (m_state) {
+            m_state->release();
+        }
+    }
+
+    TaskFuture(TaskFuture &&other) noexcept
+        : m_state(std::exchange(other.m_state, nullptr))
+    {
+    }
+    TaskFuture &operator=(TaskFuture &&other) noexcept
+    {
+        if (this != &other) {
+            if (m_state) {
+                m_state->release();
+            }
+            m_state = std::exchange(other.m_state, nullptr);
+        }
+        return *this;
+    }
+    TaskFuture(const TaskFuture &) = delete;
+    TaskFuture &operator=(const TaskFuture &) = delete;
+
+    bool valid() const
+    {
+        return m_state != nullptr;
+    }
+
+    bool ready() const
+    {
+        return m_state && m_state->ready();
+    }
+
+    void wait() const
+    {
+        m_state->wait();
+    }
+
+    /**
+     * @brief Wait for and return the result, or rethrow the exception thrown by the task.
+     * The future becomes invalid afterwards.
+     */
+    R get()
+    {
+        auto s = std::exchange(m_state, nullptr);
+        // release the state even if get throws
+        struct Releaser
+        {
+            detail::TaskState<R> *s;
+            ~Releaser()
+            {
+                s->release();
+            }
+        } r{s};
+        return s->get();
+    }
+
+private:
+    friend class TaskPromise<R>;
+    explicit TaskFuture(detail::TaskState<R> *s)
+        : m_state(s)
+    {
+    }
+
+    detail::TaskState<R> *m_state = nullptr;
+};
+
+/**
+ * @brief Producer side of TaskFuture. If destroyed without a result, for example when the closure
+ * holding it is dropped by a stopped pool, the future gets a broken_promise error.
+ */
+template<typename R>
+class TaskPromise
+{
+public:
+    TaskPromise()
+        : m_state(detail::TaskState<R>::acquire())
+    {
+    }
+    ~TaskPromise()
+    {
+        if (m_state) {
+            m_state->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+            m_state->release();
+        }
+    }
+
+    TaskPromise(TaskPromise &&other) noexcept
+        : m_state(std::exchange(other.m_state, nullptr))
+    {
+    }
+    TaskPromise &operator=(TaskPromise &&) = delete;
+    TaskPromise(const TaskPromise &) = delete;
+    TaskPromise &operator=(const TaskPromise &) = delete;
+
+    /**
+     * @brief Must be called exactly once, before any set*
+     */
+    TaskFuture<R> getFuture()
+    {
+        return TaskFuture<R>(m_state);
+    }
+
+    /**
+     * @brief Run f and store its result or exception
+     */
+    template<typename Func>
+    void setFrom(Func &f)
+    {
+        auto s = std::exchange(m_state, nullptr);
+        try {
+            if constexpr (std::is_void_v<R>) {
+                f();
+                s->setValue();
+            } else {
+                s->setValue(f());
+            }
+        } catch (...) {
+            s->setException(std::current_exception());
+        }
+        s->release();
+    }
+
+private:
+    detail::TaskState<R> *m_state;
+};
+
+#endif // EXECUTION_THREADPOOL_TASKFUTURE_H
@@ -21,14 +21,19 @@
 #define EXECUTION_THREADPOOL_H
 
 #include "utils/fixed_function.hpp"
+#include "execution/threadpool/cputopology.h"
+#include "execution/threadpool/taskfuture.h"
 
-#include <future>
+#include <array>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 struct ThreadPoolOptions
 {
     /**
-     * Number of threads in the thread pool.
+     * Maximum number of threads in the thread pool. Only activeThreads of them are started
+     * up front, the rest when ThreadPool::setActiveThreads raises the limit.
      * Use 0 for default value, which is std::thread::hardware_concurrency()
      */
     size_t numThreads = 0;
@@ -44,6 +49,61 @@ struct ThreadPoolOptions
      */
     int spinCount = -1;
 
+    /**
+     * Each worker adapts its spin budget, starting from spinCount. The budget grows when
+     * work arrives late in a spin or shortly after parking, and shrinks after long parks.
+     * These bound the budget. Use -1 for default values, which are 0 and 4 * spinCount.
+     */
+    int minSpinCount = -1;
+    int maxSpinCount = -1;
+
+    /**
+     * Parks shorter than this, in microseconds, would have been better spent spinning.
+     */
+    int shortParkUs = 50;
+
+    /**
+     * Whether to collect per-worker statistics, see ThreadPool::stats().
+     * This costs a few clock reads per task.
+     */
+    bool collectStats = true;
+
+    /**
+     * Maximum number of compensating threads started for workers inside a blocking region,
+     * see ThreadPool::BlockingScope. Use -1 for default value, which is numThreads
+     */
+    int maxSpareThreads = -1;
+
+    /**
+     * Compensating threads no longer needed exit after idling for this long, in milliseconds
+     */
+    int spareIdleTimeoutMs = 1000;
+
+    /**
+     * Number of workers initially taking work, see ThreadPool::setActiveThreads.
+     * Use 0 for default value, which is numThreads
+     */
+    size_t activeThreads = 0;
+
+    /**
+     * Every starvationLimit picks, a worker looks at lower priority levels first,
+     * so low priority work is never starved by a sustained stream of higher priority work.
+     * Use 0 to disable.
+     */
+    int starvationLimit = 32;
+
+    /**
+     * Pin each worker thread to one CPU in the process cpuset.
+     * Workers are spread over NUMA nodes in round-robin order.
+     */
+    bool pinThreads = false;
+
+    /**
+     * Topology used to group workers by NUMA node. Workers steal from the same node first.
+     * Use nullptr for default value, which is CpuTopology::system()
+     */
+    std::shared_ptr<const CpuTopology> topology;
+
     ThreadPoolOptions();
     ThreadPoolOptions(const ThreadPoolOptions &) = default;
     ThreadPoolOptions(ThreadPoolOptions &&) = default;
@@ -66,46 +126,180 @@ public:
     ThreadPool(ThreadPool &&other) = default;
     ThreadPool &operator=(ThreadPool &&other) = default;
 
-    using Closure = sstl::FixedFunction<void()>;
+    static constexpr size_t kClosureStorage = 128;
+    using Closure = sstl::FixedFunction<void(), kClosureStorage>;
+
+    /**
+     * @brief Convert f to a Closure. Functors too large for the inline storage of Closure
+     * are moved to heap, others are stored inline without allocation.
+     */
+    template<typename Func>
+    static Closure makeClosure(Func &&f)
+    {
+        using F = std::decay_t<Func>;
+        if constexpr (sizeof(F) < kClosureStorage) {
+            return Closure(std::forward<Func>(f));
+        } else {
+            return Closure([p = std::make_unique<F>(std::forward<Func>(f))]() { (*p)(); });
+        }
+    }
+
+    /**
+     * @brief Priority levels of submitted work. Workers always prefer higher levels,
+     * both in their own queue and when stealing, subject to ThreadPoolOptions::starvationLimit.
+     */
+    enum class Priority : uint8_t
+    {
+        High = 0,
+        Normal = 1,
+        Low = 2,
+    };
+    static constexpr size_t kNumPriorities = 3;
+
+    /**
+     * @brief Counters of worker spinning and parking, accumulated over the lifetime of the pool
+     */
+    struct SpinStats
+    {
+        // Spins that found work
+        uint64_t spinHits = 0;
+        // Spins that used up the budget without finding work
+        uint64_t spinMisses = 0;
+        // Times a worker parked waiting for work
+        uint64_t parks = 0;
+        // Parks that were shorter than ThreadPoolOptions::shortParkUs
+        uint64_t shortParks = 0;
+    };
+
+    /**
+     * @brief Declares that the current task is about to block, e.g. waiting on a device or a rendezvous.
+     * While in the scope, the pool runs a compensating thread for the blocked worker, so other
+     * queued work keeps going. Compensating threads exit after idling for
+     * ThreadPoolOptions::spareIdleTimeoutMs once the blocked workers are back.
+     * This is a no-op if not called from a worker of the pool.
+     */
+    class BlockingScope
+    {
+    public:
+        explicit BlockingScope(ThreadPool &pool);
+        ~BlockingScope();
+
+        BlockingScope(const BlockingScope &) = delete;
+        BlockingScope &operator=(const BlockingScope &) = delete;
+
+    private:
+        ThreadPool &m_pool;
+        bool m_counted;
+    };
+
+    /**
+     * @brief Sets the default priority of work submitted from the current thread within its scope.
+     * This is useful to tag work submitted through interfaces that can't carry a priority.
+     */
+    class PriorityScope
+    {
+    public:
+        explicit PriorityScope(Priority p);
+        ~PriorityScope();
+
+        PriorityScope(const PriorityScope &) = delete;
+        PriorityScope &operator=(const PriorityScope &) = delete;
+
+    private:
+        Priority m_prev;
+    };
+
+    /**
+     * @returns default priority of work submitted from the current thread
+     */
+    static Priority currentPriority();
 
     /**
      * @brief Try run a closure c in thread pool.
-     * @returns c itself if queue is full. Otherwise a default constructed Closure.
+     * If per-thread queues are full, c goes to an unbounded overflow queue, which workers
+     * drain after their own queue. This never blocks.
+     * @returns c itself if the pool is stopped. Otherwise a default constructed Closure.
+     */
+    Closure tryRun(Closure c, Priority p = currentPriority());
+
+    /**
+     * @brief Like tryRun, but prefer workers on NUMA node `node`.
+     * Negative or out of range node means no preference.
+     */
+    Closure tryRunOnNode(Closure c, int node, Priority p = currentPriority());
+
+    /**
+     * @brief Run c as the next task of the calling worker, for continuations whose inputs are
+     * hot in this core's cache. Each worker has a single LIFO slot, which it checks before its
+     * own queue. A previous occupant is moved to the front of the worker's queue. Idle workers
+     * only take from the slot after finding no other work, and no worker is woken for it.
+     * If not called from a worker of this pool, this is the same as tryRun.
+     * @returns c itself if the pool is stopped. Otherwise a default constructed Closure.
      */
-    Closure tryRun(Closure c);
+    Closure tryRunNext(Closure c, Priority p = currentPriority());
+
+    /**
+     * @brief Run all closures in cs in thread pool as one batch. Closures are spread over
+     * worker queues, and at most min(cs.size(), number of idle workers) workers are woken up.
+     * @returns false if the pool is stopped, in which case cs is left untouched. Otherwise cs is
+     * cleared and returns true.
+     */
+    bool runBulk(std::vector<Closure> &cs, Priority p = currentPriority());
+
+    /**
+     * @brief Like runBulk, but spread closures over workers on NUMA node `node`.
+     * Negative or out of range node means no preference.
+     */
+    bool runBulkOnNode(std::vector<Closure> &cs, int node, Priority p = currentPriority());
 
     /**
      * @brief Run the Func f in thread pool, don't care about its completion.
      * This may be more efficient, because no wrapper task for future/promise is created.
-     * If the queue is full, then f is run on calling thread.
+     * Full per-thread queues spill to the overflow queue, so f only runs on calling thread
+     * if the pool is stopped.
      */
     template<typename Func>
-    void run(Func f)
+    void run(Func f, Priority p = currentPriority())
     {
-        auto c = tryRun(std::move(f));
+        auto c = tryRun(makeClosure(std::move(f)), p);
         if (c) {
-            // enqueue failed, run on current thread
+            // pool stopped, run on current thread
             c();
         }
     }
 
     /**
      * @brief Post the function f to thread pool, returns with a future holding the result.
-     * If the queue is full, then closure is executed on caller thread before return.
-     * @returns future holding the return value of function f.
+     * If the pool is stopped, then closure is executed on caller thread before return.
+     * The future's shared state comes from a pool, so this doesn't allocate in steady state
+     * unless f is too large to fit in a Closure.
+     * @returns future holding the return value of function f, or the exception it throws.
      */
     template<typename Func>
-    auto post(Func f)
+    auto post(Func f, Priority p = currentPriority())
     {
         using R = std::invoke_result_t<Func>;
-        using Task = std::packaged_task<R()>;
 
-        Task tk(std::move(f));
-        auto fu = tk.get_future();
-        run(std::move(tk));
+        TaskPromise<R> promise;
+        auto fu = promise.getFuture();
+        run([f = std::move(f), promise = std::move(promise)]() mutable { promise.setFrom(f); }, p);
         return fu;
     }
 
+    /**
+     * @brief Run the Func f as the next task of the calling worker, see tryRunNext.
+     * f only runs on calling thread if the pool is stopped.
+     */
+    template<typename Func>
+    void runNext(Func f, Priority p = currentPriority())
+    {
+        auto c = tryRunNext(makeClosure(std::move(f)), p);
+        if (c) {
+            // pool stopped, run on current thread
+            c();
+        }
+    }
+
     /**
      * @brief Signal to stop the thread pool, currently running tasks will continue to run.
      */
@@ -117,16 +311,109 @@ public:
     void join();
 
     /**
-     * @returns the number of threads in the pool
+     * @returns the maximum number of threads in the pool
      */
     size_t numThreads() const;
 
+    /**
+     * @brief Limit the number of workers taking work to n, clamped to [1, numThreads()].
+     * Workers above the limit hand their queued work to others and sleep until the limit
+     * is raised again. Tasks already running are not interrupted. Workers not yet started
+     * are started here.
+     */
+    void setActiveThreads(size_t n);
+
+    /**
+     * @returns the number of workers taking work
+     */
+    size_t activeThreads() const;
+
+    /**
+     * @returns approximate number of tasks queued but not yet started
+     */
+    size_t pendingTasks() const;
+
     /**
      * @returns a logical thread index between 0 and numThreads() - 1 if called
      * from one of the threads in the pool. Returns -1 otherwise.
      */
     int currentThreadId() const;
 
+    /**
+     * @returns spinning and parking counters of all workers
+     */
+    SpinStats spinStats() const;
+
+    /**
+     * @brief Log2 histogram of durations in microseconds.
+     * Bucket 0 counts values below 1us, bucket i counts values in [2^(i-1), 2^i) us,
+     * and the last bucket also counts everything larger.
+     */
+    struct Histogram
+    {
+        static constexpr size_t kNumBuckets = 24;
+        std::array<uint64_t, kNumBuckets> buckets{};
+
+        uint64_t count() const;
+
+        /**
+         * @returns upper bound in microseconds of the bucket containing the q-th quantile, q in [0, 1]
+         */
+        uint64_t quantileUpperBound(double q) const;
+    };
+
+    /**
+     * @brief Statistics of a single worker, accumulated over the lifetime of the pool
+     */
+    struct WorkerStats
+    {
+        // Tasks run
+        uint64_t tasks = 0;
+        // Tasks taken from other workers' queues or next slots
+        uint64_t steals = 0;
+        // Searches for work including stealing that found nothing
+        uint64_t failedSteals = 0;
+        // Tasks taken from the overflow queue
+        uint64_t overflowPops = 0;
+        // Times parked, and total nanoseconds parked
+        uint64_t parks = 0;
+        uint64_t parkNs = 0;
+        // Total nanoseconds running tasks
+        uint64_t runNs = 0;
+
+        Histogram queueWaitUs;
+        Histogram runTimeUs;
+    };
+
+    struct Stats
+    {
+        std::vector<WorkerStats> workers;
+        // Submissions that didn't fit in per-thread queues
+        uint64_t overflowPushes = 0;
+        SpinStats spin;
+        // Blocking regions entered by workers, and compensating threads started and exited
+        uint64_t blockingRegions = 0;
+        uint64_t sparesStarted = 0;
+        uint64_t sparesRetired = 0;
+    };
+
+    /**
+     * @returns a snapshot of per-worker statistics. Empty if ThreadPoolOptions::collectStats is false.
+     * Counters are read without synchronization with workers, so they may be slightly inconsistent with each other.
+     */
+    Stats stats() const;
+
+    /**
+     * @returns the number of NUMA nodes workers are grouped into
+     */
+    size_t numNodes() const;
+
+    /**
+     * @returns the NUMA node of the calling thread if it is one of the threads in the pool.
+     * Returns -1 otherwise.
+     */
+    int currentNode() const;
+
 private:
     std::unique_ptr<ThreadPoolPrivate> d;
 };
@@ -42,6 +42,7 @@ namespace {
 
 namespace flags {
 const static auto listen = "--listen";
+const static auto ipc = "--ipc";
 const static auto maxHolWaiting = "--max-hol-waiting";
 const static auto disableFairness = "--disable-fairness";
 const static auto disableWorkConservative = "--disable-wc";
@@ -70,8 +71,11 @@ Options:
     -l <endpoint>, --listen=<endpoint>
                                 Listen on ZeroMQ endpoint <endpoint>.
                                 [default: tcp://*:5501]
+    --ipc=<endpoint>            Also listen on ZeroMQ endpoint <endpoint>, e.g.
+                                ipc:///tmp/salus.sock, for clients on the same host.
+                                These clients may pass tensors in shared memory.
     -s <policy>, --sched=<policy>
-                                Use <policy> for scheduling . Choices: fair, preempt, pack, rr, fifo.
+                                Use <policy> for scheduling . Choices: fair, drf, preempt, pack, rr, fifo.
                                 [default: pack]
     --disable-wc                Disable work conservation. Only have effect when
                                 fairness is on.
@@ -260,8 +264,9 @@ int main(int argc, char **argv)
     // Then start server to accept request
     ZmqServer server;
     const auto &listen = (args)[flags::listen].asString();
-    LOG(INFO) << "Starting server listening at " << listen;
-    server.start(listen);
+    const auto ipc = value_or<std::string>(args[flags::ipc], ""s);
+    LOG(INFO) << "Starting server listening at " << listen << (ipc.empty() ? "" : " and ") << ipc;
+    server.start(listen, ipc);
 
     server.join();
 
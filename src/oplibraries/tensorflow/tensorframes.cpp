@@ -0,0 +1,215 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "oplibraries/tensorflow/tensorframes.h"
+
+#include "utils/macros.h"
+#include "utils/shmring.h"
+
+#include <cstring>
+
+namespace salus::oplib::tensorflow {
+
+namespace {
+
+/**
+ * Hands out the memory of a single frame to a single tensor, and frees the frame together with itself
+ * when the tensor buffer is released.
+ */
+class FrameAllocator : public tf::Allocator
+{
+public:
+    explicit FrameAllocator(zmq::message_t &&frame)
+        : m_frame(std::move(frame))
+    {
+    }
+
+    std::string Name() override
+    {
+        return "zmq_frame";
+    }
+
+    void *AllocateRaw(size_t alignment, size_t num_bytes) override
+    {
+        UNUSED(alignment);
+        DCHECK_EQ(num_bytes, m_frame.size());
+        return m_frame.data();
+    }
+
+    void DeallocateRaw(void *ptr) override
+    {
+        DCHECK_EQ(ptr, m_frame.data());
+        delete this;
+    }
+
+private:
+    zmq::message_t m_frame;
+};
+
+/**
+ * Hands out a range of a shared memory ring to a single tensor, and releases the range back to the
+ * producer together with itself when the tensor buffer is released.
+ */
+class ShmAllocator : public tf::Allocator
+{
+public:
+    ShmAllocator(std::shared_ptr<sstl::ShmRing> ring, uint64_t pos, size_t size)
+        : m_ring(std::move(ring))
+        , m_pos(pos)
+        , m_size(size)
+    {
+    }
+
+    std::string Name() override
+    {
+        return "shm_ring";
+    }
+
+    void *AllocateRaw(size_t alignment, size_t num_bytes) override
+    {
+        UNUSED(alignment);
+        DCHECK_EQ(num_bytes, m_size);
+        return m_ring->at(m_pos, m_size);
+    }
+
+    void DeallocateRaw(void *ptr) override
+    {
+        DCHECK_EQ(ptr, m_ring->at(m_pos, m_size));
+        m_ring->release(m_pos, m_size);
+        delete this;
+    }
+
+private:
+    std::shared_ptr<sstl::ShmRing> m_ring;
+    uint64_t m_pos;
+    size_t m_size;
+};
+
+Status checkShape(tf::DataType dtype, const tf::TensorShapeProto &shape, size_t size, tf::TensorShape *tshape)
+{
+    if (!canUseFrame(dtype)) {
+        return tf::errors::InvalidArgument("Tensor of type ", tf::DataTypeString(dtype), " can't use frames");
+    }
+    if (!tf::TensorShape::IsValid(shape)) {
+        return tf::errors::InvalidArgument("Invalid tensor shape in frame: ", shape.DebugString());
+    }
+    *tshape = tf::TensorShape(shape);
+
+    const auto expected = tshape->num_elements() * tf::DataTypeSize(dtype);
+    if (size != static_cast<size_t>(expected)) {
+        return tf::errors::InvalidArgument("Frame size ", size, " doesn't match tensor of ", tf::DataTypeString(dtype),
+                                           tshape->DebugString());
+    }
+    return Status::OK();
+}
+
+} // namespace
+
+bool canUseFrame(tf::DataType dtype)
+{
+    return tf::DataTypeCanUseMemcpy(dtype);
+}
+
+Status tensorFromFrame(tf::DataType dtype, const tf::TensorShapeProto &shape, zmq::message_t &&frame,
+                       tf::Tensor *out)
+{
+    DCHECK(out);
+    tf::TensorShape tshape;
+    TF_RETURN_IF_ERROR(checkShape(dtype, shape, frame.size(), &tshape));
+
+    // Empty tensors don't allocate
+    if (frame.size() == 0) {
+        *out = tf::Tensor(dtype, tshape);
+        return Status::OK();
+    }
+
+    // Eigen assumes aligned buffers, which the frame may not be
+    if (reinterpret_cast<uintptr_t>(frame.data()) % tf::Allocator::kAllocatorAlignment != 0) {
+        VLOG(2) << "Copying unaligned frame of size " << frame.size();
+        *out = tf::Tensor(dtype, tshape);
+        std::memcpy(const_cast<char *>(out->tensor_data().data()), frame.data(), frame.size());
+        return Status::OK();
+    }
+
+    *out = tf::Tensor(new FrameAllocator(std::move(frame)), dtype, tshape);
+    return Status::OK();
+}
+
+zmq::message_t frameFromTensor(const tf::Tensor &t)
+{
+    DCHECK(canUseFrame(t.dtype()));
+
+    auto data = const_cast<char *>(t.tensor_data().data());
+    auto size = t.tensor_data().size();
+    if (size == 0) {
+        return zmq::message_t();
+    }
+    // The copy shares t's buffer, and is deleted by zmq once the frame is sent
+    auto holder = new tf::Tensor(t);
+    return zmq::message_t(data, size, [](void *, void *hint) { delete static_cast<tf::Tensor *>(hint); }, holder);
+}
+
+Status tensorFromShm(const std::shared_ptr<sstl::ShmRing> &ring, tf::DataType dtype, const tf::TensorShapeProto &shape,
+                     uint64_t pos, uint64_t size, tf::Tensor *out)
+{
+    DCHECK(ring);
+    DCHECK(out);
+    if (size == 0) {
+        tf::TensorShape tshape;
+        TF_RETURN_IF_ERROR(checkShape(dtype, shape, 0, &tshape));
+        *out = tf::Tensor(dtype, tshape);
+        return Status::OK();
+    }
+
+    // The producer only hands out aligned positions, anything else is not a range it reserved
+    if (pos % sstl::ShmRing::kAlignment != 0 || !ring->at(pos, size)) {
+        return tf::errors::InvalidArgument("Invalid shared memory slice at ", pos, " of size ", size);
+    }
+
+    tf::TensorShape tshape;
+    auto s = checkShape(dtype, shape, size, &tshape);
+    if (!s.ok()) {
+        // Still give the space back, or the client would eventually block
+        ring->release(pos, size);
+        return s;
+    }
+
+    // Ring data and pos are aligned to ShmRing::kAlignment
+    static_assert(sstl::ShmRing::kAlignment % tf::Allocator::kAllocatorAlignment == 0);
+    *out = tf::Tensor(new ShmAllocator(ring, pos, size), dtype, tshape);
+    return Status::OK();
+}
+
+std::optional<uint64_t> tensorToShm(sstl::ShmRing &ring, const tf::Tensor &t)
+{
+    DCHECK(canUseFrame(t.dtype()));
+
+    auto data = t.tensor_data();
+    if (data.empty()) {
+        return {};
+    }
+    auto pos = ring.reserve(data.size());
+    if (!pos) {
+        return {};
+    }
+    std::memcpy(ring.at(*pos, data.size()), data.data(), data.size());
+    return pos;
+}
+
+} // namespace salus::oplib::tensorflow
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_OPLIB_TENSORFLOW_TENSORFRAMES_H
+#define SALUS_OPLIB_TENSORFLOW_TENSORFRAMES_H
+
+#include "oplibraries/tensorflow/tensorflow_headers.h"
+#include "oplibraries/tensorflow/tfutils.h"
+
+#include <zmq.hpp>
+
+#include <memory>
+#include <optional>
+
+namespace sstl {
+class ShmRing;
+} // namespace sstl
+
+namespace salus::oplib::tensorflow {
+
+/**
+ * @returns whether tensors of dtype can travel as raw payload frames
+ */
+bool canUseFrame(tf::DataType dtype);
+
+/**
+ * @brief Make a tensor from the content of a received payload frame.
+ *
+ * The tensor uses the frame's memory directly and keeps the frame alive, unless the frame is not
+ * aligned enough for Eigen, in which case the content is copied once.
+ */
+Status tensorFromFrame(tf::DataType dtype, const tf::TensorShapeProto &shape, zmq::message_t &&frame,
+                       tf::Tensor *out);
+
+/**
+ * @brief Make a payload frame from the content of tensor t without copying.
+ * The tensor's buffer is kept alive until the frame is sent.
+ */
+zmq::message_t frameFromTensor(const tf::Tensor &t);
+
+/**
+ * @brief Make a tensor from [pos, pos + size) in a shared memory ring the client produces into.
+ *
+ * The tensor uses the ring's memory directly, and releases the range back to the client when its
+ * buffer is released.
+ */
+Status tensorFromShm(const std::shared_ptr<sstl::ShmRing> &ring, tf::DataType dtype, const tf::TensorShapeProto &shape,
+                     uint64_t pos, uint64_t size, tf::Tensor *out);
+
+/**
+ * @brief Copy the content of tensor t into a shared memory ring the client consumes from.
+ * @returns position of the content, or nullopt if the ring doesn't have enough space
+ */
+std::optional<uint64_t> tensorToShm(sstl::ShmRing &ring, const tf::Tensor &t);
+
+} // namespace salus::oplib::tensorflow
+
+#endif // SALUS_OPLIB_TENSORFLOW_TENSORFRAMES_H
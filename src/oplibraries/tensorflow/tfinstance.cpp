@@ -118,6 +118,10 @@ void TFInstance::handleCreateSession(std::unique_ptr<tf::CreateSessionRequest> &
         static_cast<uint64_t>(std::round(sstl::getOrDefault(m.persistant(), "TIME:TOTAL", 0.0))) * 1000;
     ectx->setExpectedRunningTime(totalRunningTime);
 
+    // Scheduling hints are passed as pseudo resources
+    ectx->setSchedulingWeight(sstl::getOrDefault(m.persistant(), "SCHED:WEIGHT", 1.0));
+    ectx->setPriority(static_cast<int>(std::round(sstl::getOrDefault(m.persistant(), "SCHED:PRIORITY", 0.0))));
+
     m_laneMgr->requestLanes(std::move(layout), [&resp, cb = std::move(cb), req = std::move(req), ectx = std::move(ectx),
                                                 this](auto &&lanes) mutable {
         std::vector<tf::Device *> devices;
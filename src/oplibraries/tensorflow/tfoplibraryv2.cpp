@@ -26,10 +26,16 @@
 
 #include "oplibraries/tensorflow/tfoplibraryv2.h"
 
+#include "execution/steptrace.h"
 #include "oplibraries/tensorflow/handlercallback.h"
+#include "oplibraries/tensorflow/tensorframes.h"
 #include "oplibraries/tensorflow/tfexception.h"
 #include "oplibraries/tensorflow/tfinstance.h"
 #include "oplibraries/tensorflow/tfsession.h"
+#include "rpcserver/compactenvelope.h"
+#include "utils/shmring.h"
+
+#include <array>
 
 namespace zrpc = executor;
 
@@ -40,6 +46,27 @@ namespace {
 template<typename REQUEST>
 auto prepareTFCall(const zrpc::CustomRequest &creq);
 
+/**
+ * Parse the TF request carried in creq, for handlers that only borrow the request for the duration
+ * of the call. The request is put on the same arena as creq if there is one, otherwise in owned.
+ */
+template<typename REQUEST>
+const REQUEST &parseTFRequest(const zrpc::CustomRequest &creq, std::unique_ptr<REQUEST> &owned)
+{
+    const REQUEST *tfreq;
+    if (auto arena = creq.GetArena()) {
+        tfreq = sstl::createArenaMessage<REQUEST>(creq.extra().data(), creq.extra().size(), arena);
+    } else {
+        owned = sstl::createMessage<REQUEST>(REQUEST::descriptor()->full_name(), creq.extra().data(),
+                                             creq.extra().size());
+        tfreq = owned.get();
+    }
+    if (!tfreq) {
+        throw TFException(tf::errors::InvalidArgument("Failed to parse message as", REQUEST::descriptor()->full_name()));
+    }
+    return *tfreq;
+}
+
 #define IMPL_PARSE(name)                                                                                               \
     template<>                                                                                                         \
     auto prepareTFCall<tf::name##Request>(const zrpc::CustomRequest &creq)                                             \
@@ -58,6 +85,156 @@ CallWithMasterMethodName(IMPL_PARSE)
 
 #undef IMPL_PARSE
 
+constexpr const char kRunStepFramesType[] = "executor.TFRunStepFramesRequest";
+constexpr const char kShmAttachType[] = "executor.TFShmAttachRequest";
+
+/**
+ * Open the shared memory rings created by a client on the same host, and attach them to its session.
+ * Throws TFException on error.
+ */
+void attachSharedMemory(const zrpc::CustomRequest &creq)
+{
+    std::unique_ptr<zrpc::TFShmAttachRequest> owned;
+    const auto &req = parseTFRequest(creq, owned);
+
+    auto sess = TFInstance::instance().findSession(req.session_handle());
+    auto toServer = sstl::ShmRing::open(req.to_server());
+    auto toClient = sstl::ShmRing::open(req.to_client());
+    if (!toServer || !toClient) {
+        throw TFException(tf::errors::InvalidArgument("Failed to open shared memory ", req.to_server(), " and ",
+                                                      req.to_client(), " for session ", req.session_handle()));
+    }
+    VLOG(2) << "Attached shared memory " << req.to_server() << " and " << req.to_client() << " to session "
+            << req.session_handle();
+    sess->attachSharedMemory(std::move(toServer), std::move(toClient));
+}
+
+/**
+ * Reply to a RunStep with frames, sending fetched tensors as payload frames, or in toClient if not nullptr.
+ */
+void sendRunStepFrames(ZmqServer::Sender &sender, const tf::InMemoryRunStepResponse &wresp, sstl::ShmRing *toClient)
+{
+    zrpc::TFRunStepFramesResponse fresp;
+    auto &resp = *fresp.mutable_response();
+    *resp.mutable_metadata() = wresp.metadata();
+    MultiPartMessage frames;
+    for (size_t i = 0; i != wresp.num_tensors(); ++i) {
+        tf::Tensor t;
+        SALUS_THROW_IF_ERROR(wresp.TensorValue(i, &t));
+        if (!canUseFrame(t.dtype())) {
+            auto item = resp.add_tensor();
+            item->set_name(wresp.tensor_name(i));
+            t.AsProtoField(item->mutable_tensor());
+            continue;
+        }
+        auto item = fresp.add_tensors();
+        item->set_name(wresp.tensor_name(i));
+        item->set_dtype(t.dtype());
+        t.shape().AsProto(item->mutable_shape());
+        // Fall back to a frame if the client is behind on releasing its ring
+        if (toClient) {
+            if (auto pos = tensorToShm(*toClient, t)) {
+                item->mutable_shm()->set_pos(*pos);
+                item->mutable_shm()->set_size(t.tensor_data().size());
+                continue;
+            }
+        }
+        item->set_index(static_cast<uint32_t>(frames->size()));
+        frames->push_back(frameFromTensor(t));
+    }
+
+    zrpc::CustomResponse cresp;
+    cresp.mutable_result()->set_code(0);
+    fresp.SerializeToString(cresp.mutable_extra());
+
+    MultiPartMessage parts;
+    parts->emplace_back(cresp.ByteSizeLong());
+    cresp.SerializeToArray(parts->back().data(), parts->back().size());
+    parts.merge(std::move(frames));
+    sender->sendMessage(*cresp.GetDescriptor(), std::move(parts));
+}
+
+/**
+ * RunStep with feeds and fetched tensors in payload frames, or in the session's shared memory rings if
+ * attached. The request is decoded in place, then the step is queued in the session and this returns.
+ * Once the step finishes, the reply is sent directly on sender with the fetched tensors as payload frames,
+ * or hcb is called on error.
+ *
+ * Throws TFException if the request can't be decoded, in which case hcb is left untouched.
+ */
+void runStepWithFrames(ZmqServer::Sender &sender, const zrpc::CustomRequest &creq, HandlerCallback &&hcb)
+{
+    std::unique_ptr<zrpc::TFRunStepFramesRequest> owned;
+    const auto &freq = parseTFRequest(creq, owned);
+    const auto &req = freq.request();
+    auto payloads = sender->takePayloads();
+
+    auto sess = TFInstance::instance().findSession(req.session_handle());
+    auto [toServer, toClient] = sess->sharedMemory();
+
+    auto pwreq = std::make_unique<tf::InMemoryRunStepRequest>();
+    auto &wreq = *pwreq;
+    wreq.set_session_handle(req.session_handle());
+    wreq.set_partial_run_handle(req.partial_run_handle());
+    *wreq.mutable_options() = req.options();
+    for (const auto &feed : req.feed()) {
+        tf::Tensor t;
+        if (!t.FromProto(feed.tensor())) {
+            throw TFException(tf::errors::InvalidArgument("Invalid tensor for feed ", feed.name()));
+        }
+        wreq.add_feed(feed.name(), t);
+    }
+    for (const auto &feed : freq.feeds()) {
+        if (feed.has_shm()) {
+            if (!toServer) {
+                throw TFException(tf::errors::InvalidArgument("No shared memory attached for feed ", feed.name()));
+            }
+            tf::Tensor t;
+            SALUS_THROW_IF_ERROR(
+                tensorFromShm(toServer, feed.dtype(), feed.shape(), feed.shm().pos(), feed.shm().size(), &t));
+            wreq.add_feed(feed.name(), t);
+            continue;
+        }
+        if (feed.index() >= payloads->size()) {
+            throw TFException(tf::errors::InvalidArgument("Missing payload frame ", feed.index(), " for feed ",
+                                                          feed.name()));
+        }
+        tf::Tensor t;
+        SALUS_THROW_IF_ERROR(tensorFromFrame(feed.dtype(), feed.shape(), std::move(payloads->at(feed.index())), &t));
+        wreq.add_feed(feed.name(), t);
+    }
+    for (const auto &fetch : req.fetch()) {
+        wreq.add_fetch(fetch);
+    }
+    for (const auto &target : req.target()) {
+        wreq.add_target(target);
+    }
+
+    // Decoding feeds from frames or shared memory is part of parsing the request
+    if (const auto &trace = sender->trace()) {
+        trace->mark(StepTrace::Stage::Parse);
+    }
+
+    // Capture the session by raw pointer, it outlives its queued steps. Holding a reference here could make
+    // the step thread destroy its own session.
+    sess->enqueueStep([sess = sess.get(), sender, wreq = std::move(pwreq), toClient = std::move(toClient),
+                       hcb = std::move(hcb)](const Status &s) mutable {
+        if (!s.ok()) {
+            hcb(s);
+            return;
+        }
+        try {
+            tf::InMemoryRunStepResponse wresp;
+            sess->runStep(*wreq, wresp, sender->trace());
+            sendRunStepFrames(sender, wresp, toClient.get());
+        } catch (const TFException &ex) {
+            LOG(ERROR) << "Error when running step with frames in session " << wreq->session_handle() << ": "
+                       << ex.what();
+            hcb(ex.code());
+        }
+    });
+}
+
     OpLibraryRegistary::Register tfoplibraryv2(executor::TENSORFLOW, std::make_unique<TFOpLibraryV2>(), 200);
 
 } // namespace
@@ -100,13 +277,11 @@ void TFOpLibraryV2::onRun(ZmqServer::Sender sender, const zrpc::EvenlopDef &even
 void TFOpLibraryV2::onCustom(ZmqServer::Sender sender, const zrpc::EvenlopDef &evenlop, const zrpc::CustomRequest &creq,
                              DoneCallback cb)
 {
-    UNUSED(sender);
-
-    using Method = std::function<void(const zrpc::CustomRequest &, HandlerCallback &&)>;
+    using Method = std::function<void(const ZmqServer::Sender &, const zrpc::CustomRequest &, HandlerCallback &&)>;
     static std::unordered_map<std::string, Method> funcs{
 #define INSTANCE_HANDLER(name)                                                                                         \
     {                                                                                                                  \
-        "tensorflow." #name "Request", [](auto creq, auto &&hcb) {                                                     \
+        "tensorflow." #name "Request", [](const auto &, const auto &creq, auto &&hcb) {                                \
             auto [tfreq, tfresp] = prepareTFCall<tf::name##Request>(creq);                                             \
             auto &resp = *tfresp;                                                                                      \
             hcb.tfresp = std::move(tfresp);                                                                            \
@@ -121,30 +296,82 @@ void TFOpLibraryV2::onCustom(ZmqServer::Sender sender, const zrpc::EvenlopDef &e
 
 #define SESSION_HANDLER(name)                                                                                          \
     {                                                                                                                  \
-        "tensorflow." #name "Request", [](auto creq, auto &&hcb) -> void {                                             \
-            auto [tfreq, tfresp] = prepareTFCall<tf::name##Request>(creq);                                             \
+        "tensorflow." #name "Request", [](const auto &, const auto &creq, auto &&hcb) -> void {                        \
+            std::unique_ptr<tf::name##Request> owned;                                                                  \
+            const auto &tfreq = parseTFRequest(creq, owned);                                                           \
+            auto tfresp = std::make_unique<tf::name##Response>();                                                      \
             auto &resp = *tfresp;                                                                                      \
             hcb.tfresp = std::move(tfresp);                                                                            \
-            auto sess = TFInstance::instance().findSession(tfreq->session_handle());                                   \
-            sess->handle##name(*tfreq, resp, std::forward<decltype(hcb)>(hcb));                                        \
+            auto sess = TFInstance::instance().findSession(tfreq.session_handle());                                    \
+            sess->handle##name(tfreq, resp, std::forward<decltype(hcb)>(hcb));                                         \
         }                                                                                                              \
     }
 
-        SESSION_HANDLER(ExtendSession),  SESSION_HANDLER(PartialRunSetup), SESSION_HANDLER(RunStep),
+        SESSION_HANDLER(ExtendSession),  SESSION_HANDLER(PartialRunSetup),
 #undef SESSION_HANDLER
+
+        // Steps are queued in the session and outlive dispatch, so they own their request
+        {"tensorflow.RunStepRequest",
+         [](const auto &sender, const auto &creq, auto &&hcb) {
+             auto [tfreq, tfresp] = prepareTFCall<tf::RunStepRequest>(creq);
+             auto &resp = *tfresp;
+             hcb.tfresp = std::move(tfresp);
+             auto sess = TFInstance::instance().findSession(tfreq->session_handle());
+             sess->handleRunStep(std::move(tfreq), resp, sender->trace(), std::forward<decltype(hcb)>(hcb));
+         }},
+    };
+
+    // Requests in compact envelopes name the type of creq by id, instead of by creq.type
+    static const auto funcsById = []() {
+        std::array<const Method *, zrpc::MethodId_ARRAYSIZE> table{};
+        for (const auto &[name, func] : funcs) {
+            table[CompactEnvelope::methodOf(name)] = &func;
+        }
+        table[zrpc::METHOD_UNKNOWN] = nullptr;
+        return table;
+    }();
+
+    const auto method = evenlop.custom_method();
+    const auto &typeName = method != zrpc::METHOD_UNKNOWN ? CompactEnvelope::typeName(method) : creq.type();
+    auto isType = [&](zrpc::MethodId id, const char *name) {
+        return method != zrpc::METHOD_UNKNOWN ? method == id : creq.type() == name;
     };
 
     HandlerCallback hcb{std::move(cb), nullptr};
     try {
-        auto it = funcs.find(creq.type());
-        if (it == funcs.end()) {
-            throw TFException(tf::errors::InvalidArgument(creq.type(), " not found in registered custom tasks"));
+        // The id comes from the client, and must agree with creq.type if that is given too
+        if (method != zrpc::METHOD_UNKNOWN
+            && (!zrpc::MethodId_IsValid(method)
+                || (!creq.type().empty() && CompactEnvelope::methodOf(creq.type()) != method))) {
+            throw TFException(tf::errors::InvalidArgument("Custom method id ", static_cast<int>(method),
+                                                          " doesn't match type ", creq.type()));
+        }
+        if (isType(zrpc::TF_RUN_STEP_FRAMES_REQUEST, kRunStepFramesType)) {
+            VLOG(2) << "Dispatching custom task " << kRunStepFramesType << " of seq " << evenlop.seq();
+            runStepWithFrames(sender, creq, std::move(hcb));
+            return;
+        }
+        if (isType(zrpc::TF_SHM_ATTACH_REQUEST, kShmAttachType)) {
+            VLOG(2) << "Dispatching custom task " << kShmAttachType << " of seq " << evenlop.seq();
+            attachSharedMemory(creq);
+            hcb(Status::OK());
+            return;
+        }
+
+        const Method *func = nullptr;
+        if (method != zrpc::METHOD_UNKNOWN) {
+            func = funcsById[method];
+        } else if (auto it = funcs.find(creq.type()); it != funcs.end()) {
+            func = &it->second;
+        }
+        if (!func) {
+            throw TFException(tf::errors::InvalidArgument(typeName, " not found in registered custom tasks"));
         }
 
-        VLOG(2) << "Dispatching custom task " << it->first << " of seq " << evenlop.seq();
-        it->second(creq, std::move(hcb));
+        VLOG(2) << "Dispatching custom task " << typeName << " of seq " << evenlop.seq();
+        (*func)(sender, creq, std::move(hcb));
     } catch (const TFException &ex) {
-        LOG(ERROR) << "Error when executing custom task " << creq.type() << " of seq " << evenlop.seq() << ": "
+        LOG(ERROR) << "Error when executing custom task " << typeName << " of seq " << evenlop.seq() << ": "
                    << ex.what();
         hcb(ex.code());
     }
@@ -22,6 +22,8 @@
 #include "oplibraries/tensorflow/tfsession.h"
 
 #include "execution/executionengine.h"
+#include "execution/steptrace.h"
+#include "execution/threadpool/cpubudget.h"
 #include "oplibraries/tensorflow/handlercallback.h"
 #include "oplibraries/tensorflow/tfexception.h"
 #include "oplibraries/tensorflow/tfinstance.h"
@@ -29,8 +31,16 @@
 #include "oplibraries/tensorflow/worker/dummysessionmgr.h"
 #include "oplibraries/tensorflow/worker/dummyworkercache.h"
 #include "oplibraries/tensorflow/worker/rendezvousmgr.h"
+#include "platform/thread_annotations.h"
+#include "utils/envutils.h"
+#include "utils/shmring.h"
 
+#include <algorithm>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
 
 namespace salus::oplib::tensorflow {
 
@@ -38,7 +48,21 @@ namespace {
 
 auto computePool(tf::Env &env)
 {
-    static std::unique_ptr<tf::thread::ThreadPool> pool(new tf::thread::ThreadPool(&env, "ZrpcCompute", 4));
+    static std::unique_ptr<tf::thread::ThreadPool> pool(new tf::thread::ThreadPool(
+        &env, "ZrpcCompute", static_cast<int>(CpuBudget::instance().share(CpuBudget::Pool::TFCompute))));
+    return pool.get();
+}
+
+/**
+ * @brief Threads shared by all sessions to run their steps. Each runs one MasterSession::Run at a time,
+ * which mostly waits for the iteration on the engine pool, so this bounds the number of steps in flight.
+ * Defaults to the CPU budget, SALUS_STEP_THREADS overrides.
+ */
+auto stepPool(tf::Env &env)
+{
+    static auto numThreads = std::max<size_t>(sstl::fromEnvVar("SALUS_STEP_THREADS", CpuBudget::instance().total()), 1);
+    static std::unique_ptr<tf::thread::ThreadPool> pool(
+        new tf::thread::ThreadPool(&env, "SalusStep", static_cast<int>(numThreads)));
     return pool.get();
 }
 
@@ -57,10 +81,24 @@ public:
 
     DECLARE_HANDLER_PRIV(ExtendSession);
     DECLARE_HANDLER_PRIV(PartialRunSetup);
-    DECLARE_HANDLER_PRIV(RunStep);
 
 #undef DECLARE_HANDLER_PRIV
 
+    void handleRunStep(std::unique_ptr<tf::RunStepRequest> &&req, tf::RunStepResponse &resp,
+                       std::shared_ptr<StepTrace> &&trace, HandlerCallback &&cb);
+
+    void runStep(const tf::RunStepRequestWrapper &req, tf::MutableRunStepResponseWrapper &resp,
+                 const std::shared_ptr<StepTrace> &trace);
+
+    void enqueueStep(Step &&step);
+
+    /**
+     * @brief Fail queued steps that haven't started, and any steps queued later, with status.
+     */
+    void closeSteps(const Status &status);
+
+    void drainSteps();
+
     std::string handle() const;
 
     void safeClose(std::shared_ptr<TFSession> &&self);
@@ -81,6 +119,17 @@ public:
     std::unique_ptr<LocalSessionMgr> m_sessMgr;
 
     std::unique_ptr<SalusRendezvousMgr> m_rendezvousMgr;
+
+    mutable std::mutex m_shmMu;
+    std::shared_ptr<sstl::ShmRing> m_shmToServer GUARDED_BY(m_shmMu);
+    std::shared_ptr<sstl::ShmRing> m_shmToClient GUARDED_BY(m_shmMu);
+
+    // Steps run one at a time in queued order, drained by a single task on the step pool
+    std::mutex m_stepMu;
+    std::condition_variable m_stepCv;
+    std::deque<Step> m_steps GUARDED_BY(m_stepMu);
+    std::optional<Status> m_stepsClosed GUARDED_BY(m_stepMu);
+    bool m_draining GUARDED_BY(m_stepMu) = false;
 };
 
 TFSession::TFSession(TFInstance &inst, std::shared_ptr<ExecutionContext> ctx, std::vector<tf::Device *> devices,
@@ -110,11 +159,47 @@ void TFSession::safeClose()
 
 IMPL_HANDLER(ExtendSession)
 IMPL_HANDLER(PartialRunSetup)
-IMPL_HANDLER(RunStep)
 
 #undef IMPL_HANDLER
 
-TFSession::TFSessionPrivate::~TFSessionPrivate() = default;
+void TFSession::handleRunStep(std::unique_ptr<tf::RunStepRequest> &&req, tf::RunStepResponse &resp,
+                              std::shared_ptr<StepTrace> trace, HandlerCallback &&cb)
+{
+    d->handleRunStep(std::move(req), resp, std::move(trace), std::move(cb));
+}
+
+void TFSession::enqueueStep(Step &&step)
+{
+    d->enqueueStep(std::move(step));
+}
+
+void TFSession::runStep(const tf::RunStepRequestWrapper &req, tf::MutableRunStepResponseWrapper &resp,
+                        const std::shared_ptr<StepTrace> &trace)
+{
+    d->runStep(req, resp, trace);
+}
+
+void TFSession::attachSharedMemory(std::shared_ptr<sstl::ShmRing> toServer, std::shared_ptr<sstl::ShmRing> toClient)
+{
+    std::lock_guard<std::mutex> g(d->m_shmMu);
+    d->m_shmToServer = std::move(toServer);
+    d->m_shmToClient = std::move(toClient);
+}
+
+std::pair<std::shared_ptr<sstl::ShmRing>, std::shared_ptr<sstl::ShmRing>> TFSession::sharedMemory() const
+{
+    std::lock_guard<std::mutex> g(d->m_shmMu);
+    return {d->m_shmToServer, d->m_shmToClient};
+}
+
+TFSession::TFSessionPrivate::~TFSessionPrivate()
+{
+    closeSteps(tf::errors::Cancelled("Session is closed"));
+
+    // The drain task still references this, wait for it to return
+    std::unique_lock<std::mutex> l(m_stepMu);
+    m_stepCv.wait(l, [this]() { return !m_draining; });
+}
 
 std::string TFSession::TFSessionPrivate::handle() const
 {
@@ -210,14 +295,98 @@ void TFSession::TFSessionPrivate::handlePartialRunSetup(const tf::PartialRunSetu
     cb(Status::OK());
 }
 
-void TFSession::TFSessionPrivate::handleRunStep(const tf::RunStepRequest &req, tf::RunStepResponse &resp,
+void TFSession::TFSessionPrivate::handleRunStep(std::unique_ptr<tf::RunStepRequest> &&req,
+                                                tf::RunStepResponse &resp, std::shared_ptr<StepTrace> &&trace,
                                                 HandlerCallback &&cb)
 {
+    // resp is owned by cb, so it lives as long as the step
+    enqueueStep([this, req = std::move(req), &resp, trace = std::move(trace),
+                 cb = std::move(cb)](const Status &s) mutable {
+        if (!s.ok()) {
+            cb(s);
+            return;
+        }
+        try {
+            tf::ProtoRunStepRequest wreq(req.get());
+            tf::NonOwnedProtoRunStepResponse wresp(&resp);
+            runStep(wreq, wresp, trace);
+            cb(Status::OK());
+        } catch (const TFException &ex) {
+            LOG(ERROR) << "Error when running step in session " << handle() << ": " << ex.what();
+            cb(ex.code());
+        }
+    });
+}
+
+void TFSession::TFSessionPrivate::enqueueStep(Step &&step)
+{
+    std::optional<Status> closed;
+    {
+        std::lock_guard<std::mutex> g(m_stepMu);
+        if (!m_stepsClosed) {
+            m_steps.emplace_back(std::move(step));
+            if (m_draining) {
+                // picked up by the running drain task
+                return;
+            }
+            m_draining = true;
+        } else {
+            closed = m_stepsClosed;
+        }
+    }
+    if (closed) {
+        step(*closed);
+        return;
+    }
+    stepPool(m_inst.env())->Schedule([this]() { drainSteps(); });
+}
+
+void TFSession::TFSessionPrivate::closeSteps(const Status &status)
+{
+    std::deque<Step> pending;
+    {
+        std::lock_guard<std::mutex> g(m_stepMu);
+        if (!m_stepsClosed) {
+            m_stepsClosed = status;
+        }
+        pending.swap(m_steps);
+    }
+    for (auto &step : pending) {
+        step(status);
+    }
+}
+
+void TFSession::TFSessionPrivate::drainSteps()
+{
+    std::unique_lock<std::mutex> l(m_stepMu);
+    while (!m_steps.empty()) {
+        auto step = std::move(m_steps.front());
+        m_steps.pop_front();
+
+        l.unlock();
+        step(Status::OK());
+        l.lock();
+    }
+    m_draining = false;
+    m_stepCv.notify_all();
+}
+
+void TFSession::TFSessionPrivate::runStep(const tf::RunStepRequestWrapper &req,
+                                          tf::MutableRunStepResponseWrapper &resp,
+                                          const std::shared_ptr<StepTrace> &trace)
+{
+    if (trace) {
+        trace->setSession(handle());
+        trace->mark(StepTrace::Stage::StepQueue);
+        VLOG(2) << "Running step of " << *trace;
+    }
+
+    // Iterations scheduled by the master session during Run belong to this step, steps run one at a time
+    m_execCtx->setCurrentTrace(trace);
     tf::CallOptions opts;
-    tf::ProtoRunStepRequest wreq(&req);
-    tf::NonOwnedProtoRunStepResponse wresp(&resp);
-    SALUS_THROW_IF_ERROR(m_masterSess->Run(&opts, wreq, &wresp));
-    cb(Status::OK());
+    auto status = m_masterSess->Run(&opts, req, &resp);
+    m_execCtx->setCurrentTrace(nullptr);
+    SALUS_THROW_IF_ERROR(status);
 }
 
 void TFSession::deferClose(HandlerCallback &&cb)
@@ -227,6 +396,9 @@ void TFSession::deferClose(HandlerCallback &&cb)
     auto raw_tfresp = cb.tfresp.release();
     LOG(INFO) << "Defer closing session " << d->handle();
 
+    // Steps already running finish before the context does, the rest won't start
+    d->closeSteps(tf::errors::Cancelled("Session ", d->handle(), " is closing"));
+
     d->m_execCtx->finish([self = shared_from_this(), cb = std::move(cb.cb), raw_tfresp]() mutable {
         HandlerCallback hcb;
         hcb.tfresp = sstl::wrap_unique(raw_tfresp);
@@ -22,17 +22,26 @@
 
 #include "oplibraries/tensorflow/tfoplibraryv2.h"
 #include "oplibraries/tensorflow/tfutils.h"
+#include "utils/fixed_function.hpp"
 #include "utils/macros.h"
 #include "utils/pointerutils.h"
 
 #include <memory>
+#include <utility>
+
+namespace sstl {
+class ShmRing;
+} // namespace sstl
 
 namespace tensorflow {
 class Device;
+class RunStepRequestWrapper;
+class MutableRunStepResponseWrapper;
 } // namespace tensorflow
 
 namespace salus {
 class ExecutionContext;
+class StepTrace;
 namespace oplib::tensorflow {
 class TFInstance;
 struct HandlerCallback;
@@ -72,10 +81,48 @@ public:
 
     DECLARE_HANDLER(PartialRunSetup);
 
-    DECLARE_HANDLER(RunStep);
-
 #undef DECLARE_HANDLER
 
+    /**
+     * @brief Queue a step after the steps queued before it, so clients can keep several steps in flight.
+     * Returns immediately, cb is called on the session's step thread once the step finishes.
+     * The step is accounted to trace, if not null.
+     */
+    void handleRunStep(std::unique_ptr<tf::RunStepRequest> &&req, tf::RunStepResponse &resp,
+                       std::shared_ptr<StepTrace> trace, HandlerCallback &&cb);
+
+    /**
+     * @brief A queued step. Called with OK to run the step, or with the error to fail it with if the
+     * session is closing.
+     */
+    using Step = sstl::FixedFunction<void(const Status &), 256>;
+
+    /**
+     * @brief Run step on the shared step pool, after all steps of this session queued before it.
+     */
+    void enqueueStep(Step &&step);
+
+    /**
+     * @brief Run a step synchronously, for callers carrying tensors outside of protos. Only call this
+     * from a step queued with enqueueStep, so steps of the session stay in order and no IO thread blocks.
+     * Throws TFException on error.
+     *
+     * If trace is not null, the time waiting in the step queue and running the step is accounted to it.
+     */
+    void runStep(const tf::RunStepRequestWrapper &req, tf::MutableRunStepResponseWrapper &resp,
+                 const std::shared_ptr<StepTrace> &trace = nullptr);
+
+    /**
+     * @brief Attach shared memory rings for tensors of a client on the same host.
+     * The server consumes from toServer and produces into toClient.
+     */
+    void attachSharedMemory(std::shared_ptr<sstl::ShmRing> toServer, std::shared_ptr<sstl::ShmRing> toClient);
+
+    /**
+     * @returns the attached rings as (toServer, toClient), or nullptrs if none are attached
+     */
+    std::pair<std::shared_ptr<sstl::ShmRing>, std::shared_ptr<sstl::ShmRing>> sharedMemory() const;
+
 private:
     class TFSessionPrivate;
 
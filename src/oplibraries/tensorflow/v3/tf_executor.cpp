@@ -18,6 +18,7 @@ limitations under the License.
 
 #include "execution/engine/iterationcontext.h"
 #include "execution/iterationtask.h"
+#include "execution/steptrace.h"
 #include "oplibraries/tensorflow/tfinstance.h"
 #include "utils/envutils.h"
 
@@ -677,7 +678,7 @@ public:
     ExecutorState(const tf::Executor::Args &args, ExecutorImpl *impl, tf::Executor::DoneCallback done);
     ~ExecutorState();
 
-    void runAsync(std::shared_ptr<IterationContext> &&ictx) noexcept;
+    void runAsync(std::shared_ptr<IterationContext> &&ictx, std::shared_ptr<StepTrace> trace) noexcept;
 
 private:
     // Either a tensor pointer (pass-by-reference) or a tensor (pass-by-value).
@@ -1114,6 +1115,10 @@ private:
 
     std::shared_ptr<IterationContext> ictx_;
 
+    // Trace of the request running this iteration, and when the iteration started. May be null.
+    std::shared_ptr<StepTrace> trace_;
+    uint64_t trace_start_ns_ = 0;
+
     // true if LogMemory::IsEnabled(). Used to check memory enabled cheaply.
     const bool log_memory_;
 
@@ -1251,6 +1256,20 @@ ExecutorState::ExecutorState(const tf::Executor::Args &args, ExecutorImpl *impl,
         new IterationState(root_frame_->pending_counts, root_frame_->total_input_tensors);
 
     outstanding_frames_.insert({root_frame_->frame_name, root_frame_});
+
+    // Tag work dispatched by this step with the session's thread pool priority. The runner is opaque,
+    // so the priority becomes the default for anything submitted while running the dispatched closure.
+    if (impl_->params_.ins && impl_->params_.ins->m_item) {
+        const auto prio = impl_->params_.ins->m_item->workPriority();
+        if (prio != ThreadPool::Priority::Normal) {
+            runner_ = [runner = std::move(runner_), prio](std::function<void()> fn) {
+                runner([fn = std::move(fn), prio]() {
+                    ThreadPool::PriorityScope scope(prio);
+                    fn();
+                });
+            };
+        }
+    }
 }
 
 ExecutorState::~ExecutorState()
@@ -1345,10 +1364,14 @@ void ExecutorImpl::InitializePending(const tf::Graph *graph, const ControlFlowIn
     }
 }
 
-void ExecutorState::runAsync(std::shared_ptr<IterationContext> &&ictx) noexcept
+void ExecutorState::runAsync(std::shared_ptr<IterationContext> &&ictx, std::shared_ptr<StepTrace> trace) noexcept
 {
     ictx_ = std::move(ictx);
     ictx_->setGraphId(impl_->graph_id_);
+    trace_ = std::move(trace);
+    if (trace_) {
+        trace_start_ns_ = StepTrace::nowNs();
+    }
 
     LogAlloc() << "event: start_iter "
                << nlohmann::json({
@@ -2062,8 +2085,13 @@ void ExecutorState::Finish()
         // devices like GPUs that continue to execute Ops after their Compute
         // methods have completed, this ensures that control is not returned to
         // the user until the step (and its side-effects) has actually completed.
+        // Let the engine pool compensate if we happen to block one of its workers.
+        ThreadPool::BlockingScope blocking(ExecutionEngine::instance().pool());
         status = impl_->params_.device->Sync();
     }
+    if (trace_) {
+        trace_->record(StepTrace::Stage::Execute, StepTrace::nowNs() - trace_start_ns_);
+    }
 
     LogAlloc() << "event: end_iter "
                << nlohmann::json({{"sess", impl_->params_.session},
@@ -2443,7 +2471,7 @@ public:
     void runAsync(std::shared_ptr<IterationContext> &&ictx) noexcept override
     {
         // SIExecutorState will delete itself after called runAsync
-        m_state.release()->runAsync(std::move(ictx));
+        m_state.release()->runAsync(std::move(ictx), trace());
     }
 
     void cancel() override
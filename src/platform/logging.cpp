@@ -149,8 +149,11 @@ MAKE_LOGGABLE(executor::OpKernelDef, c, os)
 
 MAKE_LOGGABLE(executor::EvenlopDef, c, os)
 {
-    return os << "EvenlopDef(type='" << c.type() << "', seq=" << c.seq() << ", sess=" << c.sessionid()
-              << ", recvId='"
+    os << "EvenlopDef(type='" << c.type() << "', seq=" << c.seq() << ", sess=" << c.sessionid();
+    if (c.method() != executor::METHOD_UNKNOWN) {
+        os << ", method=" << executor::MethodId_Name(c.method());
+    }
+    return os << ", recvId='"
               << sstl::bytesToHexString(reinterpret_cast<const uint8_t *>(c.recvidentity().data()),
                                          c.recvidentity().size())
               << "')";
@@ -21,6 +21,8 @@
 
 #include "platform/logging.h"
 
+#include <pthread.h>
+
 #include <atomic>
 #include <csignal>
 #include <cstring>
@@ -110,6 +112,15 @@ void initialize()
 
     installSignalHandler(SIGINT, handler);
     installSignalHandler(SIGTERM, handler);
+
+    // Only waitForTerminate takes SIGUSR1, instead of it interrupting whichever thread it's delivered to
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    auto err = pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    if (err) {
+        LOG(ERROR) << "Error when blocking SIGUSR1: " << err;
+    }
 }
 
 std::pair<int, SignalAction> waitForTerminate()
@@ -118,12 +129,13 @@ std::pair<int, SignalAction> waitForTerminate()
     sigemptyset(&set);
     sigaddset(&set, SIGTERM);
     sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
     int sig;
     sigwait(&set, &sig);
 
     LOG(INFO) << "Received signal " << signalName(sig) << "(" << sig << ")";
 
-    return {sig, SignalAction::Exit};
+    return {sig, sig == SIGUSR1 ? SignalAction::Report : SignalAction::Exit};
 }
 
 } // namespace signals
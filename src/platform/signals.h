@@ -28,10 +28,19 @@ enum class SignalAction
 {
     Exit,
     Ignore,
+    // Report runtime statistics and keep running
+    Report,
 };
 
+/**
+ * Install handlers for SIGINT and SIGTERM, and block SIGUSR1 in all threads started later,
+ * so it is only received by waitForTerminate.
+ */
 void initialize();
 
+/**
+ * Wait for SIGINT or SIGTERM, for which the action is Exit, or SIGUSR1, for which it is Report.
+ */
 std::pair<int, SignalAction> waitForTerminate();
 
 using Handler = void (int);
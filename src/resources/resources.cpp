@@ -347,6 +347,7 @@ void ResourceMonitor::initializeLimits()
     auto g = sstl::with_guard(m_mu);
 
     m_limits = resources::platformLimits();
+    m_capacity = m_limits;
 }
 
 void ResourceMonitor::initializeLimits(const Resources &cap)
@@ -366,6 +367,13 @@ void ResourceMonitor::initializeLimits(const Resources &cap)
             it->second = std::min(it->second, val);
         }
     }
+    m_capacity = m_limits;
+}
+
+Resources ResourceMonitor::capacity() const
+{
+    auto g = sstl::with_guard(m_mu);
+    return m_capacity;
 }
 
 std::optional<uint64_t> ResourceMonitor::preAllocate(const Resources &req, Resources *missing)
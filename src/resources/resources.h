@@ -385,6 +385,11 @@ public:
         return LockedProxy(this);
     }
 
+    /**
+     * @brief Total resources as initialized, regardless of current usage
+     */
+    Resources capacity() const;
+
     std::string DebugString() const;
 
 private:
@@ -402,6 +407,11 @@ private:
      */
     Resources m_limits;
 
+    /**
+     * @brief Total resources
+     */
+    Resources m_capacity;
+
     /**
      * @brief Staging resources
      */
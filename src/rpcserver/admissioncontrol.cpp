@@ -0,0 +1,157 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "admissioncontrol.h"
+
+#include "compactenvelope.h"
+#include "platform/logging.h"
+#include "utils/envutils.h"
+
+#include "protos.h"
+
+using namespace std::string_view_literals;
+
+AdmissionControl::Limits AdmissionControl::Limits::fromEnv()
+{
+    return {
+        sstl::fromEnvVar("SALUS_MAX_INFLIGHT", size_t{8192}),
+        sstl::fromEnvVar("SALUS_MAX_CLIENT_INFLIGHT", size_t{1024}),
+        sstl::fromEnvVar("SALUS_MAX_QUEUED", size_t{4096}),
+    };
+}
+
+AdmissionControl::AdmissionControl(const Limits &limits)
+    : m_limits(limits)
+{
+}
+
+AdmissionControl::Ticket AdmissionControl::admit(std::string_view client, size_t queued)
+{
+    // Queued work is the cheapest to check and doesn't need the lock
+    if (m_limits.maxQueued && queued >= m_limits.maxQueued) {
+        shed(m_shedQueued, "too much queued work");
+        return {};
+    }
+
+    std::lock_guard<std::mutex> g(m_mu);
+    if (m_limits.maxInFlight && m_inFlight >= m_limits.maxInFlight) {
+        shed(m_shedInFlight, "too many requests in flight");
+        return {};
+    }
+
+    auto &entry = *m_clients.try_emplace(std::string(client), 0).first;
+    if (m_limits.maxClientInFlight && entry.second >= m_limits.maxClientInFlight) {
+        shed(m_shedClientInFlight, "too many requests in flight from one client");
+        return {};
+    }
+
+    ++entry.second;
+    ++m_inFlight;
+    m_admitted.fetch_add(1, std::memory_order_relaxed);
+    return Ticket(this, &entry);
+}
+
+void AdmissionControl::shed(std::atomic<uint64_t> &counter, const char *reason)
+{
+    auto n = counter.fetch_add(1, std::memory_order_relaxed);
+    // Don't flood the log while overloaded
+    if (n % 1000 == 0) {
+        LOG(WARNING) << "Shedding request due to " << reason << ", " << (n + 1) << " shed so far for this reason";
+    }
+}
+
+AdmissionControl::Stats AdmissionControl::stats() const
+{
+    Stats s;
+    s.admitted = m_admitted.load(std::memory_order_relaxed);
+    s.shedInFlight = m_shedInFlight.load(std::memory_order_relaxed);
+    s.shedClientInFlight = m_shedClientInFlight.load(std::memory_order_relaxed);
+    s.shedQueued = m_shedQueued.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        s.inFlight = m_inFlight;
+    }
+    return s;
+}
+
+ProtoPtr AdmissionControl::makeRejection(const executor::EvenlopDef &evenlop)
+{
+    std::string type = evenlop.method() != executor::METHOD_UNKNOWN ? CompactEnvelope::typeName(evenlop.method())
+                                                                     : evenlop.type();
+    constexpr auto kRequest = "Request"sv;
+    if (type.size() < kRequest.size() || type.compare(type.size() - kRequest.size(), kRequest.size(), kRequest) != 0) {
+        return {};
+    }
+    type.replace(type.size() - kRequest.size(), kRequest.size(), "Response");
+
+    auto msg = sstl::newMessage(type);
+    if (!msg) {
+        return {};
+    }
+    // All executor responses carry their status in `result`
+    auto field = msg->GetDescriptor()->FindFieldByName("result");
+    if (!field || field->message_type() != executor::Status::descriptor()) {
+        return {};
+    }
+    auto status = static_cast<executor::Status *>(msg->GetReflection()->MutableMessage(msg.get(), field));
+    status->set_code(kRetryableCode);
+    status->set_message("Server is overloaded, retry later");
+    return msg;
+}
+
+AdmissionControl::Ticket::~Ticket()
+{
+    release();
+}
+
+AdmissionControl::Ticket::Ticket(Ticket &&other) noexcept
+    : m_owner(other.m_owner)
+    , m_client(other.m_client)
+{
+    other.m_owner = nullptr;
+    other.m_client = nullptr;
+}
+
+AdmissionControl::Ticket &AdmissionControl::Ticket::operator=(Ticket &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        m_owner = other.m_owner;
+        m_client = other.m_client;
+        other.m_owner = nullptr;
+        other.m_client = nullptr;
+    }
+    return *this;
+}
+
+void AdmissionControl::Ticket::release()
+{
+    if (!m_owner) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> g(m_owner->m_mu);
+    --m_owner->m_inFlight;
+    // Entries are only erased once unused, so other tickets' pointers stay valid
+    if (--m_client->second == 0) {
+        m_owner->m_clients.erase(m_owner->m_clients.find(m_client->first));
+    }
+    m_owner = nullptr;
+    m_client = nullptr;
+}
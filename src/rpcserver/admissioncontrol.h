@@ -0,0 +1,149 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_RPCSERVER_ADMISSIONCONTROL_H
+#define SALUS_RPCSERVER_ADMISSIONCONTROL_H
+
+#include "utils/protoutils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace executor {
+class EvenlopDef;
+} // namespace executor
+
+/**
+ * @brief Limits the number of requests in flight, globally and per client, so one client flooding
+ * the server can't degrade everyone else.
+ *
+ * A request is in flight from when it is admitted until its ticket is released, which is when the
+ * server no longer holds its sender. Requests over a limit are shed: the server replies right away
+ * with kRetryableCode, without decoding the request body.
+ */
+class AdmissionControl
+{
+public:
+    /**
+     * @brief Same as tensorflow::error::UNAVAILABLE, which clients treat as retryable.
+     */
+    static constexpr int32_t kRetryableCode = 14;
+
+    struct Limits
+    {
+        // Requests in flight from all clients
+        size_t maxInFlight;
+        // Requests in flight from one client
+        size_t maxClientInFlight;
+        // Work queued in the server, i.e. requests waiting for an IO thread and replies waiting to be sent
+        size_t maxQueued;
+
+        /**
+         * @brief Read from SALUS_MAX_INFLIGHT, SALUS_MAX_CLIENT_INFLIGHT and SALUS_MAX_QUEUED.
+         * 0 means no limit.
+         */
+        static Limits fromEnv();
+    };
+
+    struct Stats
+    {
+        uint64_t admitted = 0;
+        uint64_t shedInFlight = 0;
+        uint64_t shedClientInFlight = 0;
+        uint64_t shedQueued = 0;
+        size_t inFlight = 0;
+    };
+
+    /**
+     * @brief Keeps one request in flight until destroyed.
+     */
+    class Ticket
+    {
+    public:
+        Ticket() = default;
+        ~Ticket();
+
+        Ticket(Ticket &&other) noexcept;
+        Ticket &operator=(Ticket &&other) noexcept;
+
+        Ticket(const Ticket &) = delete;
+        Ticket &operator=(const Ticket &) = delete;
+
+        explicit operator bool() const
+        {
+            return m_owner != nullptr;
+        }
+
+    private:
+        friend class AdmissionControl;
+        using Client = std::unordered_map<std::string, size_t>::value_type;
+
+        Ticket(AdmissionControl *owner, Client *client)
+            : m_owner(owner)
+            , m_client(client)
+        {
+        }
+
+        void release();
+
+        AdmissionControl *m_owner = nullptr;
+        Client *m_client = nullptr;
+    };
+
+    explicit AdmissionControl(const Limits &limits);
+
+    /**
+     * @brief Try to admit a request from client, while `queued` is the amount of work queued in the server.
+     * @returns a valid ticket if admitted, or an empty one if the request should be shed.
+     */
+    Ticket admit(std::string_view client, size_t queued);
+
+    /**
+     * @brief Make the reply to a shed request, of the response type of the request and with kRetryableCode.
+     * @returns nullptr if the request type has no known response type
+     */
+    static ProtoPtr makeRejection(const executor::EvenlopDef &evenlop);
+
+    Stats stats() const;
+
+    const Limits &limits() const
+    {
+        return m_limits;
+    }
+
+private:
+    void shed(std::atomic<uint64_t> &counter, const char *reason);
+
+    const Limits m_limits;
+
+    mutable std::mutex m_mu;
+    std::unordered_map<std::string, size_t> m_clients;
+    size_t m_inFlight = 0;
+
+    std::atomic<uint64_t> m_admitted{0};
+    std::atomic<uint64_t> m_shedInFlight{0};
+    std::atomic<uint64_t> m_shedClientInFlight{0};
+    std::atomic<uint64_t> m_shedQueued{0};
+};
+
+#endif // SALUS_RPCSERVER_ADMISSIONCONTROL_H
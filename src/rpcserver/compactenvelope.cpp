@@ -0,0 +1,164 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compactenvelope.h"
+
+#include "platform/logging.h"
+
+#include <array>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "CompactEnvelope::Header is read in place");
+
+struct MethodInfo
+{
+    executor::MethodId method;
+    const char *typeName;
+};
+
+// Must cover every value of executor::MethodId except METHOD_UNKNOWN
+constexpr MethodInfo kMethods[] = {
+    {executor::RUN_REQUEST, "executor.RunRequest"},
+    {executor::RUN_RESPONSE, "executor.RunResponse"},
+    {executor::RUN_GRAPH_REQUEST, "executor.RunGraphRequest"},
+    {executor::RUN_GRAPH_RESPONSE, "executor.RunGraphResponse"},
+    {executor::ALLOC_REQUEST, "executor.AllocRequest"},
+    {executor::ALLOC_RESPONSE, "executor.AllocResponse"},
+    {executor::DEALLOC_REQUEST, "executor.DeallocRequest"},
+    {executor::DEALLOC_RESPONSE, "executor.DeallocResponse"},
+    {executor::CUSTOM_REQUEST, "executor.CustomRequest"},
+    {executor::CUSTOM_RESPONSE, "executor.CustomResponse"},
+
+    {executor::TF_CREATE_SESSION_REQUEST, "tensorflow.CreateSessionRequest"},
+    {executor::TF_EXTEND_SESSION_REQUEST, "tensorflow.ExtendSessionRequest"},
+    {executor::TF_PARTIAL_RUN_SETUP_REQUEST, "tensorflow.PartialRunSetupRequest"},
+    {executor::TF_RUN_STEP_REQUEST, "tensorflow.RunStepRequest"},
+    {executor::TF_CLOSE_SESSION_REQUEST, "tensorflow.CloseSessionRequest"},
+    {executor::TF_LIST_DEVICES_REQUEST, "tensorflow.ListDevicesRequest"},
+    {executor::TF_RESET_REQUEST, "tensorflow.ResetRequest"},
+    {executor::TF_RUN_STEP_FRAMES_REQUEST, "executor.TFRunStepFramesRequest"},
+    {executor::TF_SHM_ATTACH_REQUEST, "executor.TFShmAttachRequest"},
+};
+
+struct MethodTables
+{
+    std::array<std::string, executor::MethodId_ARRAYSIZE> names;
+    std::array<sstl::MessageTypeId, executor::MethodId_ARRAYSIZE> types;
+    std::unordered_map<const google::protobuf::Descriptor *, executor::MethodId> byDescriptor;
+
+    MethodTables()
+    {
+        types.fill(sstl::kInvalidMessageType);
+        for (const auto &[method, typeName] : kMethods) {
+            names[method] = typeName;
+            types[method] = sstl::messageTypeId(typeName);
+            auto desc = google::protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(typeName);
+            if (desc) {
+                byDescriptor.emplace(desc, method);
+            }
+        }
+    }
+
+    static const MethodTables &instance()
+    {
+        static MethodTables tables;
+        return tables;
+    }
+};
+
+} // namespace
+
+bool CompactEnvelope::parse(const zmq::message_t &frame, executor::EvenlopDef *evenlop)
+{
+    DCHECK(evenlop);
+    Header h{};
+    if (frame.size() < sizeof(h)) {
+        return false;
+    }
+    std::memcpy(&h, frame.data(), sizeof(h));
+
+    if (h.magic != kMagic || h.version != kVersion) {
+        LOG(ERROR) << "Unsupported compact envelope version " << static_cast<int>(h.version);
+        return false;
+    }
+    if (frame.size() != sizeof(h) + h.identityLen) {
+        return false;
+    }
+    if (!executor::MethodId_IsValid(h.method) || !executor::MethodId_IsValid(h.customMethod)
+        || !executor::OpLibraryType_IsValid(h.oplibrary)) {
+        return false;
+    }
+
+    evenlop->set_seq(h.seq);
+    evenlop->set_method(static_cast<executor::MethodId>(h.method));
+    evenlop->set_custom_method(static_cast<executor::MethodId>(h.customMethod));
+    evenlop->set_oplibrary(static_cast<executor::OpLibraryType>(h.oplibrary));
+    if (h.identityLen != 0) {
+        evenlop->set_recvidentity(frame.data<char>() + sizeof(h), h.identityLen);
+    }
+    return true;
+}
+
+zmq::message_t CompactEnvelope::makeReply(executor::MethodId method, uint64_t seq)
+{
+    const Header h{kMagic, kVersion, static_cast<uint16_t>(method), 0, 0, 0, seq};
+    return zmq::message_t(&h, sizeof(h));
+}
+
+sstl::MessageTypeId CompactEnvelope::messageType(executor::MethodId method)
+{
+    if (!executor::MethodId_IsValid(method)) {
+        return sstl::kInvalidMessageType;
+    }
+    return MethodTables::instance().types[method];
+}
+
+const std::string &CompactEnvelope::typeName(executor::MethodId method)
+{
+    static const std::string empty;
+    if (!executor::MethodId_IsValid(method)) {
+        return empty;
+    }
+    return MethodTables::instance().names[method];
+}
+
+executor::MethodId CompactEnvelope::methodOf(std::string_view typeName)
+{
+    for (const auto &[method, name] : kMethods) {
+        if (typeName == name) {
+            return method;
+        }
+    }
+    return executor::METHOD_UNKNOWN;
+}
+
+executor::MethodId CompactEnvelope::methodOf(const google::protobuf::Descriptor &desc)
+{
+    const auto &byDescriptor = MethodTables::instance().byDescriptor;
+    auto it = byDescriptor.find(&desc);
+    return it == byDescriptor.end() ? executor::METHOD_UNKNOWN : it->second;
+}
+
+bool CompactEnvelope::methodMatches(int method, const google::protobuf::Descriptor &desc)
+{
+    return method != executor::METHOD_UNKNOWN && executor::MethodId_IsValid(method) && methodOf(desc) == method;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_RPCSERVER_COMPACTENVELOPE_H
+#define SALUS_RPCSERVER_COMPACTENVELOPE_H
+
+#include "utils/protoutils.h"
+
+#include "protos.h"
+
+#include <zmq.hpp>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Fixed layout binary envelope, used in place of a serialized EvenlopDef frame.
+ *
+ * The frame is a Header, followed by `identityLen` bytes of receive identity. Integers are little
+ * endian. A serialized protobuf message never starts with a zero byte, so the first byte tells which
+ * kind of envelope a frame is, and both can be served on the same socket. Replies to a request in a
+ * compact envelope use a compact envelope too.
+ *
+ * Message types are named by executor::MethodId instead of strings, so the common path does no string
+ * hashing, and the reply envelope is filled in place instead of serialized.
+ */
+class CompactEnvelope
+{
+public:
+    static constexpr uint8_t kMagic = 0;
+    static constexpr uint8_t kVersion = 1;
+
+    struct Header
+    {
+        uint8_t magic;
+        uint8_t version;
+        uint16_t method;
+        uint16_t customMethod;
+        uint8_t oplibrary;
+        uint8_t identityLen;
+        uint64_t seq;
+    };
+    static_assert(sizeof(Header) == 16, "Header is part of the wire format");
+
+    /**
+     * @returns whether the envelope frame is a compact envelope
+     */
+    static bool matches(const zmq::message_t &frame)
+    {
+        return frame.size() != 0 && *frame.data<uint8_t>() == kMagic;
+    }
+
+    /**
+     * @brief Decode a compact envelope frame into evenlop. Only method and custom_method are set,
+     * type is left empty.
+     * @returns false if the frame is malformatted or of an unsupported version
+     */
+    static bool parse(const zmq::message_t &frame, executor::EvenlopDef *evenlop);
+
+    /**
+     * @brief Make the compact envelope frame of a reply of type method.
+     */
+    static zmq::message_t makeReply(executor::MethodId method, uint64_t seq);
+
+    /**
+     * @returns the message type of method, or kInvalidMessageType if method is unknown
+     */
+    static sstl::MessageTypeId messageType(executor::MethodId method);
+
+    /**
+     * @returns full name of the message type of method, or an empty string if method is unknown
+     */
+    static const std::string &typeName(executor::MethodId method);
+
+    /**
+     * @returns the method of message type name, or METHOD_UNKNOWN. Compares against the known names
+     * without hashing.
+     */
+    static executor::MethodId methodOf(std::string_view typeName);
+
+    /**
+     * @returns the method of message type desc, or METHOD_UNKNOWN
+     */
+    static executor::MethodId methodOf(const ::google::protobuf::Descriptor &desc);
+
+    /**
+     * @brief Method ids come from the client, so are only used as an index after checking them.
+     * @returns whether method is a known method other than METHOD_UNKNOWN, and names message type desc
+     */
+    static bool methodMatches(int method, const ::google::protobuf::Descriptor &desc);
+};
+
+#endif // SALUS_RPCSERVER_COMPACTENVELOPE_H
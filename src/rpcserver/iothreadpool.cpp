@@ -19,30 +19,75 @@
 
 #include "iothreadpool.h"
 
-#include <thread>
+#include "execution/threadpool/cpubudget.h"
+
+#include <algorithm>
 
 namespace salus {
 
 IOThreadPoolImpl::IOThreadPoolImpl()
-    : m_numThreads(std::max(std::thread::hardware_concurrency() / 2, 1u))
+    : m_numThreads(CpuBudget::instance().limit(CpuBudget::Pool::IO))
     , m_context(static_cast<int>(m_numThreads))
     , m_workguard(boost::asio::make_work_guard(m_context))
+    , m_active(CpuBudget::instance().share(CpuBudget::Pool::IO))
 {
-    while (m_threads.size() < m_numThreads) {
-        m_threads.create_thread(std::bind(&IOThreadPoolImpl::workerLoop, this));
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        spawnUnsafe(m_active);
     }
+
+    CpuBudget::instance().attach(
+        CpuBudget::Pool::IO, [this]() { return pendingTasks(); }, [this](size_t n) { setActiveThreads(n); });
 }
 
 IOThreadPoolImpl::~IOThreadPoolImpl()
 {
+    CpuBudget::instance().detach(CpuBudget::Pool::IO);
+
     m_context.stop();
     m_workguard.reset();
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        m_cv.notify_all();
+    }
     m_threads.join_all();
 }
 
-void IOThreadPoolImpl::workerLoop()
+void IOThreadPoolImpl::setActiveThreads(size_t n)
+{
+    n = std::clamp<size_t>(n, 1, m_numThreads);
+    size_t prev;
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        spawnUnsafe(n);
+        prev = m_active.exchange(n);
+        m_cv.notify_all();
+    }
+    // Threads blocked in run_one only notice they are no longer active after running a handler
+    for (auto i = n; i < prev; ++i) {
+        boost::asio::post(m_context, []() {});
+    }
+}
+
+void IOThreadPoolImpl::spawnUnsafe(size_t n)
 {
-    m_context.run();
+    while (m_threads.size() < n) {
+        m_threads.create_thread(std::bind(&IOThreadPoolImpl::workerLoop, this, m_threads.size()));
+    }
+}
+
+void IOThreadPoolImpl::workerLoop(size_t idx)
+{
+    while (!m_context.stopped()) {
+        if (idx >= m_active) {
+            std::unique_lock<std::mutex> l(m_mu);
+            m_cv.wait(l, [this, idx]() { return idx < m_active || m_context.stopped(); });
+            continue;
+        }
+        if (m_context.run_one() == 0) {
+            break;
+        }
+    }
 }
 
 } // namespace salus
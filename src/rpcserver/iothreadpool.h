@@ -23,9 +23,14 @@
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
 namespace salus {
 /**
- * @brief Simple blocking IO thread pool made from boost::asio
+ * @brief Simple blocking IO thread pool made from boost::asio.
+ * Sized from the IO share of CpuBudget, which may change the number of active threads at runtime.
  */
 class IOThreadPoolImpl
 {
@@ -36,6 +41,14 @@ class IOThreadPoolImpl
 
     boost::thread_group m_threads;
 
+    // Threads with index at or above m_active sleep on m_cv
+    std::atomic<size_t> m_active;
+    std::mutex m_mu;
+    std::condition_variable m_cv;
+
+    // Handlers posted but not yet started
+    std::atomic<size_t> m_pending{0};
+
     /**
      * @brief A wrapper class that is copy-able to pass move-only objects.
      *
@@ -66,6 +79,8 @@ class IOThreadPoolImpl
     }
 
 public:
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
     IOThreadPoolImpl();
     ~IOThreadPoolImpl();
 
@@ -81,20 +96,72 @@ public:
     auto post(Func &&f)
     {
         if constexpr (!std::is_copy_constructible_v<Func> && use_moveonly_trick) {
-            return boost::asio::post(move_handler(f));
+            return boost::asio::post(m_context, counted(move_handler(f)));
         } else {
-            return boost::asio::post(std::forward<Func>(f));
+            return boost::asio::post(m_context, counted(std::forward<Func>(f)));
         }
     }
 
     template<typename Func>
     auto defer(Func &&f)
     {
-        return boost::asio::defer(std::forward<Func>(f));
+        return boost::asio::defer(m_context, counted(std::forward<Func>(f)));
+    }
+
+    /**
+     * @brief Make a strand of this pool. Handlers posted to the same strand run one at a time,
+     * in the order they are posted.
+     */
+    Strand makeStrand()
+    {
+        return Strand(m_context.get_executor());
+    }
+
+    template<typename Func>
+    auto post(Strand &strand, Func &&f)
+    {
+        return boost::asio::post(strand, counted(std::forward<Func>(f)));
+    }
+
+    /**
+     * @brief Set the number of threads running handlers, clamped to [1, numThreads()].
+     * Threads not yet started are started here.
+     */
+    void setActiveThreads(size_t n);
+
+    size_t activeThreads() const
+    {
+        return m_active;
+    }
+
+    size_t numThreads() const
+    {
+        return m_numThreads;
+    }
+
+    /**
+     * @returns number of handlers posted but not yet started
+     */
+    size_t pendingTasks() const
+    {
+        return m_pending;
     }
 
 private:
-    void workerLoop();
+    template<typename Func>
+    auto counted(Func &&f)
+    {
+        ++m_pending;
+        return [this, f = std::forward<Func>(f)]() mutable {
+            --m_pending;
+            f();
+        };
+    }
+
+    // Threads are started on demand, up to m_numThreads, as the active limit is raised
+    void spawnUnsafe(size_t n);
+
+    void workerLoop(size_t idx);
 };
 
 using IOThreadPool = IOThreadPoolImpl;
@@ -18,8 +18,10 @@
  */
 
 #include "rpcservercore.h"
+#include "compactenvelope.h"
 
 #include "execution/executionengine.h"
+#include "execution/steptrace.h"
 #include "resources/memorymgr.h"
 #include "oplibraries/ioplibrary.h"
 #include "platform/logging.h"
@@ -27,6 +29,7 @@
 
 #include "protos.h"
 
+#include <array>
 #include <functional>
 #include <unordered_map>
 
@@ -62,13 +65,38 @@ void RpcServerCore::dispatch(ZmqServer::Sender sender, const EvenlopDef &evenlop
 
 #undef ITEM
 
-    DCHECK(sender);
+    // Requests in compact envelopes are looked up by method id instead
+    static const auto funcsById = []() {
+        std::array<const ServiceMethod *, MethodId_ARRAYSIZE> table{};
+        for (const auto &[name, func] : funcs) {
+            table[CompactEnvelope::methodOf(name)] = &func;
+        }
+        table[METHOD_UNKNOWN] = nullptr;
+        return table;
+    }();
 
-    VLOG(2) << "Serving " << evenlop.type() << " for oplibrary " << OpLibraryType_Name(evenlop.oplibrary());
+    DCHECK(sender);
 
-    auto fit = funcs.find(evenlop.type());
-    if (fit == funcs.end()) {
-        LOG(ERROR) << "Skipping request because requested method not found: " << evenlop.type();
+    const ServiceMethod *func = nullptr;
+    if (evenlop.method() != METHOD_UNKNOWN) {
+        // request was parsed by its type, a method id naming anything else must not pick the handler
+        if (!CompactEnvelope::methodMatches(evenlop.method(), *request.GetDescriptor())) {
+            LOG(ERROR) << "Skipping request because method id " << static_cast<int>(evenlop.method())
+                       << " doesn't match request of type " << request.GetTypeName();
+            return;
+        }
+        VLOG(2) << "Serving " << MethodId_Name(evenlop.method()) << " for oplibrary "
+                << OpLibraryType_Name(evenlop.oplibrary());
+        func = funcsById[evenlop.method()];
+    } else {
+        VLOG(2) << "Serving " << evenlop.type() << " for oplibrary " << OpLibraryType_Name(evenlop.oplibrary());
+        auto fit = funcs.find(evenlop.type());
+        if (fit != funcs.end()) {
+            func = &fit->second;
+        }
+    }
+    if (!func) {
+        LOG(ERROR) << "Skipping request because requested method not found: " << evenlop;
         return;
     }
 
@@ -78,7 +106,7 @@ void RpcServerCore::dispatch(ZmqServer::Sender sender, const EvenlopDef &evenlop
         return;
     }
 
-    fit->second(std::move(sender), oplib, evenlop, request);
+    (*func)(std::move(sender), oplib, evenlop, request);
 }
 
 void RpcServerCore::Run(ZmqServer::Sender &&sender, IOpLibrary *oplib, const EvenlopDef &evenlop,
@@ -154,6 +182,15 @@ void RpcServerCore::Dealloc(ZmqServer::Sender &&sender, IOpLibrary *oplib, const
 void RpcServerCore::Custom(ZmqServer::Sender &&sender, IOpLibrary *oplib, const EvenlopDef &evenlop,
                            const CustomRequest &request)
 {
+    // Account custom requests to the method they carry, if known
+    if (const auto &trace = sender->trace()) {
+        auto method = evenlop.custom_method() != METHOD_UNKNOWN ? evenlop.custom_method()
+                                                                : CompactEnvelope::methodOf(request.type());
+        if (method != METHOD_UNKNOWN && MethodId_IsValid(method)) {
+            trace->setMethod(method);
+        }
+    }
+
     oplib->onCustom(sender, evenlop, request, [sender](auto resp) {
         if (resp) {
             sender->sendMessage(std::move(resp));
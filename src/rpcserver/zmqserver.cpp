@@ -19,47 +19,99 @@
 
 #include "zmqserver.h"
 
+#include "compactenvelope.h"
 #include "rpcservercore.h"
+#include "execution/steptrace.h"
+#include "execution/threadpool/cpubudget.h"
 #include "platform/logging.h"
 #include "platform/signals.h"
+#include "utils/envutils.h"
 #include "utils/protoutils.h"
 
 #include "protos.h"
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <functional>
-#include <chrono>
 #include <iostream>
-
-using namespace std::literals::chrono_literals;
+#include <string_view>
 
 namespace {
-constexpr const char kBeAddr[] = "inproc://backend";
+
+// Receive at most this many messages before looking at the send queue again
+constexpr int kMaxRecvBatch = 64;
+
+// How often replies parked for a peer that would block are retried, in milliseconds
+constexpr long kBacklogRetryMs = 1;
+
+/**
+ * Decode either kind of envelope frame on arena.
+ * @returns nullptr if the frame is malformatted
+ */
+executor::EvenlopDef *parseEvenlop(const zmq::message_t &frame, google::protobuf::Arena *arena)
+{
+    if (!CompactEnvelope::matches(frame)) {
+        return sstl::createArenaMessage<executor::EvenlopDef>(frame.data(), frame.size(), arena);
+    }
+    auto evenlop = google::protobuf::Arena::CreateMessage<executor::EvenlopDef>(arena);
+    return CompactEnvelope::parse(frame, evenlop) ? evenlop : nullptr;
+}
+
+int zmqIOThreads()
+{
+    auto def = std::clamp<size_t>(CpuBudget::instance().share(CpuBudget::Pool::IO) / 2, 1, 4);
+    return std::max(sstl::fromEnvVar("SALUS_ZMQ_IO_THREADS", static_cast<int>(def)), 1);
+}
+
 } // namespace
 
 ZmqServer::ZmqServer()
-    : m_zmqCtx(1)
+    : m_admission(AdmissionControl::Limits::fromEnv())
+    , m_zmqCtx(zmqIOThreads())
     , m_keepRunning(false)
     , m_pLogic(std::make_unique<RpcServerCore>())
-    , m_sendQueue(128)
+    , m_wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , m_wakePending(false)
 {
+    if (m_wakeFd < 0) {
+        LOG(FATAL) << "Failed to create eventfd for send queue: " << errno;
+    }
+
+    auto numShards = sstl::fromEnvVar("SALUS_ZMQ_DISPATCH_SHARDS", static_cast<int>(m_iopool.numThreads()));
+    numShards = std::max(numShards, 1);
+    m_dispatchShards.reserve(numShards);
+    while (m_dispatchShards.size() < static_cast<size_t>(numShards)) {
+        m_dispatchShards.emplace_back(m_iopool.makeStrand());
+    }
+    VLOG(2) << "ZmqServer using " << zmqIOThreads() << " io threads and " << numShards << " dispatch shards";
 }
 
 ZmqServer::~ZmqServer()
 {
     requestStop();
+
+    if (m_recvThread && m_recvThread->joinable()) {
+        m_recvThread->join();
+    }
+    close(m_wakeFd);
 }
 
-void ZmqServer::start(const std::string& address)
+void ZmqServer::start(const std::string& address, const std::string &localAddress)
 {
     if (m_keepRunning) {
         LOG(ERROR) << "ZmqServer already started.";
         return;
     }
 
-    m_keepRunning = true;
-    m_recvThread = std::make_unique<std::thread>(std::bind(&ZmqServer::proxyRecvLoop, this, address));
+    std::vector<std::string> addresses{address};
+    if (!localAddress.empty()) {
+        addresses.emplace_back(localAddress);
+    }
 
-    m_sendThread = std::make_unique<std::thread>(std::bind(&ZmqServer::sendLoop, this));
+    m_keepRunning = true;
+    m_recvThread = std::make_unique<std::thread>(std::bind(&ZmqServer::proxyRecvLoop, this, std::move(addresses)));
 }
 
 bool ZmqServer::pollWithCheck(const std::vector<zmq::pollitem_t> &items, long timeout)
@@ -83,111 +135,142 @@ bool ZmqServer::pollWithCheck(const std::vector<zmq::pollitem_t> &items, long ti
     return true;
 }
 
-void ZmqServer::proxyRecvLoop(const std::string &feAddr)
+void ZmqServer::proxyRecvLoop(const std::vector<std::string> &feAddrs)
 {
     VLOG(2) << "Started recving and sending loop";
     zmq::socket_t m_frontend_sock(m_zmqCtx, zmq::socket_type::router);
-    zmq::socket_t m_backend_sock(m_zmqCtx, zmq::socket_type::pair);
     m_frontend_sock.setsockopt(ZMQ_ROUTER_MANDATORY, 1);
     m_frontend_sock.setsockopt(ZMQ_ROUTER_HANDOVER, 1);
 
     try {
-        VLOG(2) << "Binding frontend socket to address: " << feAddr;
-        m_frontend_sock.bind(feAddr);
-
-        VLOG(2) << "Binding backend socket to address: " << kBeAddr;
-        m_backend_sock.bind(kBeAddr);
+        for (const auto &feAddr : feAddrs) {
+            VLOG(2) << "Binding frontend socket to address: " << feAddr;
+            m_frontend_sock.bind(feAddr);
+        }
     } catch (zmq::error_t &err) {
         LOG(FATAL) << "Error while binding sockets: " << err;
         // re-throw to stop the process
         throw;
     }
 
-    // set up pulling.
-    // we are interested in POLLIN and POLLOUT on m_frontend_sock, and POLLIN out m_backend_sock.
+    // set up polling.
     // messages received on m_frontend_sock are directly dispatched using m_pLogic,
-    // messages received on m_backend_sock are forwarded to m_frontend_sock.
-
-    static std::vector<zmq::pollitem_t> pollin_events {
+    // m_wakeFd is signaled when there are messages in m_sendQueue to send out on m_frontend_sock.
+    // With ZMQ_ROUTER_MANDATORY, the socket is writable as soon as any peer is, so POLLOUT can't
+    // tell when a particular peer stops blocking. Parked replies are retried on a short timeout instead.
+    std::vector<zmq::pollitem_t> items {
         {m_frontend_sock, 0, ZMQ_POLLIN, 0},
-        {m_backend_sock, 0, ZMQ_POLLIN, 0},
-    };
-    static std::vector<zmq::pollitem_t> all_events {
-        {m_frontend_sock, 0, ZMQ_POLLIN | ZMQ_POLLOUT, 0},
-        {m_backend_sock, 0, ZMQ_POLLIN, 0},
+        {nullptr, m_wakeFd, ZMQ_POLLIN, 0},
     };
-    std::vector<zmq::pollitem_t> *wait_events = &pollin_events;
 
-    bool canSendOut = false;
-    bool needSendOut = false;
-    bool shouldDispatch = false;
+    Backlog backlog;
     while (m_keepRunning) {
-        // first blocking wait on pollin (read) events
-        VLOG(2) << "Blocking pool on " << (wait_events == &pollin_events ? "pollin events" : "all events");
-        if (!pollWithCheck(*wait_events, -1)) {
-            break;
-        }
-        // something happened, so we poll w/o waiting on all_events
-        // to set events in all_events
-        VLOG(2) << "Non-blocking poll on all events";
-        if (!pollWithCheck(all_events, 0)) {
+        VLOG(2) << "Blocking poll with " << backlog.size() << " peers backlogged";
+        if (!pollWithCheck(items, backlog.empty() ? -1 : kBacklogRetryMs)) {
             break;
         }
 
-        // process events
-        for (auto item : all_events) {
-            if (item.socket == m_frontend_sock) {
-                shouldDispatch = (item.revents & ZMQ_POLLIN) != 0;
-                canSendOut = (item.revents & ZMQ_POLLOUT) != 0;
-            } else if (item.socket == m_backend_sock) {
-                needSendOut = (item.revents & ZMQ_POLLIN) != 0;
-            }
+        const bool shouldDispatch = (items[0].revents & ZMQ_POLLIN) != 0;
+        const bool needSendOut = (items[1].revents & ZMQ_POLLIN) != 0;
+        VLOG(3) << "Events summary: shouldDispatch=" << shouldDispatch << ", needSendOut=" << needSendOut;
+
+        if (needSendOut) {
+            clearWakeup();
         }
-        VLOG(3) << "Events summary: shouldDispatch=" << shouldDispatch
-                << ", canSendOut=" << canSendOut << ", needSendOut=" << needSendOut;
 
-        // process dispatch if any
+        // process dispatch if any, draining what's already queued on the socket without polling again
         if (shouldDispatch) {
-            dispatch(m_frontend_sock);
-            shouldDispatch = false;
+            int n = 0;
+            do {
+                dispatch(m_frontend_sock);
+            } while (++n < kMaxRecvBatch && (m_frontend_sock.getsockopt<int>(ZMQ_EVENTS) & ZMQ_POLLIN));
         }
 
-        // forward any send message
-        if (needSendOut && canSendOut) {
-            VLOG(2) << "Forwarding message out";
-            zmq::message_t msg;
-            bool more = false;
-            while (true) {
-                try {
-                    m_backend_sock.recv(&msg);
-                    VLOG(2) << "Forwarding message part: " << msg;
-                    more = m_backend_sock.getsockopt<int64_t>(ZMQ_RCVMORE);
-                    m_frontend_sock.send(msg, more ? ZMQ_SNDMORE : 0);
-                    if (!more)
-                        break;
-                } catch (zmq::error_t &err) {
-                    LOG(ERROR) << "Dropping message part while sending out due to error: " << err;
-                    if (!more)
-                        break;
-                }
+        // Always try, as parked replies may be sendable by now
+        flushSendQueue(m_frontend_sock, backlog);
+    }
+}
+
+void ZmqServer::clearWakeup()
+{
+    uint64_t value;
+    // Nonblocking, EAGAIN only means there is nothing to clear
+    if (read(m_wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOG(ERROR) << "Failed to clear send queue wakeup: " << errno;
+    }
+    // Must be after the read, so a message queued from now on signals again
+    m_wakePending = false;
+}
+
+void ZmqServer::flushSendQueue(zmq::socket_t &sock, Backlog &backlog)
+{
+    auto sent = [](Reply &reply) {
+        if (reply.trace) {
+            auto now = salus::StepTrace::nowNs();
+            reply.trace->record(salus::StepTrace::Stage::SendQueue, now - reply.queuedNs);
+            reply.trace->record(salus::StepTrace::Stage::Total, now - reply.trace->startNs());
+            reply.trace.reset();
+        }
+    };
+
+    // Parked replies of a peer go out in order, until the peer would block again
+    for (auto it = backlog.begin(); it != backlog.end();) {
+        auto &replies = it->second;
+        while (!replies.empty() && trySend(sock, replies.front().parts)) {
+            sent(replies.front());
+            replies.pop_front();
+        }
+        if (replies.empty()) {
+            it = backlog.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    Reply reply;
+    while (m_sendQueue.try_dequeue(reply)) {
+        // The first frame is the identity of the peer the ROUTER socket routes to
+        const auto &identity = reply.parts->front();
+        auto it = backlog.end();
+        if (!backlog.empty()) {
+            it = backlog.find(std::string(identity.data<char>(), identity.size()));
+        }
+        if (it == backlog.end()) {
+            if (trySend(sock, reply.parts)) {
+                sent(reply);
+                continue;
             }
-            needSendOut = canSendOut = false;
-            wait_events = &pollin_events;
-        } else if (needSendOut) {
-            // should also wait for POLLOUT on m_frontend_sock
-            wait_events = &all_events;
-        } else if (canSendOut) {
-            // only wait for POLLIN on sockets
-            wait_events = &pollin_events;
+            VLOG(2) << "Peer would block, parking its replies";
+            it = backlog.try_emplace(std::string(identity.data<char>(), identity.size())).first;
         }
+        it->second.push_back(std::move(reply));
     }
 }
 
+bool ZmqServer::trySend(zmq::socket_t &sock, MultiPartMessage &parts)
+{
+    try {
+        // Multipart messages are atomic, so only the first part can fail with EAGAIN
+        if (!sock.send(parts->front(), parts->size() > 1 ? ZMQ_SNDMORE | ZMQ_DONTWAIT : ZMQ_DONTWAIT)) {
+            return false;
+        }
+        for (size_t i = 1; i < parts->size(); ++i) {
+            sock.send(parts->at(i), i + 1 < parts->size() ? ZMQ_SNDMORE : 0);
+        }
+        VLOG(2) << "Response sent out";
+    } catch (zmq::error_t &err) {
+        LOG(ERROR) << "Dropping message while sending out due to error: " << err;
+    }
+    return true;
+}
+
 void ZmqServer::dispatch(zmq::socket_t &sock)
 {
     MultiPartMessage identities;
     zmq::message_t evenlop;
     zmq::message_t body;
+    MultiPartMessage payloads;
+    const auto recvStart = salus::StepTrace::nowNs();
     try {
         VLOG(2) << "==============================================================";
         // First receive all identity frames added by ZMQ_ROUTER socket
@@ -212,16 +295,46 @@ void ZmqServer::dispatch(zmq::socket_t &sock)
             LOG(ERROR) << "Skipped one iteration due to no body message part found after identity frames";
             return;
         }
-        // NOTE: we only assume there's only one body part.
         sock.recv(&body);
         VLOG(2) << "Received body frame: " << body;
+        // Any further frames are payloads referred to by the body, e.g. tensor contents
+        while (sock.getsockopt<int64_t>(ZMQ_RCVMORE)) {
+            payloads->emplace_back();
+            sock.recv(&payloads->back());
+            VLOG(2) << "Received payload frame " << (payloads->size() - 1) << " of size " << payloads->back().size();
+        }
     } catch (zmq::error_t &err) {
         LOG(ERROR) << "Skipped one iteration due to error while receiving: " << err;
         return;
     }
 
-    m_iopool.post([this, identities{std::move(identities)}, evenlop{std::move(evenlop)}, body{std::move(body)}]() mutable {
-        auto pEvenlop = sstl::createMessage<executor::EvenlopDef>("executor.EvenlopDef", evenlop.data(), evenlop.size());
+    const auto &client = identities->front();
+    auto ticket = m_admission.admit({client.data<char>(), client.size()},
+                                    m_iopool.pendingTasks() + m_sendQueue.size_approx());
+    if (!ticket) {
+        // Reject right here, the IO pool may be what's backed up
+        shed(std::move(identities), evenlop);
+        return;
+    }
+
+    auto trace = salus::StepTrace::start(recvStart);
+    if (trace) {
+        trace->mark(salus::StepTrace::Stage::Receive);
+    }
+
+    auto &shard = dispatchShard(client);
+    m_iopool.post(shard, [this, identities{std::move(identities)}, evenlop{std::move(evenlop)}, body{std::move(body)},
+                   payloads{std::move(payloads)}, ticket{std::move(ticket)}, trace{std::move(trace)}]() mutable {
+        if (trace) {
+            trace->mark(salus::StepTrace::Stage::IOQueue);
+        }
+
+        // Everything decoded for this request is allocated on the arena, and freed all at once when done.
+        // Handlers must not keep references to the request beyond dispatch, just like before.
+        google::protobuf::Arena arena;
+
+        const bool compact = CompactEnvelope::matches(evenlop);
+        auto pEvenlop = parseEvenlop(evenlop, &arena);
         if (!pEvenlop) {
             LOG(ERROR) << "Skipped one iteration due to malformatted request evenlop received.";
             return;
@@ -232,26 +345,80 @@ void ZmqServer::dispatch(zmq::socket_t &sock)
         if (!pEvenlop->recvidentity().empty()) {
             identities->front().rebuild(pEvenlop->recvidentity().data(), pEvenlop->recvidentity().size());
         }
-        auto sender = std::make_shared<SenderImpl>(*this, pEvenlop->seq(), std::move(identities));
+        auto method = compact ? pEvenlop->method() : CompactEnvelope::methodOf(pEvenlop->type());
+        if (trace) {
+            trace->setSeq(pEvenlop->seq());
+            trace->setMethod(method);
+        }
+        auto sender = std::make_shared<SenderImpl>(*this, pEvenlop->seq(), compact, std::move(identities),
+                                                   std::move(payloads), std::move(ticket), std::move(trace));
 
         // step 2. create request object
-        auto pRequest = sstl::createMessage(pEvenlop->type(), body.data(), body.size());
+        // Legacy envelopes of a known method take the same table lookup, only other types hash the name
+        auto typeId = compact || method != executor::METHOD_UNKNOWN ? CompactEnvelope::messageType(method)
+                                                                     : sstl::messageTypeId(pEvenlop->type());
+        auto pRequest = sstl::createArenaMessage(typeId, body.data(), body.size(), &arena);
         if (!pRequest) {
             LOG(ERROR) << "Skipped one iteration due to malformatted request received.";
             return;
         }
         VLOG(2) << "Received request body byte array size " << body.size();
+        if (sender->trace()) {
+            sender->trace()->mark(salus::StepTrace::Stage::Parse);
+        }
 
         // step 3. dispatch
         m_pLogic->dispatch(std::move(sender), *pEvenlop, *pRequest);
     });
 }
 
-ZmqServer::SenderImpl::SenderImpl(ZmqServer &server, uint64_t seq, MultiPartMessage &&identities)
+void ZmqServer::shed(MultiPartMessage &&identities, const zmq::message_t &evenlop)
+{
+    google::protobuf::Arena arena;
+    auto pEvenlop = parseEvenlop(evenlop, &arena);
+    if (!pEvenlop) {
+        return;
+    }
+    auto resp = AdmissionControl::makeRejection(*pEvenlop);
+    if (!resp) {
+        LOG(ERROR) << "Dropping shed request with no known response type: " << *pEvenlop;
+        return;
+    }
+
+    if (!pEvenlop->recvidentity().empty()) {
+        identities->front().rebuild(pEvenlop->recvidentity().data(), pEvenlop->recvidentity().size());
+    }
+    SenderImpl sender(*this, pEvenlop->seq(), CompactEnvelope::matches(evenlop), std::move(identities), {}, {});
+    sender.sendMessage(std::move(resp));
+}
+
+AdmissionControl::Stats ZmqServer::admissionStats() const
+{
+    return m_admission.stats();
+}
+
+salus::IOThreadPool::Strand &ZmqServer::dispatchShard(const zmq::message_t &identity)
+{
+    auto h = std::hash<std::string_view>{}({identity.data<char>(), identity.size()});
+    return m_dispatchShards[h % m_dispatchShards.size()];
+}
+
+ZmqServer::SenderImpl::SenderImpl(ZmqServer &server, uint64_t seq, bool compact, MultiPartMessage &&identities,
+                                  MultiPartMessage &&payloads, AdmissionControl::Ticket &&ticket,
+                                  std::shared_ptr<salus::StepTrace> trace)
     : m_server(server)
     , m_identities(std::move(identities))
+    , m_payloads(std::move(payloads))
     , m_seq(seq)
+    , m_compact(compact)
+    , m_ticket(std::move(ticket))
+    , m_trace(std::move(trace))
+{
+}
+
+MultiPartMessage ZmqServer::SenderImpl::takePayloads()
 {
+    return std::move(m_payloads);
 }
 
 void ZmqServer::SenderImpl::sendMessage(ProtoPtr &&msg)
@@ -260,24 +427,34 @@ void ZmqServer::SenderImpl::sendMessage(ProtoPtr &&msg)
     parts->emplace_back(msg->ByteSizeLong());
     auto &reply = parts->back();
     msg->SerializeToArray(reply.data(), reply.size());
-    sendMessage(msg->GetTypeName(), std::move(parts));
+    sendMessage(*msg->GetDescriptor(), std::move(parts));
 }
 
-void ZmqServer::SenderImpl::sendMessage(const std::string &typeName, MultiPartMessage &&msg)
+void ZmqServer::SenderImpl::sendMessage(const google::protobuf::Descriptor &type, MultiPartMessage &&msg)
 {
     auto parts = m_identities.clone();
-    // step 4.1. unused parts of evenlop is unset to save a few bytes on the wire,
-    executor::EvenlopDef evenlop;
-    evenlop.set_seq(m_seq);
-    evenlop.set_type(typeName);
-    parts->emplace_back(evenlop.ByteSizeLong());
-    evenlop.SerializeToArray(parts->back().data(), parts->back().size());
+    parts->reserve(parts->size() + 1 + msg->size());
+    if (m_compact) {
+        // step 4.1. compact replies only need the method and seq filled in
+        auto method = CompactEnvelope::methodOf(type);
+        DCHECK_NE(method, executor::METHOD_UNKNOWN) << "No method id for reply type " << type.full_name();
+        parts->emplace_back(CompactEnvelope::makeReply(method, m_seq));
+        VLOG(2) << "Response proto object have size " << msg.totalSize() << " with compact evenlop of method "
+                << method;
+    } else {
+        // step 4.1. unused parts of evenlop is unset to save a few bytes on the wire,
+        executor::EvenlopDef evenlop;
+        evenlop.set_seq(m_seq);
+        evenlop.set_type(type.full_name());
+        parts->emplace_back(evenlop.ByteSizeLong());
+        evenlop.SerializeToArray(parts->back().data(), parts->back().size());
+        VLOG(2) << "Response proto object have size " << msg.totalSize() << " with evenlop " << evenlop;
+    }
 
     // step 4.2. append actual message
-    VLOG(2) << "Response proto object have size " << msg.totalSize() << " with evenlop " << evenlop;
     parts.merge(std::move(msg));
 
-    m_server.sendMessage(std::move(parts));
+    m_server.sendMessage(std::move(parts), m_trace);
 }
 
 uint64_t ZmqServer::SenderImpl::sequenceNumber() const
@@ -285,34 +462,15 @@ uint64_t ZmqServer::SenderImpl::sequenceNumber() const
     return m_seq;
 }
 
-void ZmqServer::sendMessage(MultiPartMessage &&parts)
+void ZmqServer::sendMessage(MultiPartMessage &&parts, std::shared_ptr<salus::StepTrace> trace)
 {
-    m_sendQueue.push({parts.release()});
-}
-
-void ZmqServer::sendLoop()
-{
-    zmq::socket_t sock(m_zmqCtx, zmq::socket_type::pair);
-    sock.connect(kBeAddr);
-    VLOG(2) << "Sending loop started";
-
-    while (m_keepRunning) {
-        SendItem item;
-        if(!m_sendQueue.pop(item)) {
-            std::this_thread::sleep_for(1ms);
-            continue;
-        }
-        // Wrap the address in smart pointer immediately so we won't risk memory leak.
-        MultiPartMessage parts(item.p_parts);
-        try {
-            for (size_t i = 0; i != parts->size() - 1; ++i) {
-                auto &msg = parts->at(i);
-                sock.send(msg, ZMQ_SNDMORE);
-            }
-            sock.send(parts->back());
-            VLOG(2) << "Response sent on internal socket";
-        } catch (zmq::error_t &err) {
-            LOG(ERROR) << "Sending error: " << err;
+    auto queuedNs = trace ? salus::StepTrace::nowNs() : 0;
+    m_sendQueue.enqueue(Reply{std::move(parts), std::move(trace), queuedNs});
+    // Only signal if the recv thread isn't already going to look at the queue
+    if (!m_wakePending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(m_wakeFd, &one, sizeof(one)) < 0) {
+            LOG(ERROR) << "Failed to wake up recv thread for sending: " << errno;
         }
     }
 }
@@ -332,17 +490,20 @@ void ZmqServer::join()
 {
     // Handle SIGINT and SIGTERM
     // so the user can stop the server from terminal
-    for (auto [signo, action] = signals::waitForTerminate(); action != signals::SignalAction::Exit;) {
+    while (true) {
+        auto [signo, action] = signals::waitForTerminate();
         UNUSED(signo);
+        if (action == signals::SignalAction::Exit) {
+            break;
+        }
+        if (action == signals::SignalAction::Report) {
+            LOG(INFO) << "Request latency by method and stage so far:\n" << salus::LatencyStats::instance().report();
+        }
     }
 
     LOG(INFO) << "Stopping ZmqServer";
     requestStop();
 
-    if (m_sendThread && m_sendThread->joinable()) {
-        m_sendThread->join();
-    }
-
     if (m_recvThread && m_recvThread->joinable()) {
         m_recvThread->join();
     }
@@ -20,26 +20,38 @@
 #ifndef ZMQSERVER_H
 #define ZMQSERVER_H
 
+#include "rpcserver/admissioncontrol.h"
 #include "rpcserver/iothreadpool.h"
 #include "utils/protoutils.h"
 #include "utils/zmqutils.h"
 
 #include <zmq.hpp>
 
-#include <boost/lockfree/queue.hpp>
+#include <concurrentqueue.h>
 
 #include <atomic>
+#include <deque>
 #include <vector>
 #include <memory>
 #include <thread>
 #include <list>
+#include <string>
+#include <unordered_map>
 
 using sstl::MultiPartMessage;
 
 class RpcServerCore;
+namespace salus {
+class StepTrace;
+} // namespace salus
 
 /**
- * @todo write docs
+ * @brief The RPC frontend.
+ *
+ * One thread owns the ROUTER socket, and only moves frames between the socket and the rest of the
+ * server. Network IO is done by SALUS_ZMQ_IO_THREADS ZeroMQ threads. Received requests are decoded
+ * and dispatched on the IO pool, in SALUS_ZMQ_DISPATCH_SHARDS strands. A client is always hashed to
+ * the same strand by its identity, so its requests are dispatched in the order they were received.
  */
 class ZmqServer
 {
@@ -51,23 +63,50 @@ public:
     /**
      * Start the server, must be called in the same thread as the constructor. Will blocks until
      * stop is called in another thread or ctrl-c signal received.
+     *
+     * If `localAddress` is not empty, the server also listens on it, e.g. an ipc:// endpoint for
+     * clients on the same host. Both endpoints are served by the same socket.
      */
-    void start(const std::string &address);
+    void start(const std::string &address, const std::string &localAddress = {});
 
     void requestStop();
 
+    /**
+     * Wait until SIGINT or SIGTERM, then stop the server. On SIGUSR1, log per-method request latency
+     * by stage and keep waiting.
+     */
     void join();
 
+    AdmissionControl::Stats admissionStats() const;
+
     class SenderImpl
     {
     public:
-        SenderImpl(ZmqServer &server, uint64_t seq, MultiPartMessage &&m_identities);
+        SenderImpl(ZmqServer &server, uint64_t seq, bool compact, MultiPartMessage &&m_identities,
+                   MultiPartMessage &&payloads, AdmissionControl::Ticket &&ticket,
+                   std::shared_ptr<salus::StepTrace> trace = nullptr);
 
         void sendMessage(ProtoPtr &&msg);
-        void sendMessage(const std::string &typeName, MultiPartMessage &&msg);
+        /**
+         * @brief Send msg, already serialized from a message of type, followed by any payload frames
+         */
+        void sendMessage(const ::google::protobuf::Descriptor &type, MultiPartMessage &&msg);
 
         uint64_t sequenceNumber() const;
 
+        /**
+         * @returns the trace of the request, or nullptr if it isn't traced
+         */
+        const std::shared_ptr<salus::StepTrace> &trace() const
+        {
+            return m_trace;
+        }
+
+        /**
+         * @brief Take the payload frames received after the request body, which the request refers to by index.
+         */
+        MultiPartMessage takePayloads();
+
         template<typename Func>
         auto post(Func &&f)
         {
@@ -83,18 +122,53 @@ public:
     private:
         ZmqServer &m_server;
         MultiPartMessage m_identities;
+        MultiPartMessage m_payloads;
         uint64_t m_seq;
+        // Whether the request came in a compact envelope, and so should the reply
+        bool m_compact;
+        // Keeps the request in flight for as long as anyone can still reply to it
+        AdmissionControl::Ticket m_ticket;
+        std::shared_ptr<salus::StepTrace> m_trace;
     };
     using Sender = std::shared_ptr<SenderImpl>;
 
 private:
+    struct Reply
+    {
+        MultiPartMessage parts;
+        // Trace of the request replied to, and when the reply was queued
+        std::shared_ptr<salus::StepTrace> trace;
+        uint64_t queuedNs = 0;
+    };
+    // Replies parked because their peer would block, in order, keyed by the peer's identity.
+    // Only used by the recv thread.
+    using Backlog = std::unordered_map<std::string, std::deque<Reply>>;
+
+    /**
+     * Low level api for sending messages back to client. Can be called from any thread,
+     * the message is queued and the recv thread is woken up to send it.
+     */
+    void sendMessage(MultiPartMessage &&parts, std::shared_ptr<salus::StepTrace> trace = nullptr);
+
+    void proxyRecvLoop(const std::vector<std::string> &feAddrs);
+
     /**
-     * Low level api for sending messages back to client.
+     * Clear the wakeup signal of m_wakeFd, after which any new message queued will signal again.
      */
-    void sendMessage(MultiPartMessage &&parts);
+    void clearWakeup();
 
-    void sendLoop();
-    void proxyRecvLoop(const std::string &feAddr);
+    /**
+     * Send parked and queued messages on sock until the queue is empty. A message whose peer would
+     * block is parked in backlog, together with any later message to the same peer, so other peers
+     * are not held up.
+     */
+    void flushSendQueue(zmq::socket_t &sock, Backlog &backlog);
+
+    /**
+     * Send parts on sock without blocking.
+     * @returns false if sock would block, in which case parts is left untouched
+     */
+    bool trySend(zmq::socket_t &sock, MultiPartMessage &parts);
 
     /**
      * Poll on items with check
@@ -106,7 +180,20 @@ private:
      */
     void dispatch(zmq::socket_t &sock);
 
+    /**
+     * Reply to a request rejected by admission control, without dispatching it
+     */
+    void shed(MultiPartMessage &&identities, const zmq::message_t &evenlop);
+
+    /**
+     * @returns the dispatch strand for the client with socket identity
+     */
+    salus::IOThreadPool::Strand &dispatchShard(const zmq::message_t &identity);
+
 private:
+    // Must outlive m_iopool, as tasks queued there hold tickets
+    AdmissionControl m_admission;
+
     // Pool to place blocking operations
     salus::IOThreadPool m_iopool;
 
@@ -114,18 +201,20 @@ private:
     zmq::context_t m_zmqCtx;
     std::atomic_bool m_keepRunning;
 
-    // For the proxy&recv loop
+    // For the recv loop, which also owns the socket and does all sending
     std::unique_ptr<std::thread> m_recvThread;
 
     std::unique_ptr<RpcServerCore> m_pLogic;
 
-    // For send loop
-    std::unique_ptr<std::thread> m_sendThread;
-    struct SendItem {
-        // we cannot use unique_ptr because boost::lockfree::queue does not support move semantics
-        std::vector<zmq::message_t> *p_parts;
-    };
-    boost::lockfree::queue<SendItem> m_sendQueue;
+    // Requests from one client are dispatched in order on the same strand
+    std::vector<salus::IOThreadPool::Strand> m_dispatchShards;
+
+    // Messages to send, from any thread to the recv thread
+    moodycamel::ConcurrentQueue<Reply> m_sendQueue;
+    // eventfd polled by the recv thread together with the socket, signaled when m_sendQueue
+    // becomes non-empty. m_wakePending avoids the syscall when a signal is already pending.
+    int m_wakeFd;
+    std::atomic_bool m_wakePending;
 };
 
 #endif // ZMQSERVER_H
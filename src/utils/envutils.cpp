@@ -18,3 +18,28 @@
  */
 
 #include "envutils.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+
+namespace sstl {
+
+bool fromEnvVarBool(const char *env, bool def)
+{
+    const char *val = std::getenv(env);
+    if (!val) {
+        return def;
+    }
+    for (auto t : {"1", "true", "yes", "on"}) {
+        if (boost::iequals(val, t)) {
+            return true;
+        }
+    }
+    for (auto f : {"0", "false", "no", "off"}) {
+        if (boost::iequals(val, f)) {
+            return false;
+        }
+    }
+    return def;
+}
+
+} // namespace sstl
@@ -60,6 +60,16 @@ inline const char *fromEnvVarStr(const char *env, const char *def)
     return env_var_val;
 }
 
+/**
+ * @brief Read a flag from environment variable. Accepts true/false, yes/no, on/off in any case, and 1/0.
+ * lexical_cast only takes 1/0 for bool, so `fromEnvVar(env, true)` would ignore e.g. "false".
+ *
+ * @param env the name of the environment variable
+ * @param def default value in case of missing or unrecognized value
+ * @return the read value or default value
+ */
+bool fromEnvVarBool(const char *env, bool def);
+
 /**
  * @brief Read a value of type `T` from environment variable. Use `def` as default value in case of
  * error or missing value. The value is only read once from the environment variable. Later call
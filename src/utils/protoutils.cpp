@@ -33,19 +33,105 @@
 #undef NEED_UNDEF_NDEBUG
 #endif
 
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
 namespace protobuf = ::google::protobuf;
 
 namespace sstl {
 
+namespace {
+
+/**
+ * Prototypes of message types seen so far, indexed by their MessageTypeId
+ */
+class TypeRegistry
+{
+public:
+    static TypeRegistry &instance()
+    {
+        static TypeRegistry registry;
+        return registry;
+    }
+
+    MessageTypeId lookup(const std::string &type)
+    {
+        {
+            std::shared_lock<std::shared_mutex> g(m_mu);
+            auto it = m_ids.find(type);
+            if (it != m_ids.end()) {
+                return it->second;
+            }
+        }
+
+        auto desc = protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(type);
+        if (!desc) {
+            LOG(ERROR) << "Protobuf descriptor not found for type name: " << type;
+            return kInvalidMessageType;
+        }
+        auto prototype = protobuf::MessageFactory::generated_factory()->GetPrototype(desc);
+        if (!prototype) {
+            LOG(ERROR) << "Failed to get prototype from descriptor of type name: " << type;
+            return kInvalidMessageType;
+        }
+
+        std::unique_lock<std::shared_mutex> g(m_mu);
+        auto [it, inserted] = m_ids.try_emplace(type, static_cast<MessageTypeId>(m_prototypes.size()));
+        if (inserted) {
+            m_prototypes.push_back(prototype);
+        }
+        return it->second;
+    }
+
+    const protobuf::Message *prototype(MessageTypeId id)
+    {
+        std::shared_lock<std::shared_mutex> g(m_mu);
+        if (id < 0 || static_cast<size_t>(id) >= m_prototypes.size()) {
+            return nullptr;
+        }
+        return m_prototypes[id];
+    }
+
+private:
+    std::shared_mutex m_mu;
+    std::unordered_map<std::string, MessageTypeId> m_ids;
+    std::vector<const protobuf::Message *> m_prototypes;
+};
+
+} // namespace
+
+MessageTypeId messageTypeId(const std::string &type)
+{
+    return TypeRegistry::instance().lookup(type);
+}
+
+protobuf::Message *createArenaMessage(MessageTypeId id, const void *data, size_t len, protobuf::Arena *arena)
+{
+    auto prototype = TypeRegistry::instance().prototype(id);
+    if (!prototype) {
+        LOG(ERROR) << "Invalid message type id: " << id;
+        return nullptr;
+    }
+
+    auto message = prototype->New(arena);
+    if (!message->ParseFromArray(data, static_cast<int>(len))) {
+        LOG(ERROR) << "Failed to parse data buffer of length " << len << " as proto message: "
+                   << prototype->GetTypeName();
+        return nullptr;
+    }
+    return message;
+}
+
 ProtoPtr newMessage(const std::string &type)
 {
-    auto desc = protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(type);
-    if (!desc) {
-        LOG(ERROR) << "Protobuf descriptor not found for type name: " << type;
+    auto prototype = TypeRegistry::instance().prototype(messageTypeId(type));
+    if (!prototype) {
         return {};
     }
 
-    auto message = protobuf::MessageFactory::generated_factory()->GetPrototype(desc)->New();
+    auto message = prototype->New();
     if (!message) {
         LOG(ERROR) << "Failed to create message object from descriptor of type name: " << type;
         return {};
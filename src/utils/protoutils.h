@@ -27,6 +27,7 @@
 #define NEED_UNDEF_NDEBUG
 #endif
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/message.h>
 
 #ifdef NEED_UNDEF_NDEBUG
@@ -34,6 +35,7 @@
 #undef NEED_UNDEF_NDEBUG
 #endif
 
+#include <cstdint>
 #include <memory>
 
 using ProtoPtr = std::unique_ptr<::google::protobuf::Message>;
@@ -73,6 +75,46 @@ std::unique_ptr<T> createLenLimitedMessage(const std::string &type,
  * @return created Message, or nullptr if not found.
  */
 ProtoPtr newMessage(const std::string &type);
+
+/**
+ * @brief Small integer id of a message type, assigned the first time the type name is looked up.
+ */
+using MessageTypeId = int32_t;
+constexpr MessageTypeId kInvalidMessageType = -1;
+
+/**
+ * @brief Get the id of message type name `type`. The descriptor pool is only searched the first
+ * time a type is seen, the prototype is cached under the id afterwards.
+ *
+ * @return the id, or kInvalidMessageType if the type is not found.
+ */
+MessageTypeId messageTypeId(const std::string &type);
+
+/**
+ * @brief Create the protobuf message of type `id` on `arena` from a byte buffer `data` of length `len`.
+ * `arena` must not be nullptr.
+ *
+ * @return created Message owned by the arena, or nullptr if id is invalid or data is malformatted.
+ */
+::google::protobuf::Message *createArenaMessage(MessageTypeId id, const void *data, size_t len,
+                                                ::google::protobuf::Arena *arena);
+
+/**
+ * @brief Create the protobuf message of type T on `arena` from a byte buffer `data` of length `len`.
+ * `arena` must not be nullptr.
+ *
+ * @return created Message owned by the arena, or nullptr if data is malformatted.
+ */
+template<typename T>
+T *createArenaMessage(const void *data, size_t len, ::google::protobuf::Arena *arena)
+{
+    auto msg = ::google::protobuf::Arena::CreateMessage<T>(arena);
+    if (!msg->ParseFromArray(data, static_cast<int>(len))) {
+        return nullptr;
+    }
+    return msg;
+}
+
 } // namespace sstl
 
 #endif // SALUS_SSTL_PROTOUTILS_H
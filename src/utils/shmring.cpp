@@ -0,0 +1,208 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shmring.h"
+
+#include "platform/logging.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <limits>
+
+namespace sstl {
+
+namespace {
+constexpr uint64_t kMagic = 0x53414c5553524e47; // "SALUSRNG"
+// Keep data page aligned, which is also aligned for any tensor
+constexpr size_t kHeaderSize = 4096;
+} // namespace
+
+struct ShmRing::Header
+{
+    uint64_t magic;
+    uint64_t capacity;
+    // Written by the consumer, read by the producer
+    alignas(64) std::atomic<uint64_t> tail;
+    // Written by the producer: where it last skipped to the next lap. As at most one lap boundary is
+    // between tail and head, this tells the consumer whether the rest of tail's lap is unused.
+    alignas(64) std::atomic<uint64_t> padStart;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory atomics must be lock free");
+
+std::shared_ptr<ShmRing> ShmRing::open(const std::string &name)
+{
+    auto fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        LOG(ERROR) << "Failed to open shared memory " << name << ": " << errno;
+        return nullptr;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= kHeaderSize) {
+        LOG(ERROR) << "Shared memory " << name << " is too small to be a ring";
+        close(fd);
+        return nullptr;
+    }
+
+    auto size = static_cast<size_t>(st.st_size);
+    auto base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map shared memory " << name << ": " << errno;
+        return nullptr;
+    }
+
+    auto header = static_cast<Header *>(base);
+    if (header->magic != kMagic || header->capacity + kHeaderSize > size || header->capacity % kAlignment != 0) {
+        LOG(ERROR) << "Shared memory " << name << " is not a valid ring";
+        munmap(base, size);
+        return nullptr;
+    }
+
+    return std::shared_ptr<ShmRing>(new ShmRing(name, base, size, false));
+}
+
+std::shared_ptr<ShmRing> ShmRing::create(const std::string &name, size_t capacity)
+{
+    capacity = alignUp(capacity);
+    if (capacity == 0) {
+        return nullptr;
+    }
+
+    auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        LOG(ERROR) << "Failed to create shared memory " << name << ": " << errno;
+        return nullptr;
+    }
+
+    auto size = kHeaderSize + capacity;
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        LOG(ERROR) << "Failed to size shared memory " << name << ": " << errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    auto base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map shared memory " << name << ": " << errno;
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    static_assert(sizeof(Header) <= kHeaderSize);
+    auto header = new (base) Header;
+    header->capacity = capacity;
+    header->tail.store(0);
+    header->padStart.store(std::numeric_limits<uint64_t>::max());
+    // Publish last, so a peer never sees a valid magic on a half initialized header
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = kMagic;
+
+    return std::shared_ptr<ShmRing>(new ShmRing(name, base, size, true));
+}
+
+ShmRing::ShmRing(std::string name, void *base, size_t mappedSize, bool owner)
+    : m_name(std::move(name))
+    , m_base(base)
+    , m_mappedSize(mappedSize)
+    , m_owner(owner)
+    , m_header(static_cast<Header *>(base))
+    , m_data(static_cast<char *>(base) + kHeaderSize)
+    , m_capacity(m_header->capacity)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    munmap(m_base, m_mappedSize);
+    if (m_owner) {
+        shm_unlink(m_name.c_str());
+    }
+}
+
+void *ShmRing::at(uint64_t pos, size_t size) const
+{
+    auto offset = pos % m_capacity;
+    if (size > m_capacity - offset) {
+        return nullptr;
+    }
+    return m_data + offset;
+}
+
+std::optional<uint64_t> ShmRing::reserve(size_t size)
+{
+    size = alignUp(size);
+    if (size == 0 || size > m_capacity) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> g(m_mu);
+    auto pos = m_head;
+    // Don't split at the end of the ring, skip to the next lap
+    auto offset = pos % m_capacity;
+    const bool skip = size > m_capacity - offset;
+    if (skip) {
+        pos += m_capacity - offset;
+    }
+
+    // With everything released, the skipped rest of the lap is free too, even though tail is still before it
+    auto tail = m_header->tail.load(std::memory_order_acquire);
+    if (tail != m_head && pos + size - tail > m_capacity) {
+        return {};
+    }
+
+    if (skip) {
+        m_header->padStart.store(m_head, std::memory_order_release);
+    }
+    m_head = pos + size;
+    return pos;
+}
+
+void ShmRing::release(uint64_t pos, size_t size)
+{
+    size = alignUp(size);
+    if (size == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> g(m_mu);
+    m_released.emplace(pos, pos + size);
+
+    auto tail = m_header->tail.load(std::memory_order_relaxed);
+    const auto padStart = m_header->padStart.load(std::memory_order_acquire);
+    auto it = m_released.begin();
+    while (it != m_released.end()) {
+        auto [begin, end] = *it;
+        // The producer may have skipped the rest of the lap
+        if (begin != tail && !(tail == padStart && begin == tail + m_capacity - tail % m_capacity)) {
+            break;
+        }
+        tail = end;
+        it = m_released.erase(it);
+    }
+    m_header->tail.store(tail, std::memory_order_release);
+}
+
+} // namespace sstl
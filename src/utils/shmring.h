@@ -0,0 +1,125 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SALUS_SSTL_SHMRING_H
+#define SALUS_SSTL_SHMRING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace sstl {
+
+/**
+ * @brief Single producer, single consumer byte ring in a POSIX shared memory object, for
+ * passing bulk data between processes on the same host.
+ *
+ * The object starts with a header page, followed by `capacity` bytes of data. Positions are
+ * byte offsets that only grow, and map to data offset `pos % capacity`. Data is never split
+ * at the end of the ring: the producer skips to the next lap instead. Both sides round
+ * sizes up to kAlignment.
+ *
+ * The producer reserves space and tells the consumer about (pos, size) out of band, e.g. in
+ * a message. The consumer releases ranges when done, in any order, which advances the shared
+ * tail once all data before it is released.
+ */
+class ShmRing
+{
+public:
+    static constexpr size_t kAlignment = 64;
+
+    /**
+     * @brief Map an existing shared memory ring created by the peer.
+     * @returns nullptr if the object doesn't exist or isn't a ring
+     */
+    static std::shared_ptr<ShmRing> open(const std::string &name);
+
+    /**
+     * @brief Create a new shared memory ring with `capacity` bytes of data, rounded up to kAlignment.
+     * The object is unlinked when the returned ring is destroyed.
+     * @returns nullptr on failure
+     */
+    static std::shared_ptr<ShmRing> create(const std::string &name, size_t capacity);
+
+    ~ShmRing();
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    const std::string &name() const
+    {
+        return m_name;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    /**
+     * @returns pointer to data at [pos, pos + size), or nullptr if the range is not within one lap
+     */
+    void *at(uint64_t pos, size_t size) const;
+
+    /**
+     * @brief Producer side: reserve `size` bytes. Thread safe.
+     * @returns position of the reserved space, or nullopt if the consumer hasn't released enough space
+     */
+    std::optional<uint64_t> reserve(size_t size);
+
+    /**
+     * @brief Consumer side: release [pos, pos + size) back to the producer. Thread safe.
+     */
+    void release(uint64_t pos, size_t size);
+
+private:
+    struct Header;
+
+    ShmRing(std::string name, void *base, size_t mappedSize, bool owner);
+
+    static size_t alignUp(size_t n)
+    {
+        return (n + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    const std::string m_name;
+    void *const m_base;
+    const size_t m_mappedSize;
+    const bool m_owner;
+    Header *m_header;
+    char *m_data;
+    size_t m_capacity;
+
+    // A process is either the producer or the consumer of a ring, so one lock is enough for both sides
+    std::mutex m_mu;
+
+    // Producer state
+    uint64_t m_head = 0;
+
+    // Consumer state: ranges released ahead of tail, by position
+    std::map<uint64_t, uint64_t> m_released;
+};
+
+} // namespace sstl
+
+#endif // SALUS_SSTL_SHMRING_H
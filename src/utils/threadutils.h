@@ -216,8 +216,7 @@ std::enable_if_t<std::is_pointer_v<typename std::iterator_traits<Iterator>::valu
     lock_shared(b, e);
 }
 
-template<typename Iterator, typename = std::enable_if_t<std::is_same_v<
-                                typename std::iterator_traits<Iterator>::value_type, boost::shared_mutex>>>
+template<typename Iterator, typename>
 void lock_shared(Iterator begin, Iterator end)
 {
     using Mutex = typename std::iterator_traits<Iterator>::value_type;
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rpcserver/admissioncontrol.h"
+
+#include "protos.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using Ticket = AdmissionControl::Ticket;
+
+TEST(AdmissionControl, LimitsRequestsPerClient)
+{
+    AdmissionControl ac({0, 2, 0});
+
+    auto a1 = ac.admit("a", 0);
+    auto a2 = ac.admit("a", 0);
+    EXPECT_TRUE(a1);
+    EXPECT_TRUE(a2);
+    EXPECT_FALSE(ac.admit("a", 0));
+    // Other clients are not affected
+    auto b1 = ac.admit("b", 0);
+    EXPECT_TRUE(b1);
+
+    // Releasing a ticket makes room again
+    a1 = {};
+    EXPECT_TRUE(ac.admit("a", 0));
+
+    auto stats = ac.stats();
+    EXPECT_EQ(stats.admitted, 4u);
+    EXPECT_EQ(stats.shedClientInFlight, 1u);
+    EXPECT_EQ(stats.inFlight, 2u);
+}
+
+TEST(AdmissionControl, LimitsRequestsInFlight)
+{
+    AdmissionControl ac({3, 0, 0});
+
+    std::vector<Ticket> tickets;
+    for (auto client : {"a", "b", "c"}) {
+        tickets.push_back(ac.admit(client, 0));
+        EXPECT_TRUE(tickets.back());
+    }
+    EXPECT_FALSE(ac.admit("d", 0));
+    EXPECT_EQ(ac.stats().shedInFlight, 1u);
+
+    tickets.pop_back();
+    EXPECT_TRUE(ac.admit("d", 0));
+}
+
+TEST(AdmissionControl, LimitsQueuedWork)
+{
+    AdmissionControl ac({0, 0, 10});
+
+    EXPECT_TRUE(ac.admit("a", 9));
+    EXPECT_FALSE(ac.admit("a", 10));
+    auto stats = ac.stats();
+    EXPECT_EQ(stats.shedQueued, 1u);
+    // The admitted ticket was released right away
+    EXPECT_EQ(stats.inFlight, 0u);
+}
+
+TEST(AdmissionControl, ZeroMeansNoLimit)
+{
+    AdmissionControl ac({0, 0, 0});
+
+    std::vector<Ticket> tickets;
+    for (int i = 0; i != 1000; ++i) {
+        tickets.push_back(ac.admit("a", 1000000));
+        ASSERT_TRUE(tickets.back());
+    }
+    EXPECT_EQ(ac.stats().inFlight, 1000u);
+    tickets.clear();
+    EXPECT_EQ(ac.stats().inFlight, 0u);
+}
+
+TEST(AdmissionControl, MovedTicketReleasesOnce)
+{
+    AdmissionControl ac({1, 1, 0});
+
+    auto t = ac.admit("a", 0);
+    ASSERT_TRUE(t);
+    Ticket moved(std::move(t));
+    EXPECT_FALSE(t);
+    EXPECT_TRUE(moved);
+    EXPECT_FALSE(ac.admit("a", 0));
+
+    Ticket assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(ac.stats().inFlight, 1u);
+    assigned = {};
+    EXPECT_EQ(ac.stats().inFlight, 0u);
+    EXPECT_TRUE(ac.admit("a", 0));
+}
+
+TEST(AdmissionControl, RejectionIsRetryableResponse)
+{
+    executor::EvenlopDef legacy;
+    legacy.set_type("executor.RunRequest");
+    auto msg = AdmissionControl::makeRejection(legacy);
+    ASSERT_TRUE(msg);
+    auto resp = dynamic_cast<executor::RunResponse *>(msg.get());
+    ASSERT_NE(resp, nullptr);
+    EXPECT_EQ(resp->result().code(), AdmissionControl::kRetryableCode);
+
+    executor::EvenlopDef compact;
+    compact.set_method(executor::ALLOC_REQUEST);
+    msg = AdmissionControl::makeRejection(compact);
+    ASSERT_TRUE(msg);
+    EXPECT_EQ(msg->GetTypeName(), "executor.AllocResponse");
+
+    executor::EvenlopDef unknown;
+    unknown.set_type("executor.NoSuchThing");
+    EXPECT_FALSE(AdmissionControl::makeRejection(unknown));
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rpcserver/compactenvelope.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <string>
+
+using executor::EvenlopDef;
+
+namespace {
+
+zmq::message_t makeFrame(CompactEnvelope::Header h, const std::string &identity = "")
+{
+    h.identityLen = static_cast<uint8_t>(identity.size());
+    zmq::message_t frame(sizeof(h) + identity.size());
+    std::memcpy(frame.data(), &h, sizeof(h));
+    std::memcpy(static_cast<char *>(frame.data()) + sizeof(h), identity.data(), identity.size());
+    return frame;
+}
+
+CompactEnvelope::Header validHeader()
+{
+    return {CompactEnvelope::kMagic, CompactEnvelope::kVersion, executor::CUSTOM_REQUEST,
+            executor::TF_RUN_STEP_REQUEST, executor::TENSORFLOW, 0, 42};
+}
+
+} // namespace
+
+TEST(CompactEnvelope, ParsesValidFrame)
+{
+    auto frame = makeFrame(validHeader(), "client");
+    ASSERT_TRUE(CompactEnvelope::matches(frame));
+
+    EvenlopDef evenlop;
+    ASSERT_TRUE(CompactEnvelope::parse(frame, &evenlop));
+    EXPECT_EQ(evenlop.seq(), 42u);
+    EXPECT_EQ(evenlop.method(), executor::CUSTOM_REQUEST);
+    EXPECT_EQ(evenlop.custom_method(), executor::TF_RUN_STEP_REQUEST);
+    EXPECT_EQ(evenlop.oplibrary(), executor::TENSORFLOW);
+    EXPECT_EQ(evenlop.recvidentity(), "client");
+    EXPECT_TRUE(evenlop.type().empty());
+}
+
+TEST(CompactEnvelope, LegacyEnvelopeDoesNotMatch)
+{
+    EvenlopDef legacy;
+    legacy.set_type("executor.RunRequest");
+    legacy.set_seq(1);
+    auto bytes = legacy.SerializeAsString();
+    zmq::message_t frame(bytes.data(), bytes.size());
+    EXPECT_FALSE(CompactEnvelope::matches(frame));
+    EXPECT_FALSE(CompactEnvelope::matches(zmq::message_t()));
+}
+
+TEST(CompactEnvelope, RejectsMalformedFrames)
+{
+    EvenlopDef evenlop;
+
+    auto full = makeFrame(validHeader());
+    zmq::message_t truncated(full.data(), full.size() - 1);
+    EXPECT_FALSE(CompactEnvelope::parse(truncated, &evenlop));
+
+    auto h = validHeader();
+    h.version = CompactEnvelope::kVersion + 1;
+    EXPECT_FALSE(CompactEnvelope::parse(makeFrame(h), &evenlop));
+
+    // identityLen says more than the frame has
+    auto withIdentity = makeFrame(validHeader(), "id");
+    zmq::message_t shortIdentity(withIdentity.data(), withIdentity.size() - 1);
+    EXPECT_FALSE(CompactEnvelope::parse(shortIdentity, &evenlop));
+}
+
+TEST(CompactEnvelope, RejectsBadIds)
+{
+    EvenlopDef evenlop;
+
+    auto h = validHeader();
+    h.method = executor::MethodId_ARRAYSIZE;
+    EXPECT_FALSE(CompactEnvelope::parse(makeFrame(h), &evenlop));
+
+    h = validHeader();
+    h.customMethod = 0xffff;
+    EXPECT_FALSE(CompactEnvelope::parse(makeFrame(h), &evenlop));
+
+    h = validHeader();
+    h.oplibrary = 0xff;
+    EXPECT_FALSE(CompactEnvelope::parse(makeFrame(h), &evenlop));
+
+    EXPECT_EQ(CompactEnvelope::messageType(static_cast<executor::MethodId>(executor::MethodId_ARRAYSIZE)),
+              sstl::kInvalidMessageType);
+    EXPECT_TRUE(CompactEnvelope::typeName(static_cast<executor::MethodId>(-1)).empty());
+}
+
+TEST(CompactEnvelope, MethodMustMatchRequestType)
+{
+    const auto &run = *executor::RunRequest::descriptor();
+    EXPECT_TRUE(CompactEnvelope::methodMatches(executor::RUN_REQUEST, run));
+
+    // A valid id naming another type would make the handler misread the request
+    EXPECT_FALSE(CompactEnvelope::methodMatches(executor::ALLOC_REQUEST, run));
+    EXPECT_FALSE(CompactEnvelope::methodMatches(executor::METHOD_UNKNOWN, run));
+    EXPECT_FALSE(CompactEnvelope::methodMatches(executor::MethodId_ARRAYSIZE, run));
+    EXPECT_FALSE(CompactEnvelope::methodMatches(-1, run));
+    EXPECT_FALSE(CompactEnvelope::methodMatches(1 << 20, run));
+}
+
+TEST(CompactEnvelope, ReplyRoundTrip)
+{
+    auto frame = CompactEnvelope::makeReply(executor::RUN_RESPONSE, 7);
+    ASSERT_TRUE(CompactEnvelope::matches(frame));
+
+    EvenlopDef evenlop;
+    ASSERT_TRUE(CompactEnvelope::parse(frame, &evenlop));
+    EXPECT_EQ(evenlop.method(), executor::RUN_RESPONSE);
+    EXPECT_EQ(evenlop.seq(), 7u);
+    EXPECT_EQ(CompactEnvelope::typeName(executor::RUN_RESPONSE), "executor.RunResponse");
+    EXPECT_NE(CompactEnvelope::messageType(executor::RUN_RESPONSE), sstl::kInvalidMessageType);
+}
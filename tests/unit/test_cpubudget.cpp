@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/threadpool/cpubudget.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+
+using Pool = CpuBudget::Pool;
+
+TEST(CpuBudget, RebalanceMovesThreadToBusyPool)
+{
+    // No background thread, rebalance is driven by the test
+    CpuBudget budget(8, 0);
+    const auto engineShare = budget.share(Pool::Engine);
+    const auto ioShare = budget.share(Pool::IO);
+    ASSERT_GT(ioShare, 1u);
+
+    std::atomic<size_t> enginePending{0};
+    size_t engineThreads = 0;
+    size_t ioThreads = 0;
+    // Pools may look at the budget while being resized
+    budget.attach(Pool::Engine, [&]() { return enginePending.load(); },
+                  [&](size_t n) { engineThreads = n; EXPECT_EQ(budget.current(Pool::Engine), n); });
+    budget.attach(Pool::IO, []() { return size_t{0}; },
+                  [&](size_t n) { ioThreads = n; EXPECT_EQ(budget.current(Pool::IO), n); });
+    EXPECT_EQ(engineThreads, engineShare);
+    EXPECT_EQ(ioThreads, ioShare);
+
+    // Nothing queued, nothing moves
+    budget.rebalance();
+    EXPECT_EQ(engineThreads, engineShare);
+
+    enginePending = 100;
+    budget.rebalance();
+    EXPECT_EQ(engineThreads, engineShare + 1);
+    EXPECT_EQ(ioThreads, ioShare - 1);
+
+    // IO keeps at least one thread
+    for (size_t i = 0; i != ioShare; ++i) {
+        budget.rebalance();
+    }
+    EXPECT_EQ(ioThreads, 1u);
+    EXPECT_EQ(engineThreads, engineShare + ioShare - 1);
+    EXPECT_LE(engineThreads, budget.limit(Pool::Engine));
+
+    budget.detach(Pool::IO);
+    budget.detach(Pool::Engine);
+}
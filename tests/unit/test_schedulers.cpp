@@ -0,0 +1,211 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/scheduler/basescheduler.h"
+#include "execution/engine/taskexecutor.h"
+#include "execution/scheduler/schedulingparam.h"
+#include "execution/threadpool/threadpool.h"
+#include "resources/resources.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/container/small_vector.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace salus;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr size_t kMemCapacity = 1000;
+
+ThreadPoolOptions makePoolOptions()
+{
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    return opts;
+}
+
+class SchedulerOrdering : public ::testing::Test
+{
+protected:
+    SchedulerOrdering()
+        : exec(pool, monitor, param)
+    {
+        Resources cap;
+        cap[resources::CPU0Memory] = kMemCapacity;
+        cap[resources::GPU0Memory] = kMemCapacity;
+        monitor.initializeLimits(cap);
+    }
+
+    PSessionItem addSession(const std::string &handle)
+    {
+        return sessions.emplace_back(std::make_shared<SessionItem>(handle));
+    }
+
+    // Runs one pre-scheduling iteration and returns the candidate handles in order
+    std::vector<std::string> order(BaseScheduler &scheduler)
+    {
+        SessionList added;
+        SessionChangeSet changeset;
+        changeset.addedSessionBegin = added.begin();
+        changeset.addedSessionEnd = added.end();
+
+        boost::container::small_vector<PSessionItem, 5> candidates;
+        scheduler.notifyPreSchedulingIteration(sessions, changeset, &candidates);
+
+        std::vector<std::string> handles;
+        for (auto &item : candidates) {
+            handles.emplace_back(item->sessHandle);
+        }
+        return handles;
+    }
+
+    std::unique_ptr<BaseScheduler> create(std::string_view name)
+    {
+        auto scheduler = SchedulerRegistary::instance().create(name, exec);
+        EXPECT_TRUE(scheduler);
+        return scheduler;
+    }
+
+    ThreadPool pool{makePoolOptions()};
+    ResourceMonitor monitor;
+    SchedulingParam param;
+    TaskExecutor exec;
+
+    SessionList sessions;
+};
+
+using Order = std::vector<std::string>;
+
+} // namespace
+
+TEST_F(SchedulerOrdering, DRFLeastDominantShareFirst)
+{
+    auto a = addSession("a");
+    auto b = addSession("b");
+    auto c = addSession("c");
+    a->resourceUsage(resources::GPU0Memory) = 600;
+    b->resourceUsage(resources::CPU0Memory) = 200;
+    // c's dominant resource is CPU memory, not the smaller GPU usage
+    c->resourceUsage(resources::GPU0Memory) = 100;
+    c->resourceUsage(resources::CPU0Memory) = 400;
+
+    auto drf = create("drf");
+    EXPECT_EQ(order(*drf), (Order{"b", "c", "a"}));
+}
+
+TEST_F(SchedulerOrdering, DRFWeightScalesShare)
+{
+    auto a = addSession("a");
+    auto b = addSession("b");
+    a->resourceUsage(resources::GPU0Memory) = 600;
+    b->resourceUsage(resources::GPU0Memory) = 200;
+
+    auto drf = create("drf");
+    EXPECT_EQ(order(*drf), (Order{"b", "a"}));
+
+    // 600 / 4 < 200 / 1
+    a->weight = 4;
+    EXPECT_EQ(order(*drf), (Order{"a", "b"}));
+}
+
+TEST_F(SchedulerOrdering, DRFCountsComputeTime)
+{
+    auto a = addSession("a");
+    auto b = addSession("b");
+    a->usedComputeTime = 1000;
+
+    auto drf = create("drf");
+    EXPECT_EQ(order(*drf), (Order{"b", "a"}));
+
+    // b catches up and then uses much more compute in the following iterations
+    for (int i = 0; i != 5; ++i) {
+        b->usedComputeTime += 1000;
+        EXPECT_EQ(order(*drf).back(), "b") << "iteration " << i;
+    }
+}
+
+TEST_F(SchedulerOrdering, DRFComputeShareAtMostOne)
+{
+    auto a = addSession("a");
+    addSession("b");
+    auto drf = create("drf");
+
+    // Tasks finishing on workers keep adding compute time while the shares are computed
+    std::atomic<bool> stop{false};
+    std::thread worker([&]() {
+        while (!stop) {
+            a->usedComputeTime += 1;
+        }
+    });
+
+    const std::string prefix = "dominant: ";
+    for (int i = 0; i != 1000; ++i) {
+        order(*drf);
+        auto str = drf->debugString(a);
+        ASSERT_EQ(str.compare(0, prefix.size(), prefix), 0) << str;
+        EXPECT_LE(std::stod(str.substr(prefix.size())), 1.0) << "iteration " << i;
+    }
+
+    stop = true;
+    worker.join();
+}
+
+TEST_F(SchedulerOrdering, FairLeastServiceFirst)
+{
+    auto a = addSession("a");
+    auto b = addSession("b");
+    // fair service is accounted on GPU memory usage
+    a->notifyAlloc(1, 1, resources::GPU0Memory, 500);
+
+    std::this_thread::sleep_for(20ms);
+
+    auto fair = create("fair");
+    EXPECT_EQ(order(*fair), (Order{"b", "a"}));
+
+    // once a frees memory and b holds more, b keeps receiving service and eventually overtakes a
+    a->notifyDealloc(1, 1, resources::GPU0Memory, 500, true);
+    b->notifyAlloc(1, 2, resources::GPU0Memory, 800);
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (order(*fair) != Order{"a", "b"} && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(5ms);
+    }
+    EXPECT_EQ(order(*fair), (Order{"a", "b"}));
+}
+
+TEST_F(SchedulerOrdering, FairWeightNormalizesService)
+{
+    auto a = addSession("a");
+    auto b = addSession("b");
+    a->notifyAlloc(1, 1, resources::GPU0Memory, 500);
+    b->notifyAlloc(1, 2, resources::GPU0Memory, 500);
+    a->weight = 4;
+
+    std::this_thread::sleep_for(20ms);
+
+    auto fair = create("fair");
+    EXPECT_EQ(order(*fair), (Order{"a", "b"}));
+}
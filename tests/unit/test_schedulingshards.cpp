@@ -0,0 +1,192 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/engine/schedulingshards.h"
+#include "execution/scheduler/sessionitem.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/container/small_vector.hpp>
+
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+using salus::SchedulingShards;
+
+namespace {
+
+struct Decisions
+{
+    std::set<std::string> visited;
+    size_t scheduled = 0;
+};
+
+// Mimics what policies return from maybeScheduleFrom: only continue after a session that
+// scheduled nothing, and only when work conserving.
+class FakePolicy
+{
+public:
+    FakePolicy(std::unordered_map<std::string, size_t> plan, bool workConservative)
+        : m_plan(std::move(plan))
+        , m_workConservative(workConservative)
+    {
+    }
+
+    std::pair<size_t, bool> operator()(const PSessionItem &item)
+    {
+        auto count = m_plan.at(item->sessHandle);
+        {
+            std::lock_guard<std::mutex> g(m_mu);
+            m_visited.insert(item->sessHandle);
+        }
+        return {count, m_workConservative && count == 0};
+    }
+
+    std::set<std::string> visited() const
+    {
+        std::lock_guard<std::mutex> g(m_mu);
+        return m_visited;
+    }
+
+private:
+    const std::unordered_map<std::string, size_t> m_plan;
+    const bool m_workConservative;
+
+    mutable std::mutex m_mu;
+    std::set<std::string> m_visited;
+};
+
+using Candidates = boost::container::small_vector<PSessionItem, 8>;
+
+Candidates makeCandidates(size_t n)
+{
+    Candidates candidates;
+    for (size_t i = 0; i != n; ++i) {
+        candidates.emplace_back(std::make_shared<SessionItem>("sess" + std::to_string(i)));
+    }
+    return candidates;
+}
+
+Decisions sequential(const Candidates &candidates, const std::unordered_map<std::string, size_t> &plan,
+                     bool workConservative)
+{
+    FakePolicy policy(plan, workConservative);
+    Decisions d;
+    for (auto &item : candidates) {
+        auto [count, shouldContinue] = policy(item);
+        d.scheduled += count;
+        if (!shouldContinue) {
+            break;
+        }
+    }
+    d.visited = policy.visited();
+    return d;
+}
+
+Decisions sharded(SchedulingShards &shards, const Candidates &candidates,
+                  const std::unordered_map<std::string, size_t> &plan, bool workConservative)
+{
+    FakePolicy policy(plan, workConservative);
+    Decisions d;
+    d.scheduled = shards.scheduleAll(candidates, std::ref(policy), !workConservative);
+    d.visited = policy.visited();
+    return d;
+}
+
+std::unordered_map<std::string, size_t> randomPlan(const Candidates &candidates, std::mt19937 &rng)
+{
+    std::uniform_int_distribution<size_t> dist(0, 3);
+    std::unordered_map<std::string, size_t> plan;
+    for (auto &item : candidates) {
+        plan[item->sessHandle] = dist(rng);
+    }
+    return plan;
+}
+
+} // namespace
+
+TEST(SchedulingShards, ShardOfIsStable)
+{
+    auto candidates = makeCandidates(16);
+    for (auto &item : candidates) {
+        auto shard = SchedulingShards::shardOf(*item, 4);
+        EXPECT_LT(shard, 4u);
+        EXPECT_EQ(shard, SchedulingShards::shardOf(*item, 4));
+        EXPECT_EQ(SchedulingShards::shardOf(*item, 1), 0u);
+    }
+}
+
+TEST(SchedulingShards, NonWorkConservingMatchesSequential)
+{
+    std::mt19937 rng(42);
+    for (size_t numShards : {2, 3, 4}) {
+        SchedulingShards shards(numShards);
+        for (int round = 0; round != 50; ++round) {
+            auto candidates = makeCandidates(8);
+            auto plan = randomPlan(candidates, rng);
+
+            auto expected = sequential(candidates, plan, false);
+            auto actual = sharded(shards, candidates, plan, false);
+
+            ASSERT_EQ(expected.visited, std::set<std::string>{candidates.front()->sessHandle});
+            EXPECT_EQ(actual.visited, expected.visited) << "shards: " << numShards << " round: " << round;
+            EXPECT_EQ(actual.scheduled, expected.scheduled) << "shards: " << numShards << " round: " << round;
+        }
+    }
+}
+
+TEST(SchedulingShards, WorkConservingIdleVisitsAll)
+{
+    SchedulingShards shards(4);
+    auto candidates = makeCandidates(8);
+    std::unordered_map<std::string, size_t> plan;
+    for (auto &item : candidates) {
+        plan[item->sessHandle] = 0;
+    }
+
+    auto expected = sequential(candidates, plan, true);
+    auto actual = sharded(shards, candidates, plan, true);
+
+    EXPECT_EQ(expected.visited.size(), candidates.size());
+    EXPECT_EQ(actual.visited, expected.visited);
+    EXPECT_EQ(actual.scheduled, 0u);
+}
+
+TEST(SchedulingShards, WorkConservingVisitsAtLeastSequential)
+{
+    std::mt19937 rng(7);
+    SchedulingShards shards(4);
+    for (int round = 0; round != 50; ++round) {
+        auto candidates = makeCandidates(8);
+        auto plan = randomPlan(candidates, rng);
+
+        auto expected = sequential(candidates, plan, true);
+        auto actual = sharded(shards, candidates, plan, true);
+
+        // Shards may speculatively visit candidates ranked after the stopping one, but never skip
+        // any candidate a sequential pass would visit.
+        for (auto &handle : expected.visited) {
+            EXPECT_EQ(actual.visited.count(handle), 1u) << handle << " round: " << round;
+        }
+        EXPECT_GE(actual.scheduled, expected.scheduled);
+    }
+}
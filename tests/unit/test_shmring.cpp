@@ -0,0 +1,103 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "utils/shmring.h"
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+using sstl::ShmRing;
+
+namespace {
+
+constexpr size_t kCapacity = 4 * ShmRing::kAlignment;
+
+std::string ringName(const char *test)
+{
+    return "/salus-test-" + std::to_string(getpid()) + "-" + test;
+}
+
+} // namespace
+
+TEST(ShmRing, LoopbackInProcess)
+{
+    // Producer and consumer are the two ends of the same object, mapped twice
+    auto producer = ShmRing::create(ringName("loopback"), kCapacity);
+    ASSERT_TRUE(producer);
+    auto consumer = ShmRing::open(producer->name());
+    ASSERT_TRUE(consumer);
+    EXPECT_EQ(consumer->capacity(), kCapacity);
+
+    const std::string payload = "tensor content passed through shared memory";
+    auto pos = producer->reserve(payload.size());
+    ASSERT_TRUE(pos);
+    EXPECT_EQ(*pos % ShmRing::kAlignment, 0u);
+    std::memcpy(producer->at(*pos, payload.size()), payload.data(), payload.size());
+
+    auto data = static_cast<const char *>(consumer->at(*pos, payload.size()));
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(std::string(data, payload.size()), payload);
+
+    // The whole ring is only available again after the consumer released the range
+    EXPECT_FALSE(producer->reserve(kCapacity));
+    consumer->release(*pos, payload.size());
+    EXPECT_TRUE(producer->reserve(kCapacity));
+}
+
+TEST(ShmRing, ReserveReleaseWrapAround)
+{
+    auto producer = ShmRing::create(ringName("wrap"), kCapacity);
+    ASSERT_TRUE(producer);
+    auto consumer = ShmRing::open(producer->name());
+    ASSERT_TRUE(consumer);
+
+    const size_t half = kCapacity / 2;
+    const size_t quarter = kCapacity / 4;
+
+    auto a = producer->reserve(half);
+    auto b = producer->reserve(quarter);
+    ASSERT_TRUE(a && b);
+    EXPECT_EQ(*a, 0u);
+    EXPECT_EQ(*b, half);
+    // Only a quarter is left at the end of the lap, and nothing was released yet
+    EXPECT_FALSE(producer->reserve(half));
+
+    consumer->release(*a, half);
+    // Not split at the end of the ring: skips the last quarter and continues on the next lap
+    auto c = producer->reserve(half);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(*c, kCapacity);
+    EXPECT_EQ(producer->at(*c, half), producer->at(0, half));
+    EXPECT_EQ(consumer->at(kCapacity - quarter, half), nullptr);
+
+    // The skipped quarter plus b are all that's left, which is still in use
+    EXPECT_FALSE(producer->reserve(quarter));
+
+    // Released out of order, tail moves over b, the skipped quarter and c only once all are back
+    consumer->release(*c, half);
+    EXPECT_FALSE(producer->reserve(quarter));
+    consumer->release(*b, quarter);
+    auto d = producer->reserve(kCapacity);
+    ASSERT_TRUE(d);
+    EXPECT_EQ(*d, 2 * kCapacity);
+}
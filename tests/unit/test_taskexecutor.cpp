@@ -0,0 +1,230 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/engine/taskexecutor.h"
+#include "execution/operationtask.h"
+#include "execution/scheduler/operationitem.h"
+#include "execution/scheduler/schedulingparam.h"
+#include "execution/scheduler/sessionitem.h"
+#include "execution/threadpool/threadpool.h"
+#include "resources/resources.h"
+#include "utils/threadutils.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace salus;
+
+namespace {
+
+class FakeTask : public OperationTask
+{
+public:
+    FakeTask(sstl::semaphore &ran, std::atomic_int &canceled)
+        : m_ran(ran)
+        , m_canceled(canceled)
+    {
+    }
+
+    std::string DebugString() const override
+    {
+        return "FakeTask";
+    }
+
+    uint64_t graphId() const override
+    {
+        return 0;
+    }
+
+    Resources estimatedUsage(const DeviceSpec &) override
+    {
+        return {};
+    }
+
+    bool hasExactEstimation(const DeviceSpec &) override
+    {
+        return true;
+    }
+
+    DeviceTypes supportedDeviceTypes() const override
+    {
+        return m_types;
+    }
+
+    int failedTimes() const override
+    {
+        return 0;
+    }
+
+    bool prepare(std::unique_ptr<ResourceContext> &&) noexcept override
+    {
+        return true;
+    }
+
+    ResourceContext &resourceContext() const override
+    {
+        std::abort();
+    }
+
+    bool isAsync() const override
+    {
+        return false;
+    }
+
+    void run(Callbacks) noexcept override
+    {
+        if (body) {
+            body();
+        }
+        m_ran.notify();
+    }
+
+    void cancel() override
+    {
+        ++m_canceled;
+    }
+
+    std::function<void()> body;
+
+private:
+    sstl::semaphore &m_ran;
+    std::atomic_int &m_canceled;
+    std::vector<DeviceType> m_types{DeviceType::CPU};
+};
+
+ThreadPoolOptions makePoolOptions()
+{
+    ThreadPoolOptions opts;
+    opts.numThreads = 2;
+    return opts;
+}
+
+class TaskExecutorBatch : public ::testing::Test
+{
+protected:
+    POpItem makeOpItem(std::function<void()> body = {})
+    {
+        auto op = std::make_unique<FakeTask>(ran, canceled);
+        op->body = std::move(body);
+
+        auto opItem = std::make_shared<OperationItem>();
+        opItem->sess = sess;
+        opItem->op = std::move(op);
+        return opItem;
+    }
+
+    sstl::semaphore ran;
+    std::atomic_int canceled{0};
+
+    ThreadPool pool{makePoolOptions()};
+    ResourceMonitor monitor;
+    SchedulingParam param;
+    TaskExecutor exec{pool, monitor, param};
+
+    PSessionItem sess = std::make_shared<SessionItem>("sess");
+};
+
+constexpr int kNumItems = 8;
+
+} // namespace
+
+TEST_F(TaskExecutorBatch, AcceptedTasksRunAfterFlush)
+{
+    TaskExecutor::SubmitBatch batch(exec);
+    for (int i = 0; i != kNumItems; ++i) {
+        EXPECT_FALSE(exec.runTask(makeOpItem()));
+    }
+    EXPECT_TRUE(batch.flush().empty());
+    ran.wait(kNumItems);
+    EXPECT_EQ(canceled.load(), 0);
+}
+
+TEST_F(TaskExecutorBatch, StoppedPoolGivesItemsBack)
+{
+    pool.stop();
+
+    std::vector<POpItem> items;
+    TaskExecutor::SubmitBatch batch(exec);
+    for (int i = 0; i != kNumItems; ++i) {
+        items.emplace_back(makeOpItem());
+        EXPECT_FALSE(exec.runTask(POpItem(items.back())));
+    }
+
+    auto rejected = batch.flush();
+    ASSERT_EQ(rejected.size(), items.size());
+    for (auto &opItem : rejected) {
+        ASSERT_TRUE(opItem);
+        EXPECT_NE(std::find(items.begin(), items.end(), opItem), items.end());
+    }
+    EXPECT_EQ(canceled.load(), 0);
+}
+
+TEST_F(TaskExecutorBatch, UnflushedRejectedItemsAreCanceled)
+{
+    pool.stop();
+    {
+        TaskExecutor::SubmitBatch batch(exec);
+        for (int i = 0; i != kNumItems; ++i) {
+            exec.runTask(makeOpItem());
+        }
+    }
+    EXPECT_EQ(canceled.load(), kNumItems);
+}
+
+TEST_F(TaskExecutorBatch, StoppedPoolGivesItemBackWithoutBatch)
+{
+    pool.stop();
+    auto opItem = makeOpItem();
+    EXPECT_EQ(exec.runTask(POpItem(opItem)), opItem);
+}
+
+TEST_F(TaskExecutorBatch, SuccessorRunsNextOnSameWorker)
+{
+    std::thread::id predecessor;
+    std::thread::id successor;
+    sstl::semaphore queued;
+    sstl::semaphore admitted;
+
+    auto second = makeOpItem([&]() { successor = std::this_thread::get_id(); });
+    auto first = makeOpItem([&]() {
+        predecessor = std::this_thread::get_id();
+        exec.queueTask(POpItem(second));
+        queued.notify();
+        // keep running until the successor is admitted
+        admitted.wait();
+    });
+    ASSERT_FALSE(exec.runTask(std::move(first)));
+
+    // stands in for the scheduler
+    queued.wait();
+    EXPECT_TRUE(second->handoff);
+    EXPECT_FALSE(exec.runTask(std::move(second)));
+    admitted.notify();
+
+    ran.wait(2);
+    EXPECT_EQ(successor, predecessor);
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright 2019 Peifeng Yu <peifeng@umich.edu>
+ * 
+ * This file is part of Salus
+ * (see https://github.com/SymbioticLab/Salus).
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "execution/threadpool/threadpool.h"
+#include "utils/threadutils.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t kNumTasks = 100;
+
+ThreadPoolOptions fakeNumaOptions(size_t numThreads, std::vector<std::vector<int>> nodes)
+{
+    ThreadPoolOptions opts;
+    opts.numThreads = numThreads;
+    opts.topology = std::make_shared<CpuTopology>(std::move(nodes));
+    return opts;
+}
+
+} // namespace
+
+TEST(ThreadPoolNuma, NodeHintWithFewerThreadsThanNodes)
+{
+    // state used by tasks outlives the pool, which joins workers when destroyed
+    sstl::semaphore done;
+    std::atomic_int ran{0};
+
+    ThreadPool pool(fakeNumaOptions(1, {{0}, {1}}));
+    ASSERT_EQ(pool.numNodes(), 2u);
+    for (uint32_t i = 0; i != kNumTasks; ++i) {
+        // node 1 has no worker at all
+        auto c = pool.tryRunOnNode([&]() {
+            ++ran;
+            done.notify();
+        }, static_cast<int>(i % 2));
+        EXPECT_FALSE(c);
+    }
+    done.wait(kNumTasks);
+    EXPECT_EQ(ran.load(), static_cast<int>(kNumTasks));
+}
+
+TEST(ThreadPoolNuma, NodeHintSkipsInactiveWorkers)
+{
+    sstl::semaphore done;
+    std::mutex mu;
+    std::set<int> threads;
+
+    // workers 0 and 2 are on node 0, workers 1 and 3 on node 1
+    ThreadPool pool(fakeNumaOptions(4, {{0, 1}, {2, 3}}));
+    pool.setActiveThreads(1);
+    ASSERT_EQ(pool.activeThreads(), 1u);
+    for (uint32_t i = 0; i != kNumTasks; ++i) {
+        pool.tryRunOnNode([&]() {
+            {
+                std::lock_guard<std::mutex> g(mu);
+                threads.insert(pool.currentThreadId());
+            }
+            done.notify();
+        }, 1);
+    }
+    done.wait(kNumTasks);
+    EXPECT_EQ(threads, std::set<int>{0});
+}
+
+TEST(ThreadPoolNuma, WorkersSpreadOverNodes)
+{
+    sstl::semaphore done;
+    std::mutex mu;
+    std::set<std::pair<int, int>> placement;
+
+    ThreadPool pool(fakeNumaOptions(4, {{0, 1}, {2, 3}}));
+    for (uint32_t i = 0; i != kNumTasks; ++i) {
+        pool.tryRunOnNode([&]() {
+            {
+                std::lock_guard<std::mutex> g(mu);
+                placement.emplace(pool.currentThreadId(), pool.currentNode());
+            }
+            done.notify();
+        }, static_cast<int>(i % 2));
+    }
+    done.wait(kNumTasks);
+    EXPECT_EQ(pool.currentNode(), -1);
+    for (auto [thread, node] : placement) {
+        EXPECT_EQ(node, thread % 2) << "thread " << thread;
+    }
+}
+
+TEST(ThreadPoolNuma, BulkNodeHintQueuesOnNode)
+{
+    constexpr int kBulk = 16;
+
+    sstl::semaphore done;
+    sstl::semaphore finished;
+    std::atomic_int offNode{0};
+    uint64_t steals = 0;
+
+    // one worker on each node
+    ThreadPool pool(fakeNumaOptions(2, {{0}, {1}}));
+    auto totalSteals = [&pool]() {
+        uint64_t n = 0;
+        for (const auto &w : pool.stats().workers) {
+            n += w.steals;
+        }
+        return n;
+    };
+
+    pool.run([&]() {
+        // Keep this worker busy, so the other one has to steal whatever is queued here
+        const auto other = 1 - pool.currentNode();
+        const auto before = totalSteals();
+
+        std::vector<ThreadPool::Closure> cs;
+        for (int i = 0; i != kBulk; ++i) {
+            cs.emplace_back([&, other]() {
+                if (pool.currentNode() != other) {
+                    ++offNode;
+                }
+                done.notify();
+            });
+        }
+        EXPECT_TRUE(pool.runBulkOnNode(cs, other));
+        EXPECT_TRUE(cs.empty());
+
+        done.wait(kBulk);
+        steals = totalSteals() - before;
+        finished.notify();
+    });
+    finished.wait();
+
+    EXPECT_EQ(offNode.load(), 0);
+    // Spread over both queues, the free worker would have to steal about half of them. It may still
+    // count a few steals from its own queue, when popping the front races with a push.
+    EXPECT_LT(steals, static_cast<uint64_t>(kBulk / 4));
+}
+
+TEST(ThreadPoolActive, StartsWorkersWhenLimitRaised)
+{
+    constexpr size_t kWorkers = 4;
+    sstl::semaphore done;
+    std::mutex mu;
+    std::condition_variable cv;
+    size_t arrived = 0;
+    std::set<int> threads;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = kWorkers;
+    opts.activeThreads = 1;
+    ThreadPool pool(opts);
+    pool.setActiveThreads(kWorkers);
+    for (size_t i = 0; i != kWorkers; ++i) {
+        pool.run([&]() {
+            {
+                // Every task waits for the others, which only works if all workers were started
+                std::unique_lock<std::mutex> l(mu);
+                threads.insert(pool.currentThreadId());
+                ++arrived;
+                cv.notify_all();
+                cv.wait_for(l, std::chrono::seconds(5), [&]() { return arrived == kWorkers; });
+            }
+            done.notify();
+        });
+    }
+    done.wait(kWorkers);
+    EXPECT_EQ(threads.size(), kWorkers);
+}
+
+TEST(ThreadPoolPost, FutureCarriesResultAcrossThreads)
+{
+    ThreadPoolOptions opts;
+    opts.numThreads = 2;
+    ThreadPool pool(opts);
+
+    const auto caller = std::this_thread::get_id();
+    auto fu = pool.post([caller]() { return std::this_thread::get_id() != caller; });
+    ASSERT_TRUE(fu.valid());
+    EXPECT_TRUE(fu.get());
+    EXPECT_FALSE(fu.valid());
+
+    // Shared states are recycled, so reuse many of them, some while still pending
+    std::vector<TaskFuture<int>> futures;
+    for (int i = 0; i != 2000; ++i) {
+        futures.push_back(pool.post([i]() { return i * 2; }));
+    }
+    for (int i = 0; i != 2000; ++i) {
+        EXPECT_EQ(futures[i].get(), i * 2);
+    }
+
+    auto failed = pool.post([]() -> int { throw std::runtime_error("task failed"); });
+    EXPECT_THROW(failed.get(), std::runtime_error);
+}
+
+TEST(ThreadPoolPost, RunsOnCallerWhenStopped)
+{
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    ThreadPool pool(opts);
+    pool.stop();
+
+    auto fu = pool.post([]() { return std::this_thread::get_id(); });
+    EXPECT_TRUE(fu.ready());
+    EXPECT_EQ(fu.get(), std::this_thread::get_id());
+}
+
+TEST(ThreadPoolNext, SuccessorRunsOnSameWorkerBeforeQueuedWork)
+{
+    // Declared before the pool, which joins workers still inside notify
+    sstl::semaphore blocked;
+    sstl::semaphore release;
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 2;
+    ThreadPool pool(opts);
+
+    // Keep one worker busy, so only the worker running the predecessor is left
+    pool.run([&]() {
+        blocked.notify();
+        release.wait();
+    });
+    blocked.wait();
+
+    std::atomic_int seq{0};
+    int queuedSeq = -1;
+    int successorSeq = -1;
+    std::thread::id predecessor;
+    std::thread::id successor;
+    pool.run([&]() {
+        predecessor = std::this_thread::get_id();
+        pool.runNext([&]() {
+            successor = std::this_thread::get_id();
+            successorSeq = seq++;
+            release.notify();
+            done.notify();
+        });
+        // queued later, so it would come first from the worker's LIFO queue end
+        pool.run([&]() {
+            queuedSeq = seq++;
+            done.notify();
+        });
+    });
+
+    done.wait(2);
+    EXPECT_EQ(successor, predecessor);
+    EXPECT_LT(successorSeq, queuedSeq);
+}
+
+TEST(ThreadPoolPriority, HigherLevelsRunFirst)
+{
+    sstl::semaphore blocked;
+    sstl::semaphore release;
+    sstl::semaphore done;
+    std::mutex mu;
+    std::vector<ThreadPool::Priority> order;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    opts.starvationLimit = 0;
+    ThreadPool pool(opts);
+
+    // Hold the only worker, so all levels are queued before it picks any
+    pool.run([&]() {
+        blocked.notify();
+        release.wait();
+    });
+    blocked.wait();
+
+    using P = ThreadPool::Priority;
+    for (auto p : {P::Low, P::Normal, P::High, P::Low, P::Normal, P::High}) {
+        pool.run(
+            [&, p]() {
+                {
+                    std::lock_guard<std::mutex> g(mu);
+                    order.push_back(p);
+                }
+                done.notify();
+            },
+            p);
+    }
+
+    // Work submitted without an explicit priority takes the one of the enclosing scope
+    {
+        ThreadPool::PriorityScope scope(P::High);
+        EXPECT_EQ(ThreadPool::currentPriority(), P::High);
+        pool.run([&]() {
+            {
+                std::lock_guard<std::mutex> g(mu);
+                order.push_back(P::High);
+            }
+            done.notify();
+        });
+    }
+    EXPECT_EQ(ThreadPool::currentPriority(), P::Normal);
+
+    release.notify();
+    done.wait(7);
+    std::lock_guard<std::mutex> g(mu);
+    EXPECT_EQ(order, (std::vector<P>{P::High, P::High, P::High, P::Normal, P::Normal, P::Low, P::Low}));
+}
+
+TEST(ThreadPoolPriority, AgingRunsLowLevelWithinStarvationLimit)
+{
+    constexpr int kLimit = 4;
+    constexpr int kHigh = 12;
+
+    sstl::semaphore blocked;
+    sstl::semaphore release;
+    sstl::semaphore done;
+    std::atomic_int seq{0};
+    int lowSeq = -1;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    opts.starvationLimit = kLimit;
+    ThreadPool pool(opts);
+
+    pool.run([&]() {
+        blocked.notify();
+        release.wait();
+    });
+    blocked.wait();
+
+    // Without aging the low priority task would run after all the high priority ones
+    pool.run(
+        [&]() {
+            lowSeq = seq++;
+            done.notify();
+        },
+        ThreadPool::Priority::Low);
+    for (int i = 0; i != kHigh; ++i) {
+        pool.run(
+            [&]() {
+                seq++;
+                done.notify();
+            },
+            ThreadPool::Priority::High);
+    }
+
+    release.notify();
+    done.wait(kHigh + 1);
+    EXPECT_GE(lowSeq, 0);
+    EXPECT_LT(lowSeq, kLimit);
+}
+
+TEST(ThreadPoolSpin, CountsHitsWhenWorkArrivesWhileSpinning)
+{
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    // Far longer than the gap between tasks, so the worker is still spinning when the next one arrives
+    opts.spinCount = opts.minSpinCount = opts.maxSpinCount = 1 << 22;
+    ThreadPool pool(opts);
+
+    for (int i = 0; i != 10; ++i) {
+        pool.run([&]() { done.notify(); });
+        done.wait();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto stats = pool.spinStats();
+    EXPECT_GT(stats.spinHits, 0u);
+
+    // Cut the last spin short
+    pool.stop();
+}
+
+TEST(ThreadPoolSpin, ZeroSpinLimitParksRightAway)
+{
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    // maxSpinCount bounds the budget even though spinning is allowed
+    opts.allowSpinning = true;
+    opts.spinCount = 1000;
+    opts.maxSpinCount = 0;
+    // Count every park as short, which would grow the budget if not bounded
+    opts.shortParkUs = 60 * 1000 * 1000;
+    ThreadPool pool(opts);
+
+    for (int i = 0; i != 5; ++i) {
+        pool.run([&]() { done.notify(); });
+        done.wait();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    auto stats = pool.spinStats();
+    EXPECT_EQ(stats.spinHits, 0u);
+    EXPECT_EQ(stats.spinMisses, 0u);
+    EXPECT_GT(stats.parks, 0u);
+    EXPECT_EQ(stats.shortParks, stats.parks);
+}
+
+TEST(ThreadPoolSpin, CountsMissesBeforeParking)
+{
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    opts.spinCount = opts.minSpinCount = opts.maxSpinCount = 10;
+    opts.shortParkUs = 0;
+    ThreadPool pool(opts);
+
+    for (int i = 0; i != 5; ++i) {
+        pool.run([&]() { done.notify(); });
+        done.wait();
+        // Far longer than spinning 10 times, so the worker parks in between
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    auto stats = pool.spinStats();
+    EXPECT_GT(stats.spinMisses, 0u);
+    EXPECT_GT(stats.parks, 0u);
+    EXPECT_EQ(stats.shortParks, 0u);
+}
+
+TEST(ThreadPoolStats, CountsOverflowParksAndDurations)
+{
+    // More than a per-thread queue holds
+    constexpr int kTasks = 1100;
+    constexpr auto kHold = std::chrono::milliseconds(10);
+
+    sstl::semaphore blocked;
+    sstl::semaphore release;
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    opts.allowSpinning = false;
+    ThreadPool pool(opts);
+
+    // Let the worker park before the first task
+    std::this_thread::sleep_for(kHold);
+    pool.run([&]() {
+        blocked.notify();
+        release.wait();
+        std::this_thread::sleep_for(kHold);
+    });
+    blocked.wait();
+    for (int i = 0; i != kTasks; ++i) {
+        pool.run([&]() { done.notify(); });
+    }
+    release.notify();
+    done.wait(kTasks);
+
+    // Counters of the last task are updated after it returns
+    auto stats = pool.stats();
+    for (int i = 0; i != 1000 && stats.workers[0].tasks != kTasks + 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stats = pool.stats();
+    }
+
+    ASSERT_EQ(stats.workers.size(), 1u);
+    const auto &w = stats.workers[0];
+    EXPECT_EQ(w.tasks, static_cast<uint64_t>(kTasks + 1));
+    EXPECT_GT(stats.overflowPushes, 0u);
+    EXPECT_EQ(w.overflowPops, stats.overflowPushes);
+    EXPECT_EQ(w.steals, 0u);
+    EXPECT_GT(w.parks, 0u);
+    EXPECT_GT(w.parkNs, 0u);
+
+    EXPECT_EQ(w.runTimeUs.count(), w.tasks);
+    EXPECT_EQ(w.queueWaitUs.count(), w.tasks);
+    const auto holdUs = static_cast<uint64_t>(std::chrono::microseconds(kHold).count());
+    // The blocker ran and the first queued tasks waited for at least kHold
+    EXPECT_GE(w.runTimeUs.quantileUpperBound(1.0), holdUs);
+    EXPECT_GE(w.queueWaitUs.quantileUpperBound(1.0), holdUs);
+    EXPECT_GE(w.runNs, static_cast<uint64_t>(std::chrono::nanoseconds(kHold).count()));
+}
+
+TEST(ThreadPoolStats, CountsSteals)
+{
+    constexpr int kTasks = 10;
+
+    sstl::semaphore done;
+    sstl::semaphore finished;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 2;
+    ThreadPool pool(opts);
+
+    // Work queued by a worker that then blocks can only be run by stealing it
+    pool.run([&]() {
+        for (int i = 0; i != kTasks; ++i) {
+            pool.run([&]() { done.notify(); });
+        }
+        done.wait(kTasks);
+        finished.notify();
+    });
+    finished.wait();
+
+    uint64_t steals = 0;
+    for (const auto &w : pool.stats().workers) {
+        steals += w.steals;
+    }
+    EXPECT_GE(steals, static_cast<uint64_t>(kTasks));
+}
+
+TEST(ThreadPoolStats, EmptyWithoutCollecting)
+{
+    sstl::semaphore done;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 2;
+    opts.collectStats = false;
+    ThreadPool pool(opts);
+
+    pool.run([&]() { done.notify(); });
+    done.wait();
+    EXPECT_TRUE(pool.stats().workers.empty());
+}
+
+TEST(ThreadPoolBlocking, SpareRunsWorkWhileWorkerBlocks)
+{
+    sstl::semaphore ran;
+    sstl::semaphore finished;
+
+    ThreadPoolOptions opts;
+    opts.numThreads = 1;
+    opts.spareIdleTimeoutMs = 10;
+    ThreadPool pool(opts);
+
+    // Outside of a worker, the scope does nothing
+    {
+        ThreadPool::BlockingScope scope(pool);
+    }
+    EXPECT_EQ(pool.stats().blockingRegions, 0u);
+
+    // The only worker waits for work queued behind it, which deadlocks without a spare
+    pool.run([&]() {
+        pool.run([&]() { ran.notify(); });
+        {
+            ThreadPool::BlockingScope scope(pool);
+            ran.wait();
+        }
+        finished.notify();
+    });
+    finished.wait();
+
+    auto stats = pool.stats();
+    EXPECT_EQ(stats.blockingRegions, 1u);
+    EXPECT_EQ(stats.sparesStarted, 1u);
+
+    // The spare exits once idle
+    for (int i = 0; i != 1000 && stats.sparesRetired != stats.sparesStarted; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stats = pool.stats();
+    }
+    EXPECT_EQ(stats.sparesRetired, stats.sparesStarted);
+}